@@ -2,11 +2,19 @@
 #define ALMGR_H
 
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <time.h>
 
 /********************************************************************************
  * ALMgr - Access List manager, basically reads from a text document to find the
  *         IP address given. If it's a whitelist, then returns true for allowed
  *         if found and opposite for blacklists
+ *
+ *         Entries are single IPv4 addresses or CIDR blocks (10.0.0.0/8), one per
+ *         line. The list is kept in memory as sorted, merged address ranges and is
+ *         only re-read when the file's modification time (or size) changes, so a
+ *         lookup is a stat plus a binary search.
  ********************************************************************************/
 
 class ALMgr {
@@ -17,10 +25,25 @@ class ALMgr {
       bool isAllowed(const char *ipaddr);
       bool isAllowed(unsigned long ipaddr);
 
+      // Re-reads the file if it has changed since the last load
+      void refresh();
+
    private:
+      // Reads and parses the file into _ranges
+      void loadList();
+
       std::string _al_file;
 
       bool _is_whitelist;
+
+      // Address ranges in host byte order (first, last), sorted and non-overlapping
+      std::vector<std::pair<uint32_t, uint32_t>> _ranges;
+
+      // File state at the last load, to detect changes
+      bool _loaded = false;
+      timespec _mtime;
+      off_t _size = 0;
+      ino_t _inode = 0;
 };
 
 #endif // ALMGR_H
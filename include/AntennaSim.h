@@ -1,7 +1,6 @@
 #ifndef ANTENNASIM_H
 #define ANTENNASIM_H
 
-#include <list>
 #include <unistd.h>
 #include "exceptions.h"
 #include "DronePlotDB.h"
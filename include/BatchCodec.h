@@ -0,0 +1,38 @@
+#ifndef BATCHCODEC_H
+#define BATCHCODEC_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/********************************************************************************************
+ * BatchCodec - compact wire encoding for replication batches. A batch is normally the plot
+ *              count followed by packed plot records (see DronePlotDB.h). Within a batch the
+ *              IDs repeat, timestamps climb slowly and each drone's position moves only a
+ *              little between plots, so the compressed form stores the batch by column:
+ *
+ *                 <version><count>
+ *                 <drone IDs> <node IDs> <timestamps> <latitudes> <longitudes>
+ *
+ *              The count and every column value are LEB128 varints. IDs and timestamps are
+ *              zigzag deltas from the previous record. Latitude and longitude are zigzag
+ *              deltas of the float bits from the same drone's previous plot in the batch (the
+ *              previous record's for a drone's first plot), which keeps the exponent and high
+ *              mantissa bits out of the stream.
+ *
+ *              Decoding is a single pass over the stream, each column written straight into
+ *              the packed records.
+ ********************************************************************************************/
+
+// Version byte at the front of a compressed batch
+const uint8_t batch_codec_version = 1;
+
+// Compresses a batch (<count><packed plot records>), appending it to out
+//    Throws: runtime_error if the batch size does not match its count
+void compressBatch(const std::vector<uint8_t> &batch, std::vector<uint8_t> &out);
+
+// Expands a compressed batch back into <count><packed plot records> in batch. Returns false
+// if the data is malformed (truncated, trailing bytes, or an unknown version)
+bool decompressBatch(const uint8_t *data, size_t len, std::vector<uint8_t> &batch);
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <deque>
+#include <cstddef>
+#include <utility>
+#include <pthread.h>
+
+/********************************************************************************************
+ * BoundedQueue - blocking FIFO for handing work between threads. push blocks while the queue
+ *                is at capacity, which throttles a fast producer to the speed of its consumers
+ *                instead of letting memory grow; pop blocks while it is empty. Any number of
+ *                threads can push and pop.
+ *
+ *                close() ends the queue: pushes are refused, and once the items already in it
+ *                are drained pop returns false so consumer threads can exit.
+ ********************************************************************************************/
+
+template <class T>
+class BoundedQueue
+{
+public:
+   BoundedQueue(size_t capacity);
+   ~BoundedQueue();
+
+   // Adds an item, waiting for room. Returns false (item untouched) if the queue is closed
+   bool push(T &item);
+
+   // Takes the oldest item, waiting for one. Returns false once closed and empty
+   bool pop(T &item);
+
+   // Wakes all waiting threads and refuses further pushes
+   void close();
+
+   size_t size();
+
+private:
+   std::deque<T> _items;
+   size_t _capacity;
+   bool _closed;
+
+   pthread_mutex_t _mutex;
+   pthread_cond_t _not_empty;
+   pthread_cond_t _not_full;
+};
+
+template <class T>
+BoundedQueue<T>::BoundedQueue(size_t capacity):_capacity(capacity > 0 ? capacity : 1),
+                                               _closed(false)
+{
+   pthread_mutex_init(&_mutex, NULL);
+   pthread_cond_init(&_not_empty, NULL);
+   pthread_cond_init(&_not_full, NULL);
+}
+
+template <class T>
+BoundedQueue<T>::~BoundedQueue() {
+   pthread_cond_destroy(&_not_full);
+   pthread_cond_destroy(&_not_empty);
+   pthread_mutex_destroy(&_mutex);
+}
+
+/**********************************************************************************************
+ * push - moves item onto the back of the queue, blocking while the queue is full
+ *
+ *    Returns: true if queued, false if the queue was closed
+ **********************************************************************************************/
+
+template <class T>
+bool BoundedQueue<T>::push(T &item) {
+   pthread_mutex_lock(&_mutex);
+
+   while ((_items.size() >= _capacity) && !_closed)
+      pthread_cond_wait(&_not_full, &_mutex);
+
+   if (_closed) {
+      pthread_mutex_unlock(&_mutex);
+      return false;
+   }
+
+   _items.push_back(std::move(item));
+
+   pthread_cond_signal(&_not_empty);
+   pthread_mutex_unlock(&_mutex);
+   return true;
+}
+
+/**********************************************************************************************
+ * pop - moves the front item into item, blocking while the queue is empty
+ *
+ *    Returns: true if an item was taken, false if the queue is closed and empty
+ **********************************************************************************************/
+
+template <class T>
+bool BoundedQueue<T>::pop(T &item) {
+   pthread_mutex_lock(&_mutex);
+
+   while (_items.empty() && !_closed)
+      pthread_cond_wait(&_not_empty, &_mutex);
+
+   if (_items.empty()) {
+      pthread_mutex_unlock(&_mutex);
+      return false;
+   }
+
+   item = std::move(_items.front());
+   _items.pop_front();
+
+   pthread_cond_signal(&_not_full);
+   pthread_mutex_unlock(&_mutex);
+   return true;
+}
+
+template <class T>
+void BoundedQueue<T>::close() {
+   pthread_mutex_lock(&_mutex);
+   _closed = true;
+   pthread_cond_broadcast(&_not_empty);
+   pthread_cond_broadcast(&_not_full);
+   pthread_mutex_unlock(&_mutex);
+}
+
+template <class T>
+size_t BoundedQueue<T>::size() {
+   pthread_mutex_lock(&_mutex);
+   size_t n = _items.size();
+   pthread_mutex_unlock(&_mutex);
+   return n;
+}
+
+#endif
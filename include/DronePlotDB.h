@@ -1,35 +1,103 @@
 #ifndef DRONEPLOTDB_H
 #define DRONEPLOTDB_H
 
-#include <list>
 #include <vector>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <iterator>
+#include <cstdint>
+#include <atomic>
 #include <unistd.h>
 #include <pthread.h>
 #include "exceptions.h"
+#include "SPSCRing.h"
 
 
 // Flags for the DronePlot object. The first two are already coded in and
 // you can define more. It's based off bitwise and/or operations so just
 // create a new one up to 0x128 
 #define DBFLAG_NEW      0x1   // Was newly added to the database
-#define DBFLAG_SYNCD    0x2   // Has been sync'd
+#define DBFLAG_SYNCD    0x2   // Has been sync'd (set by takePending)
 #define DBFLAG_USER1    0x4   // Change as needed
 #define DBFLAG_USER2    0x8   // Change as needed
 #define DBFLAG_USER3    0x16  // Change as needed
 #define DBFLAG_USER4    0x32
+#define DBFLAG_ERASED   0x80  // Internal: the slot was erased and is skipped by iterators
 
-// Manages the drone plot database for a particular node.
+// Handle to a plot stored in a DronePlotDB. Handles stay valid until the plot is erased, the
+// database is cleared, or sortByTime reorders the store.
+typedef size_t plot_handle;
+const plot_handle invalid_plot = static_cast<plot_handle>(-1);
+
+// Packed record layout of a serialized plot, used for binary files and replication batches
+// (native byte order): drone_id (4), node_id (4), timestamp (8), latitude (4), longitude (4)
+const size_t plot_rec_size = 24;
+const size_t rec_drone_id = 0;
+const size_t rec_node_id = 4;
+const size_t rec_timestamp = 8;
+const size_t rec_latitude = 16;
+const size_t rec_longitude = 20;
+
+// Duplicate detection defaults: plots from different nodes are the same sighting if they are for
+// the same drone, no more than one grid size apart in latitude and in longitude, and no further
+// apart in time than the worst clock skew between sites
+const float dedup_grid_size = 0.00001;    // Degrees (roughly one meter)
+const time_t dedup_time_window = 5;       // Seconds
+
+// Plots submitPlot can hold before they are moved into the store (see submitPlot)
+const size_t submit_ring_size = 4096;
+
+// Plots per storage chunk (a power of two) - handle h is slot h & plot_chunk_mask of chunk
+// h >> plot_chunk_bits
+const size_t plot_chunk_bits = 12;
+const size_t plot_chunk_size = static_cast<size_t>(1) << plot_chunk_bits;
+const size_t plot_chunk_mask = plot_chunk_size - 1;
+
+// Plots are grouped into time segments: a plot segment_duration (seconds) or more newer than the
+// first plot in the current segment starts a new one, so old data can be dropped a segment at a
+// time. Segments are runs of handles laid over the chunks, so starting one uses no slots
+const time_t segment_duration = 60;
+
+// Time ordering switches from merging the node runs to a radix sort of every plot's timestamp
+// once the runs are this fragmented (a loaded file or merged replay) and the store this large
+const size_t radix_sort_min_runs = 64;
+const size_t radix_sort_min_plots = 1 << 16;
+
+// A fixed block of plot storage, one array per attribute. Chunks never move once allocated,
+// and are shared between the database and its snapshots until the database needs to change
+// a plot in one (then it copies the chunk first)
+struct PlotChunk {
+   unsigned int drone_id[plot_chunk_size];
+   unsigned int node_id[plot_chunk_size];
+   time_t timestamp[plot_chunk_size];
+   float latitude[plot_chunk_size];
+   float longitude[plot_chunk_size];
+   unsigned short flags[plot_chunk_size];
+};
+
+typedef std::vector<std::shared_ptr<PlotChunk>> plot_chunk_dir;
+
+class DronePlotDB;
+
+// A single drone plot as a plain value. The database does not store these objects directly
+// (see DronePlotDB), but they are used to build, parse and serialize individual plots.
 class DronePlot
 {
 public:
    DronePlot();
    DronePlot(int in_droneid, int in_nodeid, int in_timestamp, float in_latitude, float in_longitude);
-   virtual ~DronePlot();
+   ~DronePlot();
 
    // Function to serialize, or convert this data into a binary stream in a vector class and back
    void serialize(std::vector<uint8_t> &buf);
    void deserialize(std::vector<uint8_t> &buf, unsigned int start_pt = 0);
 
+   // Same as above, but to/from a plot_rec_size record in raw memory
+   void encode(uint8_t *rec) const;
+   void decode(const uint8_t *rec);
+
    // Reads and writes this plot to/from a buffer in comma-separated format
    int readCSV(std::string &buf);
    void writeCSV(std::string &buf);
@@ -53,11 +121,173 @@ private:
 
 };
 
+/**************************************************************************************************
+ * DronePlotRef - a proxy to a plot stored in DronePlotDB. The attribute members stand in for the
+ *                database columns, so it reads like the old DronePlot list entries
+ *                (dpit->timestamp, dpit->setFlags(...)). The attributes are read only, as the
+ *                tracks, runs, segments and duplicate index are keyed on them - change a plot
+ *                with DronePlotDB::updatePlot or shiftTimestamps. Reads go straight to the
+ *                chunk; only setFlags and clrFlags copy the chunk first if a snapshot shares
+ *                it, so walking the database does not copy anything. Like the
+ *                live iterators it is meant for the thread that owns the database or holds its
+ *                mutex; other threads read through DronePlotSnapshot. Do not hold one across a
+ *                call that erases or re-sorts plots.
+ **************************************************************************************************/
+class DronePlotRef
+{
+public:
+   DronePlotRef(DronePlotDB &db, plot_handle handle);
+
+   // One attribute of the plot, reading as a T
+   template <class T, T (PlotChunk::*Column)[plot_chunk_size]>
+   class Field
+   {
+   public:
+      Field(DronePlotDB &db, plot_handle handle):_db(db),_handle(handle) {};
+
+      operator T() const { return (readChunk(_db, _handle).*Column)[_handle & plot_chunk_mask]; };
+
+   private:
+      DronePlotDB &_db;
+      plot_handle _handle;
+   };
+
+   // Same interface as DronePlot
+   void serialize(std::vector<uint8_t> &buf) const;
+   void writeCSV(std::string &buf) const;
+
+   void setFlags(unsigned short flags);
+   void clrFlags(unsigned short flags);
+   bool isFlagSet(unsigned short flags) const;
+
+   // Copies the referenced plot out into a standalone DronePlot
+   DronePlot getPlot() const;
+
+   plot_handle getHandle() const { return _handle; };
+
+   // Lets iterators return the proxy by value from operator->
+   DronePlotRef *operator->() { return this; };
+
+   Field<unsigned int, &PlotChunk::drone_id> drone_id;
+   Field<unsigned int, &PlotChunk::node_id> node_id;
+   Field<time_t, &PlotChunk::timestamp> timestamp;
+   Field<float, &PlotChunk::latitude> latitude;
+   Field<float, &PlotChunk::longitude> longitude;
+
+private:
+   // The chunk holding a plot, to read from or (unshared from snapshots) to write to
+   static const PlotChunk &readChunk(DronePlotDB &db, plot_handle handle);
+   static PlotChunk &writeChunk(DronePlotDB &db, plot_handle handle);
+
+   DronePlotDB &_db;
+   plot_handle _handle;
+};
+
+/**************************************************************************************************
+ * DronePlotSnapshot - an immutable view of a DronePlotDB as it was when DronePlotDB::snapshot was
+ *                     called. It shares the database's chunks instead of copying them, and the
+ *                     database copies a chunk before changing a plot a snapshot can see, so a
+ *                     snapshot can be read from any thread without the mutex while the database
+ *                     keeps taking plots. Memory is released when the last snapshot using it goes.
+ **************************************************************************************************/
+class DronePlotSnapshot
+{
+public:
+   DronePlotSnapshot();   // Empty
+
+   // Walks the live plots of the snapshot in storage order, giving copies of each plot
+   class iterator
+   {
+   public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef DronePlot value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const DronePlot *pointer;
+      typedef DronePlot reference;
+
+      iterator():_snap(NULL),_pos(0) {};
+      iterator(const DronePlotSnapshot *snap, plot_handle pos);
+
+      DronePlot operator*() const { return _snap->getPlot(_pos); };
+
+      iterator &operator++();
+      iterator operator++(int);
+
+      bool operator==(const iterator &other) const { return _pos == other._pos; };
+      bool operator!=(const iterator &other) const { return _pos != other._pos; };
+
+      plot_handle getHandle() const { return _pos; };
+
+   private:
+      void skipErased();
+
+      const DronePlotSnapshot *_snap;
+      plot_handle _pos;
+   };
+
+   iterator begin() const { return iterator(this, _head); };
+   iterator end() const { return iterator(this, _slots); };
+
+   // Number of live plots, and of slots (handles below this may be valid)
+   size_t size() const { return _live; };
+   size_t getSlotCount() const { return _slots; };
+
+   bool isValid(plot_handle handle) const;
+
+   // Attribute access by handle (handle must be below getSlotCount)
+   unsigned int getDroneID(plot_handle h) const { return chunkOf(h).drone_id[h & plot_chunk_mask]; };
+   unsigned int getNodeID(plot_handle h) const { return chunkOf(h).node_id[h & plot_chunk_mask]; };
+   time_t getTimestamp(plot_handle h) const { return chunkOf(h).timestamp[h & plot_chunk_mask]; };
+   float getLatitude(plot_handle h) const { return chunkOf(h).latitude[h & plot_chunk_mask]; };
+   float getLongitude(plot_handle h) const { return chunkOf(h).longitude[h & plot_chunk_mask]; };
+   unsigned short getFlags(plot_handle h) const { return chunkOf(h).flags[h & plot_chunk_mask]; };
+
+   // Copies a plot out (flags not copied)
+   DronePlot getPlot(plot_handle handle) const;
+
+private:
+   friend class DronePlotDB;
+
+   DronePlotSnapshot(std::shared_ptr<const plot_chunk_dir> chunks, size_t slots, plot_handle head,
+                                                                                     size_t live);
+
+   const PlotChunk &chunkOf(plot_handle h) const { return *(*_chunks)[h >> plot_chunk_bits]; };
+
+   std::shared_ptr<const plot_chunk_dir> _chunks;
+   size_t _slots;
+   plot_handle _head;
+   size_t _live;
+};
+
 
 /**************************************************************************************************
  * DronePlotDB - class to manage a database of DronePlot objects, which manage drone GPS plots that
  *               are "received" by the antenna or another replication server
  *
+ *               Plots are stored as a structure of arrays (one array per attribute) in fixed
+ *               size chunks, so scans touch only the columns they need and growing the store
+ *               never moves existing plots. Erased plots leave a DBFLAG_ERASED slot behind,
+ *               which keeps every other handle stable.
+ *
+ *               Readers on other threads take a snapshot() rather than iterating the live store.
+ *               Taking one is O(1); the writer only pays when it changes a plot a snapshot can
+ *               see, by copying that chunk (and the chunk directory) once per snapshot.
+ *
+ *               The store is also divided into time segments (see segment_duration), runs of
+ *               consecutive handles with tracked time bounds and live counts, so retention
+ *               drops whole segments (releasing the chunks behind them) and time range
+ *               queries skip segments that cannot match.
+ *
+ *               Every plot is also indexed in its drone's track, a time-ordered series of
+ *               handles kept up to date on insert and erase, so per-drone questions are a
+ *               binary search instead of a scan. Plots are also kept in sorted runs per
+ *               source node (each node's plots arrive nearly in time order, so a node rarely
+ *               has more than one run), and time ordered output is a k-way merge of the runs.
+ *
+ *               The antenna feeds plots in through a lock-free ring (submitPlot) instead of
+ *               taking the mutex for each one. Whoever next takes the mutex moves them into
+ *               the store, so every mutex'd call sees them.
+ *
  **************************************************************************************************/
 class DronePlotDB 
 {
@@ -65,18 +295,93 @@ public:
    DronePlotDB();
    virtual ~DronePlotDB();
 
-   // Add a plot to the database with the given attributes (mutex'd)
-   void addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude);
+   /**********************************************************************************************
+    * iterator - walks the live plots in storage order, skipping erased slots. Dereferencing gives
+    *            a DronePlotRef proxy, so dpit->latitude and dpit->setFlags() work as before.
+    **********************************************************************************************/
+   class iterator
+   {
+   public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef DronePlotRef value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef DronePlotRef pointer;
+      typedef DronePlotRef reference;
+
+      iterator():_db(NULL),_pos(0),_seg(0) {};
+      iterator(DronePlotDB *db, plot_handle pos);
+
+      DronePlotRef operator*() const { return DronePlotRef(*_db, _pos); };
+      DronePlotRef operator->() const { return DronePlotRef(*_db, _pos); };
+
+      iterator &operator++();
+      iterator operator++(int);
 
-   // Load or write the database to/from a CSV file, 
+      bool operator==(const iterator &other) const { return _pos == other._pos; };
+      bool operator!=(const iterator &other) const { return _pos != other._pos; };
+
+      plot_handle getHandle() const { return _pos; };
+
+   private:
+      // Moves forward to the next live slot (or the end of the store)
+      void skipErased();
+
+      DronePlotDB *_db;
+      plot_handle _pos;
+      size_t _seg;         // Segment holding _pos
+   };
+
+   // Add a plot to the database with the given attributes (mutex'd). Returns the new plot's handle,
+   // or invalid_plot if the duplicate index is enabled and the plot was rejected as a duplicate
+   plot_handle addPlot(int drone_id, int node_id, time_t timestamp, float lattitude, float longitude,
+                                                                     unsigned short flags = 0);
+
+   // Same as addPlot but does not wait on the mutex - the plot and its flags go into the submit
+   // ring and are added the next time any thread locks the database (the DB's notify eventfd is
+   // signaled so the replication loop takes them promptly). Only one thread may call this. If
+   // the ring is full it falls back to addPlot
+   void submitPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude,
+                                                                     unsigned short flags = 0);
+
+   // Load or write the database to/from a CSV file. With time_order the file is written in
+   // timestamp order (as after sortByTime) without reordering the store
    int loadCSVFile(const char *filename);
-   int writeCSVFile(const char *filename);
+   int writeCSVFile(const char *filename, bool time_order = false);
+
+   // Handles of the live plots in timestamp order, equal timestamps in insertion order. A merge
+   // of the per-node runs, O(n log k) for k runs (mutex'd)
+   void getTimeOrder(std::vector<plot_handle> &order);
 
    // Direct binary load/write to/from the specified file
    int loadBinaryFile(const char *filename);
    int writeBinaryFile(const char *filename);
+
+   // Batch encode/decode of packed plot records (plot_rec_size bytes each). encodePlots writes
+   // count records to out and does not lock the mutex. addPlotBatch locks once for the whole
+   // batch and returns how many plots were added (duplicates are dropped if the index is on)
+   void encodePlots(const plot_handle *handles, size_t count, uint8_t *out);
+   size_t addPlotBatch(const uint8_t *data, size_t count, unsigned short flags = 0);
+
+   // Plots added with DBFLAG_NEW are logged as they are inserted. takePending hands back the
+   // logged plots that are still live and still flagged new (swapping the flag for
+   // DBFLAG_SYNCD) and empties the log, so collecting new plots costs O(new plots) rather than
+   // a scan of the whole store. Does not lock the mutex
+   void takePending(std::vector<plot_handle> &handles);
+
+   // Collects up to max_count live DBFLAG_SYNCD plots from first through last (already taken by
+   // takePending, e.g. to send again) and returns the handle to carry on from. Does not lock
+   // the mutex
+   plot_handle collectSynced(plot_handle first, plot_handle last, size_t max_count,
+                                                      std::vector<plot_handle> &handles);
+   size_t getPendingCount();   // mutex'd
+
+   // Wakeup for a consumer of the pending log (the replication loop) - an eventfd signaled when
+   // the log goes from empty to holding plots, and again when it reaches the threshold. Created
+   // on first call, so a database nobody watches makes no system calls
+   int getNotifyFD();
+   void setNotifyThreshold(size_t plots) { _notify_threshold = plots; };
    
-   // Sort the database in order of timestamp 
+   // Sort the database in order of timestamp. This reorders the store, invalidating all handles
    void sortByTime();
 
    // Remove all plotpoints of a particular node (used to generate binary, not for student use)
@@ -84,17 +389,66 @@ public:
 
    // Iterators for simple access to the database. Can use these to modify drone plot points
    // but won't be able to add/delete PlotObjects. Use erase (below) for that as it is mutex'd
-   std::list<DronePlot>::iterator begin() { return _dbdata.begin(); };
-   std::list<DronePlot>::iterator end() { return _dbdata.end(); };
+   iterator begin() { return iterator(this, _head); };
+   iterator end() { return iterator(this, _size); };
+
+   // Direct access to a plot by handle. Not mutex'd - for the thread that owns the database or
+   // holds its mutex
+   DronePlotRef getPlot(plot_handle handle) { return DronePlotRef(*this, handle); };
+   bool isValid(plot_handle handle);
+
+   // Consistent read-only view of the database as it is now, safe to read from any thread
+   // without blocking the writer (mutex'd, O(1))
+   DronePlotSnapshot snapshot();
+
+   // Retention - drops the oldest whole segments holding only plots older than cutoff, returns
+   // the number of plots dropped (mutex'd)
+   size_t dropSegmentsBefore(time_t cutoff);
+
+   // Appends the handles of live plots timestamped from start to end inclusive (mutex'd)
+   void findInTimeRange(time_t start, time_t end, std::vector<plot_handle> &handles);
+
+   // Track queries (mutex'd, O(log n) in the drone's track length). getLastPosition gives the
+   // drone's newest plot, getPositionAt its newest plot at or before time t. Both return false
+   // if there is no such plot. getTrack appends the handles of the drone's plots from start to
+   // end inclusive, in time order
+   bool getLastPosition(unsigned int drone_id, DronePlot &plot);
+   bool getPositionAt(unsigned int drone_id, time_t t, DronePlot &plot);
+   void getTrack(unsigned int drone_id, time_t start, time_t end, std::vector<plot_handle> &handles);
    
    // Manipulate database entries (mutex'd functions)
    void popFront();
    void erase(unsigned int i);
-   std::list<DronePlot>::iterator erase(std::list<DronePlot>::iterator dptr);
+   iterator erase(iterator dptr);
+   void erasePlot(plot_handle handle);
+
+   // Same as erasePlot, but a handle that is no longer in the database is ignored. Returns true
+   // if the plot was erased
+   bool eraseIfValid(plot_handle handle);
+
+   // Replaces a stored plot's attributes (its flags are kept), moving it in its track, runs and
+   // the duplicate index to match. Throws runtime_error if the handle is not in the database
+   void updatePlot(plot_handle handle, const DronePlot &plot);
+
+   // Adds offset to every stored plot's timestamp, indexes included (O(n))
+   void shiftTimestamps(time_t offset);
 
 
    // Return the number of plot points stored
-   size_t size() { return _dbdata.size(); };
+   size_t size() { return _live; };
+
+   // Turns on the incremental duplicate index. From then on every insert is checked against the
+   // index in O(1) expected time and duplicates are dropped instead of stored (mutex'd)
+   void enableDedup(float grid_size = dedup_grid_size, time_t time_window = dedup_time_window);
+   bool isDedupEnabled() { return _dedup_enabled; };
+
+   // Number of plots rejected by the duplicate index so far
+   size_t getDuplicateCount() { return _dup_count; };
+
+   // Single hashed pass over a snapshot of the store, collecting the handles of plots that
+   // duplicate an earlier plot. Works whether or not the index is enabled. Only holds the mutex
+   // to take the snapshot
+   void findDuplicates(std::vector<plot_handle> &dups);
 
     // Added: Andrew Davis
     void lockMutex();
@@ -104,7 +458,178 @@ public:
    void clear();
 
 private:
-   std::list<DronePlot> _dbdata;
+   friend class DronePlotRef;
+   friend class DronePlotSnapshot;
+
+   // Appends a plot to the columns without locking
+   plot_handle appendPlot(const DronePlot &plot, unsigned short flags);
+
+   // Appends count packed plot records to the columns without locking
+   size_t appendRecords(const uint8_t *data, size_t count, unsigned short flags);
+
+   // Locks the mutex and moves any submitted plots into the store
+   void lockStore();
+
+   // Appends everything waiting in the submit ring, in submission order. Mutex must be held
+   void drainSubmitted();
+
+   // Writes the notify eventfd, if there is one
+   void wakeConsumer();
+
+   // Reserves directory room for n slots
+   void reserveColumns(size_t n);
+
+   // Chunk holding a handle, for reading
+   PlotChunk &chunkOf(plot_handle h) { return *(*_chunks)[h >> plot_chunk_bits]; };
+
+   // Chunk holding a handle, for changing a plot - copied first (along with the directory) if a
+   // snapshot shares it
+   PlotChunk &writableChunk(plot_handle h);
+
+   // Chunk for the next slot for a plot with the given timestamp, starting a new segment or
+   // allocating a new chunk as needed, and counting the plot in its segment. The caller fills
+   // slot _size and bumps _size. Slots past _size are never visible to snapshots, so they are
+   // written in place
+   PlotChunk &nextSlotChunk(time_t timestamp);
+
+   // Index of the segment holding handle h (h must be below _size), and the handle just past
+   // the end of a segment
+   size_t segmentOf(plot_handle h) const;
+   plot_handle segmentEnd(size_t seg) const;
+
+   // Moves _head past erased slots and empty segments
+   void advanceHead();
+
+   // Plots ordered by timestamp (equal timestamps in insertion order) - a drone's track or one
+   // of a node's runs. The timestamp is kept alongside the handle so searches do not touch the
+   // chunks
+   struct series_point {
+      time_t timestamp;
+      plot_handle handle;
+   };
+
+   typedef std::deque<series_point> plot_series;
+
+   // Track index maintenance. addToTrack appends (or inserts, if it arrived out of time order)
+   // a plot in its drone's track; removeFromTrack takes an erased plot out
+   void addToTrack(unsigned int drone_id, time_t timestamp, plot_handle handle);
+   void removeFromTrack(plot_handle handle);
+
+   // Handle of the newest live plot among the first pos points of track, or invalid_plot
+   plot_handle lastValidBefore(const plot_series &track, size_t pos);
+
+   // Node run maintenance. addToRun appends a plot to its node's last run, or starts a new run
+   // if the plot is older than the end of that one; removeFromRuns takes an erased plot out
+   void addToRun(unsigned int node_id, time_t timestamp, plot_handle handle);
+   void removeFromRuns(plot_handle handle);
+
+   // Removes the point for handle (timestamped ts) from a series, true if it was there
+   static bool eraseFromSeries(plot_series &series, time_t ts, plot_handle handle);
+
+   // Drops the points of a series whose plots were dropped by retention (handles before _head),
+   // returns how many. With sweep false only the front of the series is checked
+   size_t pruneSeries(plot_series &series, bool sweep);
+
+   // pruneSeries over every track or every node run, removing any left empty. Returns the
+   // total number of points dropped
+   size_t pruneTracks(bool sweep);
+   size_t pruneRuns(bool sweep);
+
+   // Live handles in timestamp order (ties in insertion order), by a heap merge of the node
+   // runs. Does not lock the mutex
+   void mergeRuns(std::vector<plot_handle> &order);
+
+   // Same order as mergeRuns, but by a parallel radix sort of the live plots' timestamps, and
+   // timeOrder picks whichever of the two suits the number of runs. Do not lock the mutex
+   void radixOrder(std::vector<plot_handle> &order);
+   void timeOrder(std::vector<plot_handle> &order);
+
+   // Reads a stored plot out of a chunk directory
+   static DronePlot readPlot(const plot_chunk_dir &chunks, plot_handle h);
+
+   // Marks a slot as erased without locking
+   void eraseSlot(plot_handle handle);
+
+   // Signals the notify eventfd if the pending log just became non-empty or reached the
+   // threshold (before = its size before the latest appends)
+   void signalPending(size_t before);
+
+   // Duplicate index key - drone plus quantized position plus time bucket
+   struct DedupKey {
+      unsigned int drone_id;
+      int32_t lat;
+      int32_t lon;
+      int64_t bucket;
+
+      bool operator==(const DedupKey &other) const {
+         return (drone_id == other.drone_id) && (lat == other.lat) && (lon == other.lon) &&
+                (bucket == other.bucket);
+      };
+   };
+
+   struct DedupKeyHash {
+      size_t operator()(const DedupKey &key) const;
+   };
+
+   typedef std::unordered_multimap<DedupKey, plot_handle, DedupKeyHash> dedup_index;
+
+   DedupKey makeDedupKey(const DronePlot &plot);
+
+   // Returns the handle of a stored plot (in chunks) that plot duplicates, or invalid_plot
+   plot_handle findDuplicate(dedup_index &index, const plot_chunk_dir &chunks,
+                                                                     const DronePlot &plot);
+
+   // Builds the index from scratch over the live plots (after the store is reordered)
+   void rebuildDedupIndex();
+   void removeFromDedupIndex(plot_handle handle);
+
+   // Plot storage, shared with any snapshots taken
+   std::shared_ptr<plot_chunk_dir> _chunks;
+   size_t _size;        // Slots in use, live or erased
+
+   // Per segment first handle (it runs up to the next segment's), timestamp of the first plot,
+   // time bounds (of every plot added, erased or not) and live plot count. Kept outside the
+   // chunks since the writer updates them while snapshots share the chunks
+   struct segment_info {
+      plot_handle first;
+      time_t start_ts;
+      time_t min_ts;
+      time_t max_ts;
+      size_t live;
+   };
+
+   std::vector<segment_info> _segments;
+
+   // Per drone track index (see addToTrack)
+   std::unordered_map<unsigned int, plot_series> _tracks;
+
+   // Per node sorted runs, oldest run first (see addToRun)
+   std::unordered_map<unsigned int, std::vector<plot_series>> _node_runs;
+
+   plot_handle _head;   // No live plots exist before this slot (advanced by popFront)
+   size_t _live;        // Number of slots not marked DBFLAG_ERASED
+
+   // Handles of plots added with DBFLAG_NEW since the last takePending, in insertion order
+   std::vector<plot_handle> _pending;
+
+   // Incremental duplicate detection, maintained by appendPlot/eraseSlot when enabled
+   bool _dedup_enabled;
+   float _dedup_grid;
+   time_t _dedup_window;
+   dedup_index _dedup_index;
+   size_t _dup_count;
+
+   // Pending log wakeup (see getNotifyFD). Atomic as submitPlot reads it without the mutex
+   std::atomic<int> _notify_fd;
+   size_t _notify_threshold;
+
+   // Plots from submitPlot not yet moved into the store, with their flags
+   struct submitted_plot {
+      DronePlot plot;
+      unsigned short flags = 0;
+   };
+
+   SPSCRing<submitted_plot> _submitted;
 
    pthread_mutex_t _mutex; 
 };
@@ -3,8 +3,10 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <vector>
+#include <cstdint>
 #include <unistd.h>
 #include "exceptions.h"
 
@@ -52,83 +54,68 @@ public:
 
    void closeFD();
 
+   // Reads until every span is full, end of file, or (nonblocking FD) nothing more is waiting.
+   // Partial reads and EINTR are retried
+   ssize_t readSpans(const iovec *spans, int count);
+   ssize_t readAll(void *data, size_t len);
+
+   // Writes every span in order with as few system calls as possible (writev), finishing
+   // partial writes. On a full nonblocking FD returns early with the bytes written so far
+   ssize_t writeSpans(const iovec *spans, int count);
+   ssize_t writeAll(const void *data, size_t len);
+
    // The code must be defined here for a template for the next two functions
    /*****************************************************************************************
-    * readBytes - Template method--for an FD, reads in sizeof(T) * n bytes and stores in a
-    *             vector of type T
+    * readBytes - Template method--for an FD, reads in sizeof(T) * n bytes directly into a
+    *             vector of type T (T must be trivially copyable)
     *
-    *    Params:  buf - the STL vector to store the bytes
+    *    Params:  buf - the STL vector to store the bytes, resized to the number of T read
     *
-    *    Returns: number of bytes read, or -1 for read error, -2 if not enough bytes
+    *    Returns: number of T read, or -1 for read error, -2 if not enough bytes
     *             were available to fill a complete set of size T variables
     *
     *****************************************************************************************/
 
    template <typename T>
    int readBytes(std::vector<T> &buf, int n) {
-      int datasize = sizeof(T);
-      int bufsize = datasize * n;
-
-      unsigned char *bytebuf = new unsigned char[bufsize];
+      buf.resize(n);
 
-      buf.clear();
-
-      int results;
-      if ((results = read(_fd, bytebuf, bufsize)) < 0)
-      {
-         delete bytebuf;
+      ssize_t results = readAll(buf.data(), sizeof(T) * n);
+      if (results < 0) {
+         buf.clear();
          return -1;
       }
 
-      if (results < bufsize) {
-         if (results % datasize != 0) {
-            delete bytebuf;
-            return -2;
-         }
-      }
-
-      unsigned int read_units = results / datasize;
-      buf.reserve(read_units);
-      for (unsigned int i=0; i< read_units; i++) {
-         buf.push_back((T) bytebuf[i*datasize]);
+      if (results % sizeof(T) != 0) {
+         buf.clear();
+         return -2;
       }
 
-      delete bytebuf;
+      buf.resize(results / sizeof(T));
       return buf.size();
    }
 
    /*****************************************************************************************
-    * writeBytes - Template method--takes a STL vector object of type T and writes raw bytes to
-    *              the FD
+    * writeBytes - Template method--takes a STL vector object of type T and writes its raw
+    *              bytes to the FD straight from the vector's storage
     *
-    *    Params:  buf - the STL vector to store the bytes
+    *    Params:  buf - the STL vector holding the data
     *
-    *    Returns: number of bytes read, or -1 for read error, -2 if not enough bytes
-    *             were available to fill a complete set of size T variables
+    *    Returns: number of bytes written, or -1 for write error
     *
     *****************************************************************************************/
 
    template <typename T>
    int writeBytes(std::vector<T> &buf) {
-      int datasize = sizeof(T);
-      int bufsize = datasize * buf.size();
-
-      unsigned char *bytebuf = new unsigned char[bufsize];
-      for (unsigned int i=0; i<buf.size(); i++) {
-         memcpy(&bytebuf[i*datasize], &buf[i], sizeof(T));
-      }
-
-      int results;
-      results = write(_fd, bytebuf, bufsize);
-      delete bytebuf;
-      return results;
-
+      return writeAll(buf.data(), sizeof(T) * buf.size());
    }
 
-
  
 protected:
 
+   // Single write of a set of spans, overridden by sockets to suppress SIGPIPE
+   virtual ssize_t writevFD(const iovec *spans, int count);
+
    int _fd;
  
 };
@@ -146,9 +133,16 @@ public:
    void bindFD(const char *ip_addr, unsigned short int port);
    bool connectTo(const char *ip_addr, unsigned short port);
    bool connectTo(unsigned long ip_addr, unsigned short port);
+
+   // State of a connect started by connectTo: 0 once connected, EINPROGRESS while still under
+   // way, otherwise the errno it failed with
+   int checkConnect();
    void listenFD(int backlog = 5);
    bool acceptFD(SocketFD &server);
 
+   // Scatter read of whatever is waiting on the socket without blocking
+   ssize_t recvSpans(const iovec *spans, int count);
+
    // Sets this address to reusable to prevent problems when sockets don't shut down properly
    void setReusable();
 
@@ -156,6 +150,9 @@ public:
    void getIPAddrStr(std::string &buf); // The IP string associated with this socket
    unsigned short getPort();   // Port in little-endian (host) format
 
+protected:
+   ssize_t writevFD(const iovec *spans, int count);
+
 private:
 
    sockaddr_in _fd_addr;
@@ -193,8 +190,15 @@ public:
 
    bool openFile(fd_file_type ftype, bool create = false);
 
+   // Maps the whole open file read-only into memory, valid until unmapFile or destruction
+   bool mapFile(const uint8_t *&data, size_t &len);
+   void unmapFile();
+
 private:
    std::string _filename; 
+
+   void *_map = NULL;
+   size_t _maplen = 0;
 };
 
 
@@ -2,35 +2,82 @@
 #define LOGMGR_H
 
 #include <string>
+#include <atomic>
+#include <pthread.h>
+
+// How often (ms) the writer thread commits queued log lines to the file by default
+const unsigned int default_flush_interval = 100;
 
 /********************************************************************************
  * LogMgr - Log file manager. Includes setting log levels and a function to write
- *          a log entry if it is below a specified log level. Opens for each write
- *          in append mode to help with thread conflicts (but no mutexing)
+ *          a log entry if it is below a specified log level.
+ *
+ *          writeLog only timestamps the line and pushes it onto a lock-free
+ *          multi-producer queue, so it is safe from any thread and never waits on
+ *          the disk. A background writer thread drains the queue every flush
+ *          interval and writes the whole batch with a single flush.
  ********************************************************************************/
 
 class LogMgr {
    public:
-      LogMgr(const char *log_file, unsigned int log_lvl);
+      LogMgr(const char *log_file, unsigned int log_lvl,
+                                   unsigned int flush_interval = default_flush_interval);
       ~LogMgr();
 
       void writeLog(const char *str, unsigned int lvl=0);
       void writeLog(std::string &str, unsigned int lvl=0);
       void strerrLog(const char *str, unsigned int lvl=0);
 
+      // Writes out anything queued and closes the file (reopened by the next write)
       void closeLog();
+
+      // Writes out anything queued right away
+      void flush();
       
       unsigned int getLogLvl() { return _log_lvl; }
 
+      // Milliseconds between the writer thread's commits to the file
+      void setFlushInterval(unsigned int ms) { _flush_interval = ms; };
+
       static void createTimestamp(std::string &buf);
 
       void changeFilename(const char *filename);
 
    private:
+      // Queue node, the line is fully formatted (timestamp and newline) by the producer
+      struct LogNode {
+         std::atomic<LogNode *> next;
+         std::string line;
+      };
+
+      // Lock-free MPSC queue operations. Any thread may push, pop is only called with
+      // _file_mutex held so there is a single consumer at a time
+      void push(LogNode *node);
+      LogNode *pop();
+
+      // Writes all queued lines to the file and flushes it. Requires _file_mutex
+      void drain();
+
+      // Writer thread main loop
+      static void *writerThread(void *arg);
+
       std::string _log_file;  // Path/name of the log to write to
       unsigned int _log_lvl;  // The verbosity level
+      std::atomic<unsigned int> _flush_interval;
    
       FILE *_lfptr = NULL;
+      std::atomic<bool> _open_failed;
+
+      // Queue: producers swap themselves onto _qhead, the consumer reads from _qtail
+      LogNode _stub;
+      std::atomic<LogNode *> _qhead;
+      LogNode *_qtail;
+
+      // Guards the file and the consumer side of the queue. The writer waits on _wake
+      pthread_mutex_t _file_mutex;
+      pthread_cond_t _wake;
+      pthread_t _writer;
+      bool _stop = false;
 };
 
 #endif // ALMGR_H
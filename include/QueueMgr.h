@@ -2,7 +2,9 @@
 #define QUEUEMGR_H
 
 #include <queue>
+#include <deque>
 #include <vector>
+#include <map>
 #include <crypto++/secblock.h>
 #include "TCPServer.h"
 
@@ -19,7 +21,22 @@
  *            
  *            The pop function does two things. First, it "pops" (sends) incoming data to the
  *            management process and second, it assigns all outgoing data to a "Message
- *            Channel Agent", or TCPConn object.
+ *            Channel Agent", or TCPConn object. There is one long-lived, authenticated
+ *            TCPConn per peer in servers.txt that carries every batch sent to that peer.
+ *
+ *            Batches to each peer are numbered. The peer acks the last sequence number of each
+ *            frame, which is kept here as that peer's watermark; unacked batches are resent
+ *            (coalesced) by the session after an outage. Received frames are popped still
+ *            sealed, with what the caller needs to open them (TCPConn::openReplFrame) off the
+ *            network thread, and only acked (ackBatch) once the caller has them in the
+ *            database, so nothing acked can be lost on the way in. The caller skips a resend
+ *            whose range it already applied, and acks it again.
+ *
+ *            Outgoing batches carry the caller's source range (for ReplServer, the first and
+ *            last plot handle in the batch). If a peer's session has to drop unacked batches
+ *            to stay within max_outqueue_bytes, their source ranges are kept as lost, and
+ *            handed back by takeLostRange once the peer is reachable again, so the caller can
+ *            rebuild them from its own store.
  *
  *******************************************************************************************/
 class QueueMgr : public TCPServer 
@@ -28,16 +45,43 @@ public:
    QueueMgr(unsigned int verbosity=1);
    virtual ~QueueMgr();
 
-   void handleQueue();
+   void handleQueue(int timeout_ms = max_poll_timeout);
 
    void populateQueue();
 
-   // Pops a received queue element off the queue
-   bool pop(std::string &sid, std::vector<uint8_t> &data);
+   // Where a received batch came from - the connection and session it arrived on and the
+   // sender's epoch and sequence range (filled in by the caller once it opens the frame)
+   struct repl_seq {
+      repl_seq() : conn_id(0), session(0), epoch(0), first(0), last(0) {}
+
+      uint64_t conn_id;
+      uint64_t session;
+      uint64_t epoch;
+      uint64_t first;
+      uint64_t last;
+   };
+
+   // Pops a received queue element off the queue, still sealed - seal opens it
+   bool pop(std::string &sid, std::vector<uint8_t> &data, sealed_input &seal, repl_seq &seq);
+
+   // Acks a popped batch once it is applied. Skipped if its session has since gone, the
+   // sender then resends it on the new session
+   void ackBatch(const repl_seq &seq);
 
-   // Loads replication information into the Queue to transmit to servers
-   void sendToAll(std::vector<uint8_t> &data);
-   void sendToServer(const char *server_id, std::vector<uint8_t> &data);
+   // Drops the session a popped batch came on when the batch fails to open, logging why.
+   // Neither this nor ackBatch touches a connection that has since moved on to a new session
+   void dropBatch(const repl_seq &seq, const char *reason);
+
+   // Loads replication information into the Queue to transmit to servers. src_first/src_last
+   // are the caller's own range for where the data came from, handed back if it is dropped
+   void sendToAll(std::vector<uint8_t> &data, uint64_t src_first, uint64_t src_last);
+   void sendToServer(const char *server_id, std::vector<uint8_t> &data, uint64_t src_first,
+                                                                         uint64_t src_last);
+
+   // Takes the oldest source range dropped unsent for a peer whose session is back up with
+   // room in its queue. putLostRange returns the part of a range the caller did not requeue
+   bool takeLostRange(std::string &sid, uint64_t &src_first, uint64_t &src_last);
+   void putLostRange(const char *sid, uint64_t src_first, uint64_t src_last);
    
    // Overload simply to remove this server from _server_list. Calls parent funct
    void bindSvr(const char *ip_addr, unsigned short port);
@@ -57,22 +101,34 @@ public:
 
 private:
 
-   // Launches a connection to the other server from queue data
-   void launchDataConn(const char *sid, std::vector<uint8_t> &data);
+   // Queues data on the session to the other server, launching the session if needed
+   void launchDataConn(const char *sid, std::vector<uint8_t> &data, uint64_t src_first,
+                                                                    uint64_t src_last);
 
    // Loads server information from servers.txt
    int loadServerList(const char *filename);
 
+   // Picks up the acked sequence numbers from the peer sessions
+   void updateWatermarks();
+
    // Set up our types for managing our queue
    enum qe_type {send, recv};
    struct queue_element {
 
-      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data)
-                  : type(in_type), server_id(in_sid), data(in_data) {}
+      queue_element(qe_type in_type, const char *in_sid, std::vector<uint8_t> &in_data,
+                    const sealed_input &in_seal = sealed_input(),
+                    const repl_seq &in_seq = repl_seq(), uint64_t in_src_first = 0,
+                    uint64_t in_src_last = 0)
+                  : type(in_type), server_id(in_sid), data(in_data), seal(in_seal),
+                    seq(in_seq), src_first(in_src_first), src_last(in_src_last) {}
 
       qe_type type;
       std::string server_id;
       std::vector<uint8_t> data;
+      sealed_input seal;
+      repl_seq seq;
+      uint64_t src_first;
+      uint64_t src_last;
    };
 
    std::string _server_ID;
@@ -81,6 +137,24 @@ private:
    std::queue<queue_element> _queue;
 
    std::vector<std::tuple<std::string, unsigned long, unsigned short>> _server_list;  
+
+   // Outgoing session pool, one per peer SID (the TCPConn objects are owned by _connlist)
+   std::map<std::string, TCPConn *> _peer_conns;
+
+   // Outgoing replication state per peer SID - last sequence number queued and last acked,
+   // the source range of each batch not yet acked, and the source ranges dropped unsent
+   // (oldest first; consecutive dropped batches share one range)
+   struct repl_peer {
+      uint64_t last_seq = 0;
+      uint64_t acked = 0;
+      std::map<uint64_t, std::pair<uint64_t, uint64_t>> sources;
+      std::deque<std::pair<uint64_t, uint64_t>> lost;
+      uint64_t last_lost_seq = 0;
+   };
+   std::map<std::string, repl_peer> _repl_peers;
+
+   // Random per run, sent with every batch so peers can tell our restart from a resend
+   uint64_t _repl_epoch;
 };
 
 
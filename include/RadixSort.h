@@ -0,0 +1,34 @@
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/********************************************************************************************
+ * RadixSort - parallel, stable LSD radix sort of 64-bit keys, for bulk ordering where a
+ *             comparison sort would dominate (a freshly loaded file, a replay merged from many
+ *             nodes). The items are split into one block per thread; each pass over a key
+ *             byte counts digits per block, turns the counts into per block output offsets
+ *             and scatters every block in parallel. Blocks scatter into their own range of
+ *             each digit's bucket, in block order, so equal keys keep their input order.
+ *             Bytes that are the same in every key are skipped, so timestamps spanning a
+ *             short range take only a couple of passes.
+ ********************************************************************************************/
+
+// A key and the index (or handle) of the item it belongs to
+struct radix_item {
+   uint64_t key;
+   uint64_t index;
+};
+
+// Maps a signed value (e.g. a time_t) to a key that sorts in the same order as unsigned
+inline uint64_t radixKey(int64_t value) {
+   return static_cast<uint64_t>(value) ^ (static_cast<uint64_t>(1) << 63);
+}
+
+// Sorts items by key, keeping equal keys in their original order. threads = 0 uses one per
+// online core; small inputs use fewer threads so each gets a worthwhile block
+void radixSort(std::vector<radix_item> &items, unsigned int threads = 0);
+
+#endif
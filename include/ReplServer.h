@@ -6,6 +6,7 @@
 #include "QueueMgr.h"
 #include "DronePlotDB.h"
 #include "handleDuplication.h"
+#include "BoundedQueue.h"
 
 /***************************************************************************************
  * ReplServer - class that manages replication between servers. The data is automatically
@@ -14,6 +15,16 @@
  *              the communications. This object simply runs management loops and should
  *              do deconfliction of nodes
  *
+ *              Received batches go through a pipeline so the network thread only moves
+ *              sealed frames off the sockets: a pool of decode threads opens (GCM) and
+ *              expands the batches in parallel, and a single ingest thread writes them to
+ *              the database, so the DB has one writer besides the antenna. Batches are
+ *              sharded onto the decode threads by sender, so each sender's batches reach the
+ *              ingest thread in the order they arrived. The stages are joined by bounded
+ *              queues, so a backed-up stage slows the one feeding it instead of growing.
+ *              A batch is only acked to its sender once the ingest thread has applied it;
+ *              the ingest thread posts the ack and wakes the network thread to send it.
+ *
  ***************************************************************************************/
 class ReplServer 
 {
@@ -34,6 +45,10 @@ public:
    // attempts to check "simulator time" should use this function
    time_t getAdjustedTime();
 
+   // Retention in sim seconds - plots older than this are dropped from the database a segment
+   // at a time as the server runs. 0 (the default) keeps everything
+   void setRetention(time_t secs) { _retention = secs; };
+
    // --- Andrew Davis ---
    // Creates object that handles duplicate deletion, then does it
    void handleDuplicates();
@@ -46,6 +61,48 @@ private:
 
    unsigned int queueNewPlots();
 
+   // Queues plots dropped unsent to a peer again, from the database, once the peer is back
+   unsigned int requeueLostPlots();
+
+   // A batch received from another server on its way through the decode and ingest stages
+   struct repl_job {
+      std::string sid;
+      std::vector<uint8_t> data;
+      sealed_input seal;
+      QueueMgr::repl_seq seq;
+   };
+
+   // A decode thread and the queue of batches sharded to it
+   struct decode_worker {
+      decode_worker(ReplServer *in_server, size_t depth) : server(in_server), queue(depth) {}
+
+      ReplServer *server;
+      BoundedQueue<repl_job> queue;
+      pthread_t thread;
+   };
+
+   // Pipeline threads: hand a batch's ack (or the drop of a batch that failed to open, and why)
+   // to the network thread. Network thread: sends them
+   void postAck(const QueueMgr::repl_seq &seq);
+   void postDrop(const QueueMgr::repl_seq &seq, const char *reason);
+   void sendAcks();
+
+   // Starts and stops (draining the queues first) the decode and ingest threads
+   void startPipeline();
+   void stopPipeline();
+
+   // Thread entry points and the loops they run
+   static void *t_decode(void *data);
+   static void *t_ingest(void *data);
+   void decodeBatches(BoundedQueue<repl_job> &queue);
+   void ingestBatches();
+
+   // True once the new plots should go out (full batch, or the oldest is at the latency limit)
+   bool flushDue();
+
+   // How long the reactor may wait before flushDue could change on its own (milliseconds)
+   int getFlushTimeout();
+
 
    QueueMgr _queue;    
 
@@ -60,8 +117,11 @@ private:
    // System clock time of when the server started
    time_t _start_time;
 
-   // When the last replication happened so we can know when to do another one
-   time_t _last_repl;
+   // Monotonic time (ms) the oldest plot not yet replicated was first seen, 0 if none
+   int64_t _oldest_pending;
+
+   // Sim seconds of plots to keep, 0 for no limit
+   time_t _retention = 0;
 
    // How much to spam stdout with server status
    unsigned int _verbosity;
@@ -72,6 +132,26 @@ private:
 
    // Added: Andrew Davis
    std::string serverLeader;
+
+   // Receive pipeline stages and threads
+   std::vector<std::unique_ptr<decode_worker>> _decoders;
+   BoundedQueue<repl_job> _ingest_queue;
+   pthread_t _ingest_thread;
+
+   // Incoming replication state per sender SID - their epoch and the last sequence applied.
+   // Only the ingest thread uses it
+   struct repl_cursor {
+      uint64_t epoch = 0;
+      uint64_t applied = 0;
+   };
+   std::map<std::string, repl_cursor> _applied;
+
+   // Acks for applied batches and drops for failed ones waiting for the network thread, and
+   // the eventfd that wakes it
+   std::vector<QueueMgr::repl_seq> _acks;
+   std::vector<std::pair<QueueMgr::repl_seq, std::string>> _drops;
+   pthread_mutex_t _ack_mutex;
+   int _ack_fd = -1;
 };
 
 
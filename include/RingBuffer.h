@@ -0,0 +1,63 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+
+/********************************************************************************************
+ * RingBuffer - circular byte buffer used to stage data read off a socket until a complete
+ *              frame is available. Capacity is always a power of two so positions wrap with a
+ *              mask. Data can be examined in place as up to two contiguous spans (one if it
+ *              does not wrap) so frames can be checked and copied out without linearizing the
+ *              buffer. Grows (and linearizes) only when an append would not fit.
+ ********************************************************************************************/
+
+class RingBuffer
+{
+public:
+   RingBuffer(size_t capacity = 4096);
+   ~RingBuffer();
+
+   size_t size() const { return _size; };
+   size_t capacity() const { return _buf.size(); };
+   size_t space() const { return _buf.size() - _size; };
+   bool empty() const { return _size == 0; };
+
+   // Ensures the buffer can hold at least n bytes in total, growing if needed
+   void reserve(size_t n);
+
+   // Releases capacity beyond n bytes (or beyond what is buffered, if more)
+   void shrink(size_t n);
+
+   // Adds data to the end of the buffer, growing it if it will not fit
+   void append(const uint8_t *data, size_t len);
+
+   // Copies len bytes starting offset bytes past the read position into dst. Returns false
+   // if that many bytes are not buffered yet
+   bool peek(size_t offset, void *dst, size_t len) const;
+
+   // Fills spans with the (up to two) contiguous regions holding len bytes starting offset
+   // bytes past the read position. Returns the number of spans used, 0 if not enough data
+   int getSpans(size_t offset, size_t len, iovec spans[2]);
+
+   // Fills spans with the free space after the buffered data (two spans if it wraps) so it can
+   // be read into directly. Returns the number of spans used, 0 if the buffer is full
+   int getFreeSpans(iovec spans[2]);
+
+   // Marks n bytes written into the free spans as buffered data
+   void commit(size_t n);
+
+   // Discards n bytes from the front of the buffer
+   void consume(size_t n);
+
+   void clear();
+
+private:
+   std::vector<uint8_t> _buf;
+   size_t _head = 0;    // Read position
+   size_t _size = 0;    // Bytes currently buffered
+};
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+/********************************************************************************************
+ * SPSCRing - fixed size ring for handing items from exactly one producer thread to one
+ *            consumer (several consumers are fine if something else, like a mutex, keeps them
+ *            from popping at the same time). push and pop never block or retry, so both ends
+ *            are wait-free. Capacity is rounded up to a power of two so positions wrap with a
+ *            mask; the head and tail counters sit on separate cache lines so the two threads
+ *            do not fight over one line.
+ ********************************************************************************************/
+
+template <class T>
+class SPSCRing
+{
+public:
+   SPSCRing(size_t capacity);
+
+   // Producer: copies item in. Returns false (nothing queued) if the ring is full. If first is
+   // given it is set true when the consumer had already taken every earlier item, meaning it
+   // may be waiting and should be woken for this one
+   bool push(const T &item, bool *first = NULL);
+
+   // Consumer: copies the oldest item out. Returns false if the ring is empty
+   bool pop(T &item);
+
+   size_t capacity() const { return _slots.size(); };
+
+private:
+   std::vector<T> _slots;
+   size_t _mask;
+
+   // Positions only ever increase and are masked to index the slots. Sequentially consistent
+   // so the producer's "did the consumer catch up" check cannot miss the consumer's last pop
+   std::atomic<size_t> _head;   // Next slot to pop, written by the consumer
+   char _pad[64 - sizeof(std::atomic<size_t>)];
+   std::atomic<size_t> _tail;   // Next slot to push, written by the producer
+};
+
+template <class T>
+SPSCRing<T>::SPSCRing(size_t capacity):_head(0),
+                                       _tail(0)
+{
+   size_t size = 1;
+   while (size < capacity)
+      size <<= 1;
+
+   _slots.resize(size);
+   _mask = size - 1;
+}
+
+template <class T>
+bool SPSCRing<T>::push(const T &item, bool *first) {
+   size_t tail = _tail.load(std::memory_order_relaxed);
+
+   if (tail - _head.load(std::memory_order_acquire) >= _slots.size())
+      return false;
+
+   _slots[tail & _mask] = item;
+   _tail.store(tail + 1);
+
+   if (first != NULL)
+      *first = (_head.load() == tail);
+   return true;
+}
+
+template <class T>
+bool SPSCRing<T>::pop(T &item) {
+   size_t head = _head.load(std::memory_order_relaxed);
+
+   if (head == _tail.load())
+      return false;
+
+   item = _slots[head & _mask];
+   _head.store(head + 1);
+   return true;
+}
+
+#endif
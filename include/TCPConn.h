@@ -1,44 +1,109 @@
 #ifndef TCPCONN_H
 #define TCPCONN_H
 
+#include <deque>
 #include <crypto++/secblock.h>
+#include <crypto++/aes.h>
+#include <crypto++/modes.h>
+#include <crypto++/gcm.h>
 #include "FileDesc.h"
 #include "LogMgr.h"
+#include "RingBuffer.h"
+#include "TicketCache.h"
 
 const int max_attempts = 2;
 
+// Reconnect backoff for persistent peer sessions - starts at reconnect_delay and doubles on each
+// failed attempt up to max_reconnect_delay (seconds)
+const time_t reconnect_delay = 1;
+const time_t max_reconnect_delay = 60;
+
+// Wire framing - every message is a fixed header followed by the payload. The header holds a
+// magic number, the frame type, flags, the payload length and an Adler-32 checksum of the
+// payload, all in network byte order
+const uint16_t frame_magic = 0x4450;
+const size_t frame_hdr_size = 12;
+const uint32_t max_frame_len = 64 * 1024 * 1024;
+
+// Largest frame accepted before the session is keyed. Handshake frames only carry IDs, random
+// bytes and tickets, so an unauthenticated peer cannot make us buffer a large frame
+const uint32_t max_handshake_frame_len = 4096;
+
+// Frame header flags - frame_sealed marks a payload encrypted and authenticated with the
+// session key (ciphertext followed by the GCM tag). frame_compressed on a replication frame
+// marks a BatchCodec compressed batch; on the server's SID or resumed frame it tells the
+// client that compressed batches are accepted
+const uint8_t frame_sealed = 0x01;
+const uint8_t frame_compressed = 0x02;
+
+// Replication frames start with the sender's epoch (random per process run) and the first and
+// last sequence numbers of the batches coalesced into the frame; acks carry the last one
+const size_t repl_hdr_size = 24;
+
+// Session frames use a 96-bit GCM nonce: 4 byte sending direction, 8 byte frame counter
+const size_t seal_nonce_size = 12;
+
+// A replication frame taken off the socket still sealed, with the session key and nonce needed
+// to open it away from the network thread (TCPConn::openReplFrame)
+struct sealed_input {
+   CryptoPP::SecByteBlock key;
+   uint8_t nonce[seal_nonce_size];
+   uint8_t flags;
+};
+
+// Most batch data coalesced into one replication frame (a single larger batch still goes alone)
+const size_t max_coalesce_bytes = 16 * 1024 * 1024;
+
+// Most batch data queued for one peer. While a peer is down, the oldest batches not in flight
+// are dropped past this so the queue cannot grow without limit (QueueMgr keeps which, so their
+// plots can be rebuilt from the database once the peer is back)
+const size_t max_outqueue_bytes = 64 * 1024 * 1024;
+
 // Methods and attributes to manage a network connection, including tracking the username
 // and a buffer for user input. Status tracks what "phase" of login the user is currently in
 class TCPConn 
 {
 public:
-   TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity);
+   TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, TicketCache &tickets,
+                                                            unsigned int verbosity);
    ~TCPConn();
 
    // The current status of the connection
-   enum statustype { s_none, s_connecting, s_connected, s_datatx, s_datarx, s_waitack, s_hasdata,
+   enum statustype { s_none, s_connecting, s_connected, s_datarx, s_waitack, s_hasdata,
                      c_waitForRBString, c_waitForSID, c_sendRBString, c_waitForEBString,
-                     s_waitForEBString, s_sendEBString, s_waitForRBString };
+                     s_waitForEBString, s_sendEBString, s_waitForRBString, s_idle,
+                     c_waitForResumed };
 
    statustype getStatus() { return _status; };
 
+   // Message types carried in the frame header
+   enum frametype { f_sid = 1, f_auth, f_rep, f_ack, f_resume, f_resumed };
+
    bool accept(SocketFD &server);
 
    // Primary maintenance function. Checks this connection for input and handles it
    // depending on the state of the connection
    void handleConnection();
 
-   // connect - second version uses ip_addr in network format (big endian)
-   void connect(const char *ip_addr, unsigned short port);
-   void connect(unsigned long ip_addr, unsigned short port);
+   // The reactor marks a connection readable when its socket has input (or hung up)
+   void setReadable() { _readable = true; };
+   bool isReadable() { return _readable; };
 
-   // Send data to the other end of the connection without encryption
-   bool getData(std::vector<uint8_t> &buf);
-   bool sendData(std::vector<uint8_t> &buf);
+   // Frame data the socket would not take yet. While there is some the reactor watches the
+   // socket for room (setWriteWatched records that) and marks the connection writable
+   bool hasPendingOutput() { return !_sendbuf.empty() || _connect_pending; };
+   void setWritable() { _writable = true; };
+   bool isWriteWatched() { return _write_watched; };
+   void setWriteWatched(bool watched) { _write_watched = watched; };
 
-   // Calls encryptData or decryptData before send or after receive
-   bool getEncryptedData(std::vector<uint8_t> &buf);
-   bool sendEncryptedData(std::vector<uint8_t> &buf);
+   // True if the connection has something to do without waiting on input (a fresh connect
+   // that needs to send its SID, or an idle session with batches queued)
+   bool hasPendingWork();
+
+   // connect - second version uses ip_addr in network format (big endian). Does not wait for
+   // the connect to complete; the handshake starts once the socket turns writable
+   void connect(const char *ip_addr, unsigned short port);
+   void connect(unsigned long ip_addr, unsigned short port);
 
    // Simply encrypts or decrypts a buffer
    void encryptData(std::vector<uint8_t> &buf);
@@ -48,12 +113,32 @@ public:
    bool isInputDataReady() { return _data_ready; };
    void getInputData(std::vector<uint8_t> &buf);
 
+   // Key, nonce and frame flags to open the input data with (it is still sealed)
+   const sealed_input &getInputSeal() { return _input_seal; };
+
+   // Opens a sealed replication frame from getInputData and strips its header. Thread safe, so
+   // the network thread only has to take frames off the socket
+   static bool openReplFrame(const sealed_input &seal, std::vector<uint8_t> &buf,
+                             uint64_t &epoch, uint64_t &first, uint64_t &last);
+
+   // Acks received replication batches through sequence number last. Sent once the batches are
+   // in the database rather than on receipt, so a batch lost on the way in is resent
+   void sendAck(uint64_t last);
+
    // Data about the connection (NodeID = other end's Server Node ID string)
    unsigned long getIPAddr() { return _connfd.getIPAddr(); }; // Network format
    const char *getIPAddrStr(std::string &buf);
    unsigned short getPort() { return _connfd.getPort(); }; // host format
+   int getFD() { return _connfd.getFD(); };
    const char *getNodeID() { return _node_id.c_str(); };
 
+   // Unique per connection object, so a late ack can tell its session has since been replaced
+   uint64_t getConnID() { return _conn_id; };
+
+   // Counts the sessions keyed on this connection, so work for an earlier session (acks, drops)
+   // can tell it is stale after a reconnect
+   uint64_t getSessionID() { return _session_id; };
+
    // Connections can set the node or server ID of this connection
    void setNodeID(const char *new_id) { _node_id = new_id; };
    void setSvrID(const char *new_id) { _svr_id = new_id; };
@@ -67,22 +152,63 @@ public:
    // When should we try to reconnect (prevents spam)
    time_t reconnect;
 
-   // Assign outgoing data and sets up the socket to manage the transmission
-   void assignOutgoingData(std::vector<uint8_t> &data);
+   // Queues an outgoing batch with its sequence number (increasing per peer). Everything queued
+   // when a frame goes out is coalesced into it, and it stays in flight (resent unchanged after a
+   // reconnect) until the other end acks its last sequence number. Returns the number of plots
+   // dropped to keep the queue within max_outqueue_bytes, adding their sequence numbers to dropped
+   size_t assignOutgoingData(std::vector<uint8_t> &data, uint64_t seq,
+                                                      std::vector<uint64_t> &dropped);
+   size_t getOutgoingCount() { return _outqueue.size(); };
+   size_t getOutgoingBytes() { return _outqueue_bytes; };
+
+   // True once the session is authenticated and carrying batches
+   bool isSessionUp() { return isConnected() && ((_status == s_idle) || (_status == s_waitack)); };
+
+   // Highest sequence number the other end has acked
+   uint64_t getAckedSeq() { return _acked_seq; };
+
+   // Epoch sent with our replication frames, so the other end can tell a restart from a resend
+   void setReplEpoch(uint64_t epoch) { _repl_epoch = epoch; };
+
+   // Persistent connections are kept open between batches and reconnected after a failure
+   // instead of being dropped (used for the outgoing session to each peer)
+   void setPersistent(bool persistent) { _persistent = persistent; };
+   bool isPersistent() { return _persistent; };
+
+   // Marks a lost persistent session to be reconnected after the current backoff delay, then
+   // doubles the delay (up to max_reconnect_delay)
+   void scheduleReconnect();
 
 protected:
     // State Machine Process:
     // Client sendSID() --> Server waitForSID/sendRB() -->
     // Client waitForRB/sendEB() --> Server waitForEB/sendSID() -->
     // Client waitForSID/sendRB() --> Server waitForRB/sendEB() -->
-    // Client waitForEB/transmitData() --> Server waitForData()
+    // Client waitForEB/sendNextBatch() --> Server waitForData()
+    //
+    // A client holding an unexpired session ticket sends resume() instead of its SID. If the
+    // server still has the ticket it answers with resumed and both ends go straight to the
+    // data states (one round trip), otherwise it answers with its random bytes and the full
+    // handshake above carries on.
+    //
+    // Once authenticated, the session stays open. The client sends one queued batch at a
+    // time (awaitAck), dropping to idle when its queue is empty. The server returns to
+    // waitForData each time the queue manager collects a received batch.
 
    // Functions to execute various stages of a connection 
    void sendSID();
+   bool finishConnect();  // Client: true once the non-blocking connect has completed
    void waitForSID();
-   void transmitData();
    void waitForData();
    void awaitAck();
+   void waitIdle();
+
+   // Sends the frame in flight (building it from the queue if there is none) and waits for
+   // its ack
+   void sendNextBatch();
+
+   // Coalesces queued batches, oldest first, into the in-flight frame
+   void buildInflight();
 
    // Functions added for authentication
    void s_waitForEB();   // Server: After sending, waits for the encrypted version. Checks. Sends SID if valid
@@ -94,28 +220,56 @@ protected:
    void c_sendRB();      // Client: Sends our own authentication string
    void c_waitForEB();   // Client: Waits for the server to send encrypted string back. Sends data if correct, disconnects if not.
 
+   // Session resumption
+   void c_waitResumed(); // Client: Sent a ticket, waits for resumed (or random bytes if the server refused it)
+   void s_resume();      // Server: Checks a presented ticket, resumes or falls back to the full handshake
+
    void genBytesForVerify();    // Assign random string to send for verify. = RB
 
-   // Looks for commands in the data stream
-   std::vector<uint8_t>::iterator findCmd(std::vector<uint8_t> &buf,
-                                                   std::vector<uint8_t> &cmd);
-   bool hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd);
+   // Sends the payload in buf as a single frame of the given type. Whatever the socket does not
+   // take right away is kept in the send buffer and finished by flushSendBuf
+   void sendFrame(frametype type, std::vector<uint8_t> &buf, uint8_t flags = 0);
+
+   // Writes as much of the send buffer as the socket will take, true once it is empty
+   bool flushSendBuf();
+
+   // Reads any waiting socket data into the receive buffer and pulls out the next frame if it
+   // has fully arrived. A frame of a different type, or a corrupt one, drops the connection
+   bool getFrame(frametype type, std::vector<uint8_t> &buf, uint8_t *flags = NULL);
 
-   // Gets the data between startcmd and endcmd strings and places in buf
-   bool getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   // Session encryption - once both ends are authenticated, replication frames are sealed with
+   // AES-GCM under a key derived from a secret (the shared key, or a ticket's resumption
+   // secret) and both ends' random bytes. A new ticket is issued from the same derivation
+   void startSession(bool client, const CryptoPP::SecByteBlock &secret,
+                     const std::vector<uint8_t> &server_rb, const std::vector<uint8_t> &client_rb);
+   void sendSealedFrame(frametype type, std::vector<uint8_t> &buf, uint8_t flags = 0);
+   bool getSealedFrame(frametype type, std::vector<uint8_t> &buf, uint8_t *flags = NULL);
 
-   // Places startcmd and endcmd strings around the data in buf and returns it in buf
-   void wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd);
+   // Takes the next sealed frame off the socket without opening it, and gives its nonce
+   bool takeSealedFrame(frametype type, std::vector<uint8_t> &buf, uint8_t *nonce,
+                                                                   uint8_t &flags);
+
+   // Moves the data waiting on the socket into the receive buffer, false if connection lost
+   bool fillRecvBuf();
+
+   // True if a complete frame is sitting in the receive buffer
+   bool hasFrame();
+
+   // True if a complete frame of the given type is next in the receive buffer
+   bool nextFrameIs(frametype type);
+
+   // Largest frame payload accepted in the current state (max_handshake_frame_len until the
+   // session is keyed)
+   uint32_t frameLimit() { return _session ? max_frame_len : max_handshake_frame_len; };
+
+   // Logs a dropped connection and cleans up
+   void connLost();
 
 
 private:
 
    bool _connected = false;
 
-   std::vector<uint8_t> c_rep, c_endrep, c_auth, c_endauth, c_ack, c_sid, c_endsid;
-
    statustype _status = s_none;
 
    SocketFD _connfd;
@@ -127,10 +281,62 @@ private:
    std::vector<uint8_t> _inputbuf;
    bool _data_ready;    // Is the input buffer full and data ready to be read?
 
-   // Store outgoing data to be sent over the network
-   std::vector<uint8_t> _outputbuf;
+   // Received bytes not yet assembled into a complete frame
+   RingBuffer _recvbuf;
+
+   // Frame bytes waiting for room on the socket, sent in order before any new frame
+   RingBuffer _sendbuf;
+
+   // Outgoing batches and their sequence numbers, the first _inflight_batches are coalesced into
+   // _inflight (<count><records>) until acked
+   std::deque<std::pair<uint64_t, std::vector<uint8_t>>> _outqueue;
+   size_t _outqueue_bytes = 0;
+   std::vector<uint8_t> _inflight;
+   size_t _inflight_batches = 0;
+   uint64_t _inflight_first = 0;
+   uint64_t _inflight_last = 0;
+   uint64_t _acked_seq = 0;
+   uint64_t _repl_epoch = 0;
+
+   // How to open the last replication frame received
+   sealed_input _input_seal;
+
+   uint64_t _conn_id;
+   bool _persistent = false;
+   bool _connect_pending = false;   // Client: connect started, socket not writable yet
+   bool _peer_compress = false;   // Client: the server accepts compressed batches
+   bool _readable = false;
+   bool _writable = false;
+   bool _write_watched = false;
+   time_t _backoff = reconnect_delay;
 
    CryptoPP::SecByteBlock &_aes_key; // Read from a file, our shared key
+
+   // Cipher state keyed once per connection, only the IV is changed per message
+   CryptoPP::CFB_Mode<CryptoPP::AES>::Encryption _encryptor;
+   CryptoPP::CFB_Mode<CryptoPP::AES>::Decryption _decryptor;
+
+   // Output buffer for encrypt/decrypt, swapped with the caller's buffer
+   std::vector<uint8_t> _scratch;
+
+   // Session cipher state, keyed once per session. Nonces are the sending direction plus a
+   // per-direction frame counter, so nothing extra goes on the wire
+   CryptoPP::GCM<CryptoPP::AES>::Encryption _sealer;
+   CryptoPP::GCM<CryptoPP::AES>::Decryption _opener;
+   CryptoPP::SecByteBlock _session_key;   // Handed out with sealed replication frames
+   bool _session = false;
+   uint64_t _session_id = 0;
+   bool _session_client = false;
+   uint64_t _send_seq = 0;
+   uint64_t _recv_seq = 0;
+   std::vector<uint8_t> _peer_rb;   // Client: the server's challenge, kept for key derivation
+
+   // Server: tickets issued to clients. Client: the ticket for our next reconnect
+   TicketCache &_tickets;
+   std::vector<uint8_t> _ticket_id;
+   CryptoPP::SecByteBlock _resume_secret;
+   time_t _ticket_expires = 0;
+
    std::string _authstr;   // remembers the random authorization string sent.
    std::vector<uint8_t> _gennedAuthStr;
 
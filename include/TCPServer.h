@@ -2,11 +2,14 @@
 #define TCPSERVER_H
 
 #include <list>
+#include <vector>
 #include <memory>
 #include "Server.h"
 #include "FileDesc.h"
 #include "TCPConn.h"
 #include "LogMgr.h"
+#include "ALMgr.h"
+#include "TicketCache.h"
 #include <crypto++/secblock.h>
 
 /********************************************************************************************
@@ -15,9 +18,14 @@
  *
  *             handleConnection is the primary maintenance function. Calls all the TCPConn
  *             handleConnection functions. 
+ *
+ *             Sockets are watched with an epoll reactor: pollEvents blocks until the listening
+ *             socket or a connection is ready (or the timeout expires), and handleConnections
+ *             then only runs the connections that have input or work queued.
  ********************************************************************************************/
 
-const time_t reconnect_delay = 5;
+// Longest pollEvents will block when nothing is ready (milliseconds)
+const int max_poll_timeout = 100;
 
 class TCPServer : public Server 
 {
@@ -31,7 +39,16 @@ public:
 
    void shutdown();
 
-   TCPConn *handleSocket();
+   // Waits up to timeout_ms for socket activity and records which sockets are ready. Returns
+   // immediately if a connection already has work queued
+   void pollEvents(int timeout_ms = max_poll_timeout);
+
+   // Adds an fd that other threads signal (a nonblocking eventfd) to the reactor, so pollEvents
+   // returns as soon as it is signaled. Several can be watched; pollEvents drains them
+   void watchWakeFD(int fd);
+
+   // Accepts every pending connection, returns the number accepted
+   unsigned int handleSocket();
    virtual void handleConnections();
 
    unsigned long getIPAddr() { return _sockfd.getIPAddr(); };
@@ -44,11 +61,17 @@ protected:
 
    void loadAESKey(const char *filename);
 
+   // Adds a connection's socket to the reactor (call whenever it gets a new FD)
+   void watchConn(TCPConn *conn);
+
    // List of TCPConn objects to manage connections
    std::list<std::unique_ptr<TCPConn>> _connlist;
 
    CryptoPP::SecByteBlock _aes_key;
 
+   // Session tickets issued to clients, so a reconnect can skip the full handshake
+   TicketCache _tickets;
+
    LogMgr _server_log;
 
    unsigned int _verbosity;
@@ -57,6 +80,18 @@ private:
    // Class to manage the server socket
    SocketFD _sockfd;
 
+   // epoll instance watching the server socket and all connections
+   int _epollfd;
+
+   // Set by pollEvents when the (edge-triggered) server socket has connections to accept
+   bool _accept_ready;
+
+   // Wakeup eventfds from watchWakeFD
+   std::vector<int> _wake_fds;
+
+   // Connection whitelist, cached in memory and reloaded when the file changes
+   ALMgr _whitelist;
+
 };
 
 
@@ -0,0 +1,60 @@
+#ifndef TICKETCACHE_H
+#define TICKETCACHE_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <time.h>
+#include <crypto++/secblock.h>
+
+// How long a session ticket can be used to resume after the handshake that issued it (seconds)
+const time_t ticket_ttl = 600;
+
+// Most tickets the server keeps at once, oldest are dropped past this
+const size_t max_tickets = 1024;
+
+/********************************************************************************************
+ * TicketCache - server-side store of session tickets. After a full handshake both ends
+ *               derive a ticket ID and a resumption secret from the session. The client keeps
+ *               its copy in the (persistent) connection, the server keeps its copy here so it
+ *               outlives the connection object. A reconnect within ticket_ttl presents the ID
+ *               and, if the server still has it, skips the challenge/response exchange.
+ *
+ *               Tickets are single use - take() removes the entry, and the resumed session
+ *               stores a fresh one.
+ ********************************************************************************************/
+
+class TicketCache
+{
+public:
+   TicketCache(time_t ttl = ticket_ttl);
+   ~TicketCache();
+
+   // Stores a ticket issued to node_id, replacing any with the same ID
+   void store(const std::vector<uint8_t> &id, const CryptoPP::SecByteBlock &secret,
+                                               const std::string &node_id);
+
+   // Removes the ticket and returns its secret if it exists, has not expired and was issued
+   // to node_id
+   bool take(const std::vector<uint8_t> &id, const std::string &node_id,
+                                             CryptoPP::SecByteBlock &secret);
+
+   size_t size() const { return _tickets.size(); };
+
+private:
+   // Drops expired tickets, then the oldest ones if still over max_tickets
+   void prune(time_t now);
+
+   struct ticket {
+      CryptoPP::SecByteBlock secret;
+      std::string node_id;
+      time_t expires;
+   };
+
+   std::map<std::vector<uint8_t>, ticket> _tickets;
+
+   time_t _ttl;
+};
+
+#endif
@@ -20,7 +20,7 @@ public:
     void testPrint();
 
 private:
-    std::vector<int> duplicateIndices;
+    std::vector<plot_handle> duplicateHandles;
     DronePlotDB &_plotDB;
     DronePlotDB tempPlotDB;
     DronePlot tempPlot;
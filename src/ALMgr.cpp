@@ -1,5 +1,8 @@
 #include <arpa/inet.h>
+#include <sys/stat.h>
 #include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
 #include "ALMgr.h"
 #include "strfuncts.h"
 
@@ -16,45 +19,114 @@ ALMgr::~ALMgr() {
  * isAllowed - checks to see if the IP address is in the list and allows/denies based off _is_whitelist
  *  
  *    Second version takes in an unsigned long IP Addr in network (big endian) format
+ *
+ *    Throws: runtime_error if the list file cannot be read
  ******************************************************************************************************/
 bool ALMgr::isAllowed(const char *ipaddr) {
    in_addr testaddr;
 
-   inet_pton(AF_INET, ipaddr, &testaddr);
+   if (inet_pton(AF_INET, ipaddr, &testaddr) != 1)
+      return !_is_whitelist;
    return isAllowed(testaddr.s_addr);
 }
 
 bool ALMgr::isAllowed(unsigned long ipaddr) {
+   refresh();
+
+   uint32_t addr = ntohl(static_cast<uint32_t>(ipaddr));
+
+   // Find the last range starting at or below the address and see if it covers it
+   auto rptr = std::upper_bound(_ranges.begin(), _ranges.end(), addr,
+                  [](uint32_t a, const std::pair<uint32_t, uint32_t> &r) { return a < r.first; });
+
+   bool found = (rptr != _ranges.begin()) && (addr <= (rptr - 1)->second);
+
+   if (_is_whitelist)
+      return found;
+   return !found;
+}
+
+/******************************************************************************************************
+ * refresh - stats the list file and reloads it if it is new, or its mtime, size or inode changed
+ *           (an editor that saves by renaming gives a new inode)
+ *
+ *    Throws: runtime_error if the list file cannot be read
+ ******************************************************************************************************/
+void ALMgr::refresh() {
+   struct stat st;
+
+   if (stat(_al_file.c_str(), &st) == -1) {
+      throw std::runtime_error("Unable to open white list file.");
+   }
+
+   if (_loaded && (st.st_mtim.tv_sec == _mtime.tv_sec) && (st.st_mtim.tv_nsec == _mtime.tv_nsec) &&
+                  (st.st_size == _size) && (st.st_ino == _inode))
+      return;
+
+   loadList();
+
+   _mtime = st.st_mtim;
+   _size = st.st_size;
+   _inode = st.st_ino;
+   _loaded = true;
+}
+
+/******************************************************************************************************
+ * loadList - parses the list file into sorted, merged address ranges. Lines are an IPv4 address with
+ *            an optional /prefix. Blank lines, # comments and lines that don't parse are skipped.
+ *
+ *    Throws: runtime_error if the list file cannot be opened
+ ******************************************************************************************************/
+void ALMgr::loadList() {
    FILE *alfile;
 
-   // First, find the IP address in the file
    if ((alfile = fopen(_al_file.c_str(), "r")) == NULL) {
       throw std::runtime_error("Unable to open white list file.");
    }
 
-   in_addr al_ip;
-   char strbuf[30];
-   strbuf[0] = '\0';
+   std::vector<std::pair<uint32_t, uint32_t>> ranges;
+   char strbuf[64];
    std::string ipstr;
 
-   while (fgets(strbuf, 30, alfile) != NULL) {
+   while (fgets(strbuf, sizeof(strbuf), alfile) != NULL) {
       ipstr = strbuf;
       clrNewlines(ipstr);
-      inet_pton(AF_INET, ipstr.c_str(), &al_ip);
-
-      if (al_ip.s_addr == ipaddr) {
-         fclose(alfile);
-         if (_is_whitelist)
-            return true;
-         else
-            return false;
+      clrSpaces(ipstr);
+
+      if ((ipstr.size() == 0) || (ipstr[0] == '#'))
+         continue;
+
+      // Split off the prefix length, if any
+      int prefix = 32;
+      std::string::size_type slash = ipstr.find('/');
+      if (slash != std::string::npos) {
+         char *endptr;
+         prefix = strtol(ipstr.c_str() + slash + 1, &endptr, 10);
+         if ((*endptr != '\0') || (endptr == ipstr.c_str() + slash + 1) || (prefix < 0) || (prefix > 32))
+            continue;
+         ipstr.erase(slash);
       }
+
+      in_addr al_ip;
+      if (inet_pton(AF_INET, ipstr.c_str(), &al_ip) != 1)
+         continue;
+
+      uint32_t mask = (prefix == 0) ? 0 : (0xFFFFFFFFu << (32 - prefix));
+      uint32_t first = ntohl(al_ip.s_addr) & mask;
+      ranges.emplace_back(first, first | ~mask);
    }
 
    fclose(alfile);
 
-   if (_is_whitelist)
-      return false;
-   return true;
-}
+   // Sort and merge overlapping or adjacent ranges
+   std::sort(ranges.begin(), ranges.end());
 
+   _ranges.clear();
+   for (auto &r : ranges) {
+      if ((_ranges.size() > 0) && ((_ranges.back().second == 0xFFFFFFFFu) ||
+                                   (r.first <= _ranges.back().second + 1)))
+         _ranges.back().second = std::max(_ranges.back().second, r.second);
+      else
+         _ranges.push_back(r);
+   }
+}
@@ -86,12 +86,10 @@ void AntennaSim::simulate() {
    _start_time = time(NULL);
 
    timespec sleeptime;
-   std::list<DronePlot>::iterator diter;
+   DronePlotDB::iterator diter;
 
    // Change all the inject timestamps to the offset time
-   for (diter = _source_db.begin(); diter != _source_db.end(); diter++) {
-      diter->timestamp += _time_offset;
-   }
+   _source_db.shiftTimestamps(_time_offset);
    
    // Loop through the injects, sending them as their time arrives
    while (_source_db.size() > 0) {
@@ -130,10 +128,8 @@ void AntennaSim::simulate() {
                   diter->drone_id << ", Time: " << diter->timestamp << " Lat: " << 
                   diter->latitude << ", Long: " << diter->longitude << "\n";
 
-         _to_db.addPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, diter->longitude);
-         diter = _to_db.end();
-         diter--;
-         diter->setFlags(DBFLAG_NEW);
+         _to_db.submitPlot(diter->drone_id, diter->node_id, diter->timestamp, diter->latitude, 
+                                                            diter->longitude, DBFLAG_NEW);
 
          _source_db.popFront();
          diter = _source_db.begin();
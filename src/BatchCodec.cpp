@@ -0,0 +1,216 @@
+#include <stdexcept>
+#include <cstring>
+#include <unordered_map>
+#include "BatchCodec.h"
+#include "DronePlotDB.h"
+
+// Longest varint for a 32 and 64 bit value, and the most one record can take compressed
+const size_t max_varint32 = 5;
+const size_t max_varint64 = 10;
+const size_t max_rec_encoded = max_varint32 * 4 + max_varint64;
+
+/**********************************************************************************************
+ * zigzag/unzigzag - map signed deltas to unsigned so small negative values stay small
+ **********************************************************************************************/
+
+static inline uint64_t zigzag(int64_t v) {
+   return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+   return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/**********************************************************************************************
+ * putVarint/getVarint - LEB128, seven bits per byte with the high bit set on all but the last
+ *
+ *    Returns: (put) the position after the varint
+ *             (get) false if the data ends mid-varint or it runs past 64 bits
+ **********************************************************************************************/
+
+static inline uint8_t *putVarint(uint8_t *p, uint64_t v) {
+   while (v >= 0x80) {
+      *p++ = (uint8_t) (v | 0x80);
+      v >>= 7;
+   }
+   *p++ = (uint8_t) v;
+   return p;
+}
+
+static inline bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+   v = 0;
+   for (unsigned int shift = 0; shift < 64; shift += 7) {
+      if (p == end)
+         return false;
+
+      uint8_t b = *p++;
+      v |= (uint64_t) (b & 0x7F) << shift;
+      if (!(b & 0x80))
+         return true;
+   }
+   return false;
+}
+
+/**********************************************************************************************
+ * putIDColumn/getIDColumn - 32 bit field as zigzag deltas from the previous record
+ **********************************************************************************************/
+
+static uint8_t *putIDColumn(uint8_t *p, const uint8_t *recs, size_t count, size_t offset) {
+   uint32_t prev = 0, cur;
+   for (size_t i=0; i<count; i++) {
+      memcpy(&cur, recs + i * plot_rec_size + offset, sizeof(cur));
+      p = putVarint(p, zigzag((int32_t) (cur - prev)));
+      prev = cur;
+   }
+   return p;
+}
+
+static bool getIDColumn(const uint8_t *&p, const uint8_t *end, uint8_t *recs, size_t count,
+                                                                               size_t offset) {
+   uint32_t prev = 0;
+   uint64_t v;
+   for (size_t i=0; i<count; i++) {
+      if (!getVarint(p, end, v))
+         return false;
+      prev += (uint32_t) unzigzag(v);
+      memcpy(recs + i * plot_rec_size + offset, &prev, sizeof(prev));
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * putTimeColumn/getTimeColumn - 64 bit timestamps as zigzag deltas from the previous record
+ **********************************************************************************************/
+
+static uint8_t *putTimeColumn(uint8_t *p, const uint8_t *recs, size_t count) {
+   uint64_t prev = 0, cur;
+   for (size_t i=0; i<count; i++) {
+      memcpy(&cur, recs + i * plot_rec_size + rec_timestamp, sizeof(cur));
+      p = putVarint(p, zigzag((int64_t) (cur - prev)));
+      prev = cur;
+   }
+   return p;
+}
+
+static bool getTimeColumn(const uint8_t *&p, const uint8_t *end, uint8_t *recs, size_t count) {
+   uint64_t prev = 0, v;
+   for (size_t i=0; i<count; i++) {
+      if (!getVarint(p, end, v))
+         return false;
+      prev += (uint64_t) unzigzag(v);
+      memcpy(recs + i * plot_rec_size + rec_timestamp, &prev, sizeof(prev));
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * putPosColumn/getPosColumn - latitude or longitude as zigzag deltas of the float bits from
+ *                             the same drone's last plot. The drone ID column must already be
+ *                             decoded when reading.
+ **********************************************************************************************/
+
+static uint8_t *putPosColumn(uint8_t *p, const uint8_t *recs, size_t count, size_t offset) {
+   std::unordered_map<uint32_t, uint32_t> last;
+   uint32_t prev = 0, cur, drone;
+
+   for (size_t i=0; i<count; i++) {
+      const uint8_t *rec = recs + i * plot_rec_size;
+      memcpy(&drone, rec + rec_drone_id, sizeof(drone));
+      memcpy(&cur, rec + offset, sizeof(cur));
+
+      auto lptr = last.emplace(drone, prev).first;
+      p = putVarint(p, zigzag((int32_t) (cur - lptr->second)));
+      lptr->second = prev = cur;
+   }
+   return p;
+}
+
+static bool getPosColumn(const uint8_t *&p, const uint8_t *end, uint8_t *recs, size_t count,
+                                                                               size_t offset) {
+   std::unordered_map<uint32_t, uint32_t> last;
+   uint32_t prev = 0, drone;
+   uint64_t v;
+
+   for (size_t i=0; i<count; i++) {
+      uint8_t *rec = recs + i * plot_rec_size;
+      if (!getVarint(p, end, v))
+         return false;
+      memcpy(&drone, rec + rec_drone_id, sizeof(drone));
+
+      auto lptr = last.emplace(drone, prev).first;
+      lptr->second = prev = lptr->second + (uint32_t) unzigzag(v);
+      memcpy(rec + offset, &prev, sizeof(prev));
+   }
+   return true;
+}
+
+/**********************************************************************************************
+ * compressBatch - encodes a replication batch in the columnar delta format. The output is
+ *                 sized for the worst case up front and trimmed afterwards.
+ *
+ *    Params: batch - <count><packed plot records>
+ *            out - the compressed batch is appended to it
+ *
+ *    Throws: runtime_error if the batch size does not match its count
+ **********************************************************************************************/
+
+void compressBatch(const std::vector<uint8_t> &batch, std::vector<uint8_t> &out) {
+   unsigned int count;
+   if (batch.size() < sizeof(count))
+      throw std::runtime_error("Batch passed to compressBatch is missing its count");
+
+   memcpy(&count, batch.data(), sizeof(count));
+   if (batch.size() != sizeof(count) + (size_t) count * plot_rec_size)
+      throw std::runtime_error("Batch passed to compressBatch does not match its count");
+
+   const uint8_t *recs = batch.data() + sizeof(count);
+
+   size_t start = out.size();
+   out.resize(start + 1 + max_varint32 + (size_t) count * max_rec_encoded);
+   uint8_t *p = out.data() + start;
+
+   *p++ = batch_codec_version;
+   p = putVarint(p, count);
+   p = putIDColumn(p, recs, count, rec_drone_id);
+   p = putIDColumn(p, recs, count, rec_node_id);
+   p = putTimeColumn(p, recs, count);
+   p = putPosColumn(p, recs, count, rec_latitude);
+   p = putPosColumn(p, recs, count, rec_longitude);
+
+   out.resize(p - out.data());
+}
+
+/**********************************************************************************************
+ * decompressBatch - decodes a compressed batch back into packed records
+ *
+ *    Params: data/len - the compressed batch
+ *            batch - receives <count><packed plot records>
+ *
+ *    Returns: false if the data is malformed, true otherwise
+ **********************************************************************************************/
+
+bool decompressBatch(const uint8_t *data, size_t len, std::vector<uint8_t> &batch) {
+   const uint8_t *p = data, *end = data + len;
+   uint64_t count;
+
+   if ((len < 1) || (*p++ != batch_codec_version))
+      return false;
+
+   // Every record takes at least a byte in each of the five columns
+   if (!getVarint(p, end, count) || (count > (size_t) (end - p) / 5))
+      return false;
+
+   unsigned int n = (unsigned int) count;
+   batch.resize(sizeof(n) + (size_t) n * plot_rec_size);
+   memcpy(batch.data(), &n, sizeof(n));
+
+   uint8_t *recs = batch.data() + sizeof(n);
+   if (!getIDColumn(p, end, recs, n, rec_drone_id) ||
+       !getIDColumn(p, end, recs, n, rec_node_id) ||
+       !getTimeColumn(p, end, recs, n) ||
+       !getPosColumn(p, end, recs, n, rec_latitude) ||
+       !getPosColumn(p, end, recs, n, rec_longitude))
+      return false;
+
+   return p == end;
+}
@@ -6,16 +6,14 @@
 #include <sstream>
 #include <fstream>
 #include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <sys/eventfd.h>
 
 #include "DronePlotDB.h"
 #include "strfuncts.h"
 #include "FileDesc.h"
-
-
-// Short compare function for database sort by timestamp
-bool compare_plot(const DronePlot &pp1, const DronePlot &pp2) {
-   return (pp1.timestamp < pp2.timestamp);
-}
+#include "RadixSort.h"
 
 /*****************************************************************************************
  * DronePlot - Constructor for a drone plot object, default initializers
@@ -52,13 +50,12 @@ DronePlot::~DronePlot() {
 
 /*****************************************************************************************
  * getDataSize - returns the total size in bytes of all data stored in this object, minus
- *               the flags data. Helpful when reserving space in the vector to improve
- *               serialization efficiency.
+ *               the flags data (the packed record size). Helpful when reserving space in the
+ *               vector to improve serialization efficiency.
  *****************************************************************************************/
 size_t DronePlot::getDataSize() {
 
-   return sizeof(drone_id) + sizeof(node_id) + sizeof(timestamp) + sizeof(latitude) +
-                     sizeof(longitude);
+   return plot_rec_size;
 }
 
 /*****************************************************************************************
@@ -71,23 +68,12 @@ size_t DronePlot::getDataSize() {
  *****************************************************************************************/
 void DronePlot::serialize(std::vector<uint8_t> &buf) {
 
-   uint8_t *dataptrs[5] = { (uint8_t *) &drone_id,
-                            (uint8_t *) &node_id,
-                            (uint8_t *) &timestamp,
-                            (uint8_t *) &latitude,
-                            (uint8_t *) &longitude };
-   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp), 
-                       sizeof(latitude), sizeof(longitude)};
-
    if (drone_id == 0)
       throw std::runtime_error("Die");
-   // Loop through all our data variables and their sizes, and push to vector byte by byte
-   for (unsigned int i=0; i<5; i++) { 
-      for (unsigned int j=0; j < sizes[i]; j++, dataptrs[i]++)
-      {  
-         buf.push_back(*dataptrs[i]);
-      }
-   }
+
+   size_t start = buf.size();
+   buf.resize(start + plot_rec_size);
+   encode(&buf[start]);
 }
 
 /*****************************************************************************************
@@ -103,24 +89,38 @@ void DronePlot::serialize(std::vector<uint8_t> &buf) {
  *****************************************************************************************/
 
 void DronePlot::deserialize(std::vector<uint8_t> &buf, unsigned int start_pt) {
-   uint8_t *dataptrs[5] = { (uint8_t *) &drone_id,
-                            (uint8_t *) &node_id,
-                            (uint8_t *) &timestamp,
-                            (uint8_t *) &latitude,
-                            (uint8_t *) &longitude };
-   uint8_t sizes[5] = {sizeof(drone_id), sizeof(node_id), sizeof(timestamp),
-                       sizeof(latitude), sizeof(longitude)};
-
-   // Loop through all our data variables and their sizes, and read in the data
-   unsigned int vpos = start_pt;
-   for (unsigned int i=0; i<5; i++) {
-      for (unsigned int j=0; j < sizes[i]; j++, dataptrs[i]++){
-         if (vpos > buf.size())
-            throw std::runtime_error("DronePlot deserialize ran out of data in vector buffer prematurely");
-         *dataptrs[i] = buf[vpos++];
-      }
-   }
+   if (start_pt + plot_rec_size > buf.size())
+      throw std::runtime_error("DronePlot deserialize ran out of data in vector buffer prematurely");
+
+   decode(&buf[start_pt]);
+}
+
+/*****************************************************************************************
+ * encode/decode - write or read this plot as one packed record (see plot_rec_size) in raw
+ *                 memory. The caller makes sure there are plot_rec_size bytes available.
+ *
+ *    Params:  rec - start of the record
+ *****************************************************************************************/
+
+void DronePlot::encode(uint8_t *rec) const {
+   int64_t ts = timestamp;
 
+   memcpy(rec + rec_drone_id, &drone_id, 4);
+   memcpy(rec + rec_node_id, &node_id, 4);
+   memcpy(rec + rec_timestamp, &ts, 8);
+   memcpy(rec + rec_latitude, &latitude, 4);
+   memcpy(rec + rec_longitude, &longitude, 4);
+}
+
+void DronePlot::decode(const uint8_t *rec) {
+   int64_t ts;
+
+   memcpy(&drone_id, rec + rec_drone_id, 4);
+   memcpy(&node_id, rec + rec_node_id, 4);
+   memcpy(&ts, rec + rec_timestamp, 8);
+   memcpy(&latitude, rec + rec_latitude, 4);
+   memcpy(&longitude, rec + rec_longitude, 4);
+   timestamp = ts;
 }
 
 /*****************************************************************************************
@@ -205,41 +205,594 @@ bool DronePlot::isFlagSet(unsigned short flags) {
    return (bool) (_flags & flags);
 }
 
+/*****************************************************************************************
+ * DronePlotRef - Constructor for the plot proxy, binds the attributes to the plot at the
+ *                given handle. Nothing is copied until the proxy is written through.
+ *****************************************************************************************/
+DronePlotRef::DronePlotRef(DronePlotDB &db, plot_handle handle):
+               drone_id(db, handle),
+               node_id(db, handle),
+               timestamp(db, handle),
+               latitude(db, handle),
+               longitude(db, handle),
+               _db(db),
+               _handle(handle)
+{
+
+}
+
+/*****************************************************************************************
+ * readChunk/writeChunk - the chunk holding handle, as is for reading, or copied first if a
+ *                        snapshot shares it for writing (see DronePlotDB::writableChunk)
+ *****************************************************************************************/
+const PlotChunk &DronePlotRef::readChunk(DronePlotDB &db, plot_handle handle) {
+   return db.chunkOf(handle);
+}
+
+PlotChunk &DronePlotRef::writeChunk(DronePlotDB &db, plot_handle handle) {
+   return db.writableChunk(handle);
+}
+
+/*****************************************************************************************
+ * getPlot - copies the referenced plot into a standalone DronePlot (flags not copied)
+ *****************************************************************************************/
+DronePlot DronePlotRef::getPlot() const {
+   return DronePlot(drone_id, node_id, timestamp, latitude, longitude);
+}
+
+// serialize and writeCSV behave exactly like their DronePlot counterparts
+void DronePlotRef::serialize(std::vector<uint8_t> &buf) const {
+   getPlot().serialize(buf);
+}
+
+void DronePlotRef::writeCSV(std::string &buf) const {
+   getPlot().writeCSV(buf);
+}
+
+// Flag manipulation on the flags column, see DronePlot::setFlags
+void DronePlotRef::setFlags(unsigned short flags) {
+   writeChunk(_db, _handle).flags[_handle & plot_chunk_mask] |= flags;
+}
+
+void DronePlotRef::clrFlags(unsigned short flags) {
+   writeChunk(_db, _handle).flags[_handle & plot_chunk_mask] &= ~flags;
+}
+
+bool DronePlotRef::isFlagSet(unsigned short flags) const {
+   return (bool) (readChunk(_db, _handle).flags[_handle & plot_chunk_mask] & flags);
+}
+
+/*****************************************************************************************
+ * iterator - Constructor, positions the iterator on the first live slot at or after pos
+ *****************************************************************************************/
+DronePlotDB::iterator::iterator(DronePlotDB *db, plot_handle pos):_db(db),_pos(pos),_seg(0) {
+   if (_pos < _db->_size)
+      _seg = _db->segmentOf(_pos);
+   skipErased();
+}
+
+DronePlotDB::iterator &DronePlotDB::iterator::operator++() {
+   _pos++;
+   skipErased();
+   return *this;
+}
+
+DronePlotDB::iterator DronePlotDB::iterator::operator++(int) {
+   iterator prev = *this;
+   ++(*this);
+   return prev;
+}
+
+void DronePlotDB::iterator::skipErased() {
+   while (_pos < _db->_size) {
+      plot_handle end = _db->segmentEnd(_seg);
+      if (_pos >= end)
+         _seg++;
+      else if (_db->_segments[_seg].live == 0)
+         _pos = end;
+      else if (_db->chunkOf(_pos).flags[_pos & plot_chunk_mask] & DBFLAG_ERASED)
+         _pos++;
+      else
+         break;
+   }
+}
+
+/*****************************************************************************************
+ * DronePlotSnapshot - Constructors. The default is an empty snapshot; the other is used by
+ *                     DronePlotDB::snapshot to share its chunk directory
+ *****************************************************************************************/
+DronePlotSnapshot::DronePlotSnapshot():_chunks(std::make_shared<plot_chunk_dir>()),
+                                       _slots(0),
+                                       _head(0),
+                                       _live(0)
+{
+
+}
+
+DronePlotSnapshot::DronePlotSnapshot(std::shared_ptr<const plot_chunk_dir> chunks, size_t slots,
+                                     plot_handle head, size_t live):
+                                       _chunks(chunks),
+                                       _slots(slots),
+                                       _head(head),
+                                       _live(live)
+{
+
+}
+
+/*****************************************************************************************
+ * isValid - true if the handle was a live plot when the snapshot was taken
+ *****************************************************************************************/
+bool DronePlotSnapshot::isValid(plot_handle handle) const {
+   return (handle >= _head) && (handle < _slots) && !(getFlags(handle) & DBFLAG_ERASED);
+}
+
+DronePlot DronePlotSnapshot::getPlot(plot_handle handle) const {
+   return DronePlotDB::readPlot(*_chunks, handle);
+}
+
+/*****************************************************************************************
+ * iterator - Constructor, positions the snapshot iterator on the first live slot at or
+ *            after pos
+ *****************************************************************************************/
+DronePlotSnapshot::iterator::iterator(const DronePlotSnapshot *snap, plot_handle pos):
+                                                                  _snap(snap),_pos(pos) {
+   skipErased();
+}
+
+DronePlotSnapshot::iterator &DronePlotSnapshot::iterator::operator++() {
+   _pos++;
+   skipErased();
+   return *this;
+}
+
+DronePlotSnapshot::iterator DronePlotSnapshot::iterator::operator++(int) {
+   iterator prev = *this;
+   ++(*this);
+   return prev;
+}
+
+void DronePlotSnapshot::iterator::skipErased() {
+   while ((_pos < _snap->_slots) && (_snap->getFlags(_pos) & DBFLAG_ERASED))
+      _pos++;
+}
+
 /*****************************************************************************************
  * DronePlotDB - Constructor, currently initializes the mutex only
  *
  *****************************************************************************************/
-DronePlotDB::DronePlotDB() {
+DronePlotDB::DronePlotDB():_chunks(std::make_shared<plot_chunk_dir>()),
+                           _size(0),
+                           _head(0),
+                           _live(0),
+                           _dedup_enabled(false),
+                           _dedup_grid(dedup_grid_size),
+                           _dedup_window(dedup_time_window),
+                           _dup_count(0),
+                           _notify_fd(-1),
+                           _notify_threshold(0),
+                           _submitted(submit_ring_size)
+{
 
    // Initialize our mutex for thread protection
    pthread_mutex_init(&_mutex, NULL);
 }
 
-// No behavior for destructor yet
 DronePlotDB::~DronePlotDB() {
+   if (_notify_fd != -1)
+      close(_notify_fd);
+}
+
+/*****************************************************************************************
+ * appendPlot - pushes a plot onto the end of every column. If the duplicate index is on,
+ *              the plot is checked first and dropped if it duplicates a stored plot.
+ *              Does not lock the mutex.
+ *
+ *    Returns: the handle of the new plot, invalid_plot if it was a duplicate
+ *****************************************************************************************/
+
+plot_handle DronePlotDB::appendPlot(const DronePlot &plot, unsigned short flags) {
+   if (_dedup_enabled && (findDuplicate(_dedup_index, *_chunks, plot) != invalid_plot)) {
+      _dup_count++;
+      return invalid_plot;
+   }
+
+   PlotChunk &chunk = nextSlotChunk(plot.timestamp);
+   plot_handle handle = _size;
+   size_t slot = handle & plot_chunk_mask;
+
+   if (_dedup_enabled)
+      _dedup_index.emplace(makeDedupKey(plot), handle);
+
+   chunk.drone_id[slot] = plot.drone_id;
+   chunk.node_id[slot] = plot.node_id;
+   chunk.timestamp[slot] = plot.timestamp;
+   chunk.latitude[slot] = plot.latitude;
+   chunk.longitude[slot] = plot.longitude;
+   chunk.flags[slot] = flags & ~DBFLAG_ERASED;
+   _size++;
+
+   if (flags & DBFLAG_NEW) {
+      _pending.push_back(handle);
+      signalPending(_pending.size() - 1);
+   }
+
+   addToTrack(plot.drone_id, plot.timestamp, handle);
+   addToRun(plot.node_id, plot.timestamp, handle);
+
+   _live++;
+   return handle;
+}
+
+/*****************************************************************************************
+ * isShared - true if a snapshot still holds p. A count of one means every snapshot that
+ *            held it has let go, and the fence makes their reads happen before our writes.
+ *****************************************************************************************/
+
+template <class T>
+static bool isShared(const std::shared_ptr<T> &p) {
+   if (p.use_count() > 1)
+      return true;
+
+   std::atomic_thread_fence(std::memory_order_acquire);
+   return false;
+}
+
+/*****************************************************************************************
+ * reserveColumns - reserves directory entries for n slots so a known number of appends
+ *                  does not reallocate the directory part way through. Does not lock the
+ *                  mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::reserveColumns(size_t n) {
+   size_t chunks = (n + plot_chunk_mask) >> plot_chunk_bits;
+
+   if (!isShared(_chunks))
+      _chunks->reserve(chunks);
+}
+
+/*****************************************************************************************
+ * writableChunk - returns the chunk holding h, first copying the directory and then the
+ *                 chunk if a snapshot shares them. Does not lock the mutex.
+ *****************************************************************************************/
+
+PlotChunk &DronePlotDB::writableChunk(plot_handle h) {
+   if (isShared(_chunks))
+      _chunks = std::make_shared<plot_chunk_dir>(*_chunks);
+
+   std::shared_ptr<PlotChunk> &chunk = (*_chunks)[h >> plot_chunk_bits];
+   if (isShared(chunk))
+      chunk = std::make_shared<PlotChunk>(*chunk);
+
+   return *chunk;
+}
+
+/*****************************************************************************************
+ * nextSlotChunk - returns the chunk for the next slot, for a plot with the given timestamp.
+ *                 If the plot is segment_duration or more newer than the first plot in the
+ *                 current segment, a new segment starts at the slot; the slots stay packed,
+ *                 so segments cost no storage. A new chunk is added when the last one is full
+ *                 (a snapshot's directory is never grown, so a shared one is copied first).
+ *                 The segment's time bounds and live count include the new plot.
+ *                 Does not lock the mutex.
+ *****************************************************************************************/
+
+PlotChunk &DronePlotDB::nextSlotChunk(time_t timestamp) {
+   if ((_size & plot_chunk_mask) == 0) {
+      if (isShared(_chunks))
+         _chunks = std::make_shared<plot_chunk_dir>(*_chunks);
+      _chunks->push_back(std::make_shared<PlotChunk>());
+   }
+
+   if (_segments.empty() || (timestamp >= _segments.back().start_ts + segment_duration)) {
+      segment_info seg;
+      seg.first = _size;
+      seg.start_ts = timestamp;
+      seg.min_ts = timestamp;
+      seg.max_ts = timestamp;
+      seg.live = 0;
+      _segments.push_back(seg);
+   }
+
+   segment_info &seg = _segments.back();
+   seg.min_ts = std::min(seg.min_ts, timestamp);
+   seg.max_ts = std::max(seg.max_ts, timestamp);
+   seg.live++;
+
+   return chunkOf(_size);
+}
 
+/*****************************************************************************************
+ * readPlot - copies the plot at h out of a chunk directory (flags not copied)
+ *****************************************************************************************/
+
+DronePlot DronePlotDB::readPlot(const plot_chunk_dir &chunks, plot_handle h) {
+   const PlotChunk &chunk = *chunks[h >> plot_chunk_bits];
+   size_t slot = h & plot_chunk_mask;
+
+   return DronePlot(chunk.drone_id[slot], chunk.node_id[slot], chunk.timestamp[slot],
+                    chunk.latitude[slot], chunk.longitude[slot]);
+}
+
+/*****************************************************************************************
+ * eraseSlot - marks a slot erased and moves _head past any erased slots at the front.
+ *             Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::eraseSlot(plot_handle handle) {
+   if (!isValid(handle))
+      throw std::runtime_error("Attempted to erase a plot handle that is not in the database.");
+
+   if (_dedup_enabled)
+      removeFromDedupIndex(handle);
+   removeFromTrack(handle);
+   removeFromRuns(handle);
+
+   writableChunk(handle).flags[handle & plot_chunk_mask] |= DBFLAG_ERASED;
+   _segments[segmentOf(handle)].live--;
+   _live--;
+
+   advanceHead();
+}
+
+/*****************************************************************************************
+ * segmentOf - index of the segment holding h, by binary search on the segments' first
+ *             handles. h must be below _size.
+ *
+ * segmentEnd - the first handle past segment seg (_size for the last one)
+ *****************************************************************************************/
+
+size_t DronePlotDB::segmentOf(plot_handle h) const {
+   auto next = std::upper_bound(_segments.begin(), _segments.end(), h,
+                     [](plot_handle val, const segment_info &seg) { return val < seg.first; });
+   return (next - _segments.begin()) - 1;
+}
+
+plot_handle DronePlotDB::segmentEnd(size_t seg) const {
+   return (seg + 1 < _segments.size()) ? _segments[seg + 1].first : _size;
+}
+
+/*****************************************************************************************
+ * advanceHead - moves _head past erased slots, skipping whole segments with no live plots
+ *               in one step. Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::advanceHead() {
+   if (_head >= _size)
+      return;
+
+   size_t seg = segmentOf(_head);
+   while (_head < _size) {
+      plot_handle end = segmentEnd(seg);
+      if (_head >= end)
+         seg++;
+      else if (_segments[seg].live == 0)
+         _head = end;
+      else if (chunkOf(_head).flags[_head & plot_chunk_mask] & DBFLAG_ERASED)
+         _head++;
+      else
+         break;
+   }
+}
+
+/*****************************************************************************************
+ * DedupKeyHash - mixes the key fields into a single hash value
+ *****************************************************************************************/
+
+size_t DronePlotDB::DedupKeyHash::operator()(const DedupKey &key) const {
+   uint64_t hash = key.drone_id;
+   hash = (hash * 0x9E3779B97F4A7C15ULL) ^ static_cast<uint32_t>(key.lat);
+   hash = (hash * 0x9E3779B97F4A7C15ULL) ^ static_cast<uint32_t>(key.lon);
+   hash = (hash * 0x9E3779B97F4A7C15ULL) ^ static_cast<uint64_t>(key.bucket);
+   return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+/*****************************************************************************************
+ * makeDedupKey - builds the duplicate index key for a plot: the drone ID, the lat/long
+ *                quantized to the grid and the timestamp divided into windows
+ *****************************************************************************************/
+
+DronePlotDB::DedupKey DronePlotDB::makeDedupKey(const DronePlot &plot) {
+   DedupKey key;
+   key.drone_id = plot.drone_id;
+   key.lat = static_cast<int32_t>(std::floor(plot.latitude / _dedup_grid));
+   key.lon = static_cast<int32_t>(std::floor(plot.longitude / _dedup_grid));
+
+   // Floor division so negative timestamps bucket the same way as positive ones
+   key.bucket = plot.timestamp / _dedup_window;
+   if ((plot.timestamp % _dedup_window) < 0)
+      key.bucket--;
+   return key;
+}
+
+/*****************************************************************************************
+ * findDuplicate - probes the index for a plot that duplicates the given one. A match has
+ *                 the same drone, a lat/long within _dedup_grid of this one on each axis
+ *                 and is within _dedup_window seconds. Plots from the same node only match
+ *                 on an identical timestamp (a re-delivery), since a node never sees the
+ *                 same sighting twice. Two close positions can fall either side of a cell
+ *                 edge, and the window can straddle a bucket edge, so the neighboring cells
+ *                 and buckets (3 x 3 x 3 keys) are probed as well.
+ *
+ *    Returns: the handle of the matching plot, or invalid_plot if none
+ *****************************************************************************************/
+
+plot_handle DronePlotDB::findDuplicate(dedup_index &index, const plot_chunk_dir &chunks,
+                                                                     const DronePlot &plot) {
+   DedupKey center = makeDedupKey(plot);
+   DedupKey key = center;
+
+   for (key.lat = center.lat - 1; key.lat <= center.lat + 1; key.lat++) {
+      for (key.lon = center.lon - 1; key.lon <= center.lon + 1; key.lon++) {
+         for (key.bucket = center.bucket - 1; key.bucket <= center.bucket + 1; key.bucket++) {
+            auto range = index.equal_range(key);
+            for (auto it = range.first; it != range.second; it++) {
+               plot_handle h = it->second;
+               const PlotChunk &chunk = *chunks[h >> plot_chunk_bits];
+               size_t slot = h & plot_chunk_mask;
+
+               if ((std::fabs(chunk.latitude[slot] - plot.latitude) > _dedup_grid) ||
+                   (std::fabs(chunk.longitude[slot] - plot.longitude) > _dedup_grid))
+                  continue;
+
+               time_t diff = chunk.timestamp[slot] - plot.timestamp;
+               if (diff < 0)
+                  diff = -diff;
+
+               if (diff > _dedup_window)
+                  continue;
+               if ((chunk.node_id[slot] != plot.node_id) || (diff == 0))
+                  return h;
+            }
+         }
+      }
+   }
+   return invalid_plot;
+}
+
+/*****************************************************************************************
+ * removeFromDedupIndex - drops the index entry that points at the given handle
+ *****************************************************************************************/
+
+void DronePlotDB::removeFromDedupIndex(plot_handle handle) {
+   DedupKey key = makeDedupKey(readPlot(*_chunks, handle));
+   auto range = _dedup_index.equal_range(key);
+   for (auto it = range.first; it != range.second; it++) {
+      if (it->second == handle) {
+         _dedup_index.erase(it);
+         return;
+      }
+   }
+}
+
+/*****************************************************************************************
+ * rebuildDedupIndex - re-indexes every live plot (handles change when the store is sorted)
+ *****************************************************************************************/
+
+void DronePlotDB::rebuildDedupIndex() {
+   _dedup_index.clear();
+   _dedup_index.reserve(_live);
+
+   for (iterator dptr = begin(); dptr != end(); dptr++)
+      _dedup_index.emplace(makeDedupKey(readPlot(*_chunks, dptr.getHandle())), dptr.getHandle());
+}
+
+/*****************************************************************************************
+ * enableDedup - turns on duplicate rejection for all future inserts and indexes the plots
+ *               already stored
+ *
+ *    Params:  grid_size - lat/long quantization in degrees
+ *             time_window - max seconds apart for two plots to be the same sighting
+ *****************************************************************************************/
+
+void DronePlotDB::enableDedup(float grid_size, time_t time_window) {
+   if ((grid_size <= 0.0) || (time_window <= 0))
+      throw std::runtime_error("Duplicate index grid size and time window must be positive.");
+
+   lockStore();
+
+   _dedup_grid = grid_size;
+   _dedup_window = time_window;
+   _dedup_enabled = true;
+   rebuildDedupIndex();
+
+   pthread_mutex_unlock(&_mutex);
 }
 
+/*****************************************************************************************
+ * findDuplicates - one pass over a snapshot with a scratch index, collecting each plot that
+ *                  duplicates one seen earlier in storage order. Plots can be added while
+ *                  the scan runs; the handles found may have been erased by the time the
+ *                  caller uses them, so remove them with eraseIfValid, which checks under
+ *                  the mutex.
+ *
+ *    Params:  dups - handles of the duplicates are appended here
+ *****************************************************************************************/
+
+void DronePlotDB::findDuplicates(std::vector<plot_handle> &dups) {
+   DronePlotSnapshot snap = snapshot();
+
+   dedup_index seen;
+   seen.reserve(snap.size());
+
+   for (auto dptr = snap.begin(); dptr != snap.end(); dptr++) {
+      DronePlot plot = *dptr;
+      if (findDuplicate(seen, *snap._chunks, plot) != invalid_plot)
+         dups.push_back(dptr.getHandle());
+      else
+         seen.emplace(makeDedupKey(plot), dptr.getHandle());
+   }
+}
 
 /*****************************************************************************************
- * addPlot - Adds a plot object at the end of the doubly-linked list
+ * addPlot - Adds a plot object at the end of the store
  *
  *    Params:  drone_id - the unique integer ID of this particular drone
  *             node_id - the unique integer ID of the receiving site
  *             timestamp - the plot's time in seconds
  *             latitude - floating point latitude coordinate of this plot point
  *             longitude - floating point longitude coordinate of this plot point
+ *             flags - initial flags for the plot, set under the same lock as the insert
+ *
+ *    Returns: the handle of the new plot
  *             
  *****************************************************************************************/
 
-void DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, float longitude) {
+plot_handle DronePlotDB::addPlot(int drone_id, int node_id, time_t timestamp, float latitude, 
+                                                      float longitude, unsigned short flags) {
    // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
+   lockStore();
 
-   _dbdata.emplace_back(drone_id, node_id, timestamp, latitude, longitude);
+   plot_handle handle = appendPlot(DronePlot(drone_id, node_id, timestamp, latitude, longitude),
+                                                                                        flags);
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
+   return handle;
+}
+
+/*****************************************************************************************
+ * submitPlot - queues a plot for the store without taking the mutex. Params are the same
+ *              as addPlot. The plot is added by the next thread to lock the database; if the
+ *              ring was caught up the notify eventfd is signaled so that happens soon. Single
+ *              producer only.
+ *****************************************************************************************/
+
+void DronePlotDB::submitPlot(int drone_id, int node_id, time_t timestamp, float latitude,
+                                                      float longitude, unsigned short flags) {
+   submitted_plot entry;
+   entry.plot = DronePlot(drone_id, node_id, timestamp, latitude, longitude);
+   entry.flags = flags;
+
+   bool first = false;
+   if (!_submitted.push(entry, &first)) {
+      // Ring is full - addPlot drains it before appending, so order is kept
+      addPlot(drone_id, node_id, timestamp, latitude, longitude, flags);
+      return;
+   }
+
+   if (first)
+      wakeConsumer();
+}
+
+/*****************************************************************************************
+ * lockStore - locks the mutex, then moves submitted plots into the store so the caller
+ *             sees them. The mutex also keeps the ring to one consumer at a time.
+ *****************************************************************************************/
+
+void DronePlotDB::lockStore() {
+   pthread_mutex_lock(&_mutex);
+   drainSubmitted();
+}
+
+/*****************************************************************************************
+ * drainSubmitted - appends the plots waiting in the submit ring. Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::drainSubmitted() {
+   submitted_plot entry;
+
+   while (_submitted.pop(entry))
+      appendPlot(entry.plot, entry.flags);
 }
 
 /*****************************************************************************************
@@ -265,7 +818,7 @@ int DronePlotDB::loadCSVFile(const char *filename) {
    // Get line by line, parsing out our data
    std::string buf, data;
    int count = 0;
-   std::list<DronePlot>::iterator newplot;
+   DronePlot newplot;
   
    while (!cfile.eof()) {
       std::getline(cfile, buf);
@@ -273,15 +826,11 @@ int DronePlotDB::loadCSVFile(const char *filename) {
       if (buf.size() == 0)
          continue;
       
-      // Add this to the end and get an iterator pointing to it
-      _dbdata.emplace_back(-1, -1, 0, 0.0, 0.0);
-      newplot = _dbdata.end();
-      newplot--;
-
-      if (newplot->readCSV(buf) == -1)
+      if (newplot.readCSV(buf) == -1)
          return -1;
 
       // Add it to the database 
+      appendPlot(newplot, 0);
       count++;
    }
    cfile.close();
@@ -293,12 +842,14 @@ int DronePlotDB::loadCSVFile(const char *filename) {
  *               drone_id,node_id,timestamp,latitude,longitude
  *
  *    Params:  filename - the path/filename of the CSV file to write to
+ *             time_order - write plots in timestamp order (merged from the node runs)
+ *                          instead of storage order
  *
  *    Returns: -1 if there was an issue reading the file, otherwise num read in
  *
  *****************************************************************************************/
 
-int DronePlotDB::writeCSVFile(const char *filename) {
+int DronePlotDB::writeCSVFile(const char *filename, bool time_order) {
    std::ofstream cfile;
    int count = 0;
 
@@ -306,12 +857,30 @@ int DronePlotDB::writeCSVFile(const char *filename) {
    if (cfile.fail())
       return -1;
 
+   // Write from a snapshot so plots can keep arriving while the file is written. The order is
+   // taken under the same lock so it matches the snapshot
+   std::vector<plot_handle> order;
+
+   lockStore();
+   DronePlotSnapshot snap(_chunks, _size, _head, _live);
+   if (time_order)
+      timeOrder(order);
+   pthread_mutex_unlock(&_mutex);
+
    std::string buf;
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->writeCSV(buf);
-      cfile << buf;
-      count++;
+   if (time_order) {
+      for (plot_handle h : order) {
+         snap.getPlot(h).writeCSV(buf);
+         cfile << buf;
+         count++;
+      }
+   } else {
+      for (auto lptr = snap.begin(); lptr != snap.end(); lptr++) {
+         DronePlot plot = *lptr;
+         plot.writeCSV(buf);
+         cfile << buf;
+         count++;
+      }
    }
 
    cfile.close();
@@ -336,15 +905,18 @@ int DronePlotDB::writeBinaryFile(const char *filename) {
    if (!outfile.openFile(FileFD::writefd, true))
       return -1;
 
+   // Write from a snapshot so plots can keep arriving while the file is written
+   DronePlotSnapshot snap = snapshot();
+
    // Prep our vector that will be storing our plotpt data with exactly the right size
    std::vector<uint8_t> plot;
-   unsigned int ppsize = DronePlot::getDataSize() * _dbdata.size();
+   unsigned int ppsize = DronePlot::getDataSize() * snap.size();
    plot.reserve(ppsize);
 
    // Loop through all data points and write them to our binary vector
-   std::list<DronePlot>::iterator lptr = _dbdata.begin();
-   for ( ; lptr != _dbdata.end(); lptr++) {
-      lptr->serialize(plot);
+   for (auto lptr = snap.begin(); lptr != snap.end(); lptr++) {
+      DronePlot next = *lptr;
+      next.serialize(plot);
 
       count++;
    }
@@ -356,85 +928,315 @@ int DronePlotDB::writeBinaryFile(const char *filename) {
 }
 
 /*****************************************************************************************
- * loadBinaryFile - reads the contents of a binary dump of the data into the database
+ * loadBinaryFile - reads the contents of a binary dump of the data into the database. The
+ *                  file is memory mapped and its size checked once, then the records are
+ *                  decoded straight into the columns. With the duplicate index off this is
+ *                  a single pass per column with no per-plot objects or system calls.
  *
  *    Params:  filename - the path/filename of the input file
  *
- *    Returns: -1 if there was an issue opening the file, otherwise num read in 
+ *    Returns: -1 if there was an issue opening the file or it is not a whole number of
+ *             plot records (possibly corrupted), otherwise num read in 
  *
  *****************************************************************************************/
 
 int DronePlotDB::loadBinaryFile(const char *filename) {
-   std::vector<uint8_t> buf;
-   std::list<DronePlot>::iterator dptr;
-
    FileFD infile(filename);
-   int count = 0;
 
    if (!infile.openFile(FileFD::readfd))
       return -1;
 
-   // Loop through grabbing the bytes of each plotpt
-   unsigned int size = 0;
-   unsigned int ppsize = DronePlot::getDataSize();
-   while ((size = infile.readBytes<uint8_t>(buf, ppsize)) == ppsize) {
-      _dbdata.emplace_back();
-      dptr = _dbdata.end();
-      dptr--;
-
-      // Deserialize
-      dptr->deserialize(buf);
-      buf.clear();
+   const uint8_t *data;
+   size_t len;
+   if (!infile.mapFile(data, len))
+      return -1;
 
-      count++;
-   }
-   
-   // Final read should be size = 0 or this may be a corrupted file
-   if (size != 0) {
+   // A partial record at the end means this may be a corrupted file
+   size_t ppsize = DronePlot::getDataSize();
+   if (len % ppsize != 0)
       return -1;
-   }
 
+   size_t count = len / ppsize;
+   appendRecords(data, count, 0);
+
+   infile.unmapFile();
    infile.closeFD();
    return count; 
 }
 
 /*****************************************************************************************
- * popFront - removes the front element from the database 
+ * encodePlots - gathers plots from the columns into consecutive packed records. Does not
+ *               lock the mutex, so hold it while the handles are in use.
  *
- *    Note: this locks the mutex and may block if it is already locked.
+ *    Params:  handles - the plots to encode, in order
+ *             count - number of handles
+ *             out - where to write the records, count * plot_rec_size bytes
  *
  *****************************************************************************************/
 
-void DronePlotDB::popFront() {
-   // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
-
-   _dbdata.pop_front();
-
-   // Unlock the mutex before we exit
-   pthread_mutex_unlock(&_mutex);
+void DronePlotDB::encodePlots(const plot_handle *handles, size_t count, uint8_t *out) {
+   for (size_t i=0; i<count; i++, out += plot_rec_size) {
+      plot_handle h = handles[i];
+      const PlotChunk &chunk = chunkOf(h);
+      size_t slot = h & plot_chunk_mask;
+      int64_t ts = chunk.timestamp[slot];
+
+      memcpy(out + rec_drone_id, &chunk.drone_id[slot], 4);
+      memcpy(out + rec_node_id, &chunk.node_id[slot], 4);
+      memcpy(out + rec_timestamp, &ts, 8);
+      memcpy(out + rec_latitude, &chunk.latitude[slot], 4);
+      memcpy(out + rec_longitude, &chunk.longitude[slot], 4);
+   }
 }
 
 /*****************************************************************************************
- * erase - removes the DronePlot at the specified index
+ * addPlotBatch - adds a batch of packed plot records (e.g. from replication) to the database
+ *                while holding the mutex once for the whole batch
  *
- *    Warning: this has up to linear time speed--better to use iterators when possible
+ *    Params:  data - the records, count * plot_rec_size bytes
+ *             count - number of records
+ *             flags - flags to give each new plot
  *
- *    Note: this locks the mutex and may block if it is already locked.
+ *    Returns: number of plots added (less than count if duplicates were rejected)
  *
  *****************************************************************************************/
 
-void DronePlotDB::erase(unsigned int i) {
-   // First lock the mutex (blocking)
+size_t DronePlotDB::addPlotBatch(const uint8_t *data, size_t count, unsigned short flags) {
+   lockStore();
+
+   size_t added;
+   try {
+      added = appendRecords(data, count, flags);
+   } catch (...) {
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return added;
+}
+
+/*****************************************************************************************
+ * appendRecords - decodes packed plot records onto the end of the columns. With the
+ *                 duplicate index off the records are decoded straight into the chunks a
+ *                 chunk at a time; with it on, each plot goes through appendPlot to be
+ *                 checked.
+ *                 Does not lock the mutex.
+ *
+ *    Returns: number of plots added
+ *****************************************************************************************/
+
+size_t DronePlotDB::appendRecords(const uint8_t *data, size_t count, unsigned short flags) {
+   size_t start = _size;
+
+   if (_dedup_enabled) {
+      size_t added = 0;
+      DronePlot newplot;
+
+      reserveColumns(start + count);
+      for (size_t i=0; i<count; i++, data += plot_rec_size) {
+         newplot.decode(data);
+         if (appendPlot(newplot, flags) != invalid_plot)
+            added++;
+      }
+      return added;
+   }
+
+   size_t before = _pending.size();
+
+   reserveColumns(start + count);
+   for (size_t i=0; i<count; i++, data += plot_rec_size) {
+      int64_t ts;
+      memcpy(&ts, data + rec_timestamp, 8);
+
+      PlotChunk &chunk = nextSlotChunk(ts);
+      size_t slot = _size & plot_chunk_mask;
+
+      memcpy(&chunk.drone_id[slot], data + rec_drone_id, 4);
+      memcpy(&chunk.node_id[slot], data + rec_node_id, 4);
+      memcpy(&chunk.latitude[slot], data + rec_latitude, 4);
+      memcpy(&chunk.longitude[slot], data + rec_longitude, 4);
+      chunk.timestamp[slot] = ts;
+      chunk.flags[slot] = flags & ~DBFLAG_ERASED;
+      addToTrack(chunk.drone_id[slot], ts, _size);
+      addToRun(chunk.node_id[slot], ts, _size);
+
+      if (flags & DBFLAG_NEW)
+         _pending.push_back(_size);
+      _size++;
+   }
+
+   if (flags & DBFLAG_NEW)
+      signalPending(before);
+
+   _live += count;
+   return count;
+}
+
+/*****************************************************************************************
+ * getPendingCount - number of plots logged as new since the last takePending (including
+ *                   any erased since, which takePending will skip)
+ *****************************************************************************************/
+
+size_t DronePlotDB::getPendingCount() {
+   lockStore();
+   size_t count = _pending.size();
+   pthread_mutex_unlock(&_mutex);
+   return count;
+}
+
+/*****************************************************************************************
+ * getNotifyFD - returns the pending-log eventfd, creating it on the first call
+ *
+ *    Throws: runtime_error if the eventfd cannot be created
+ *****************************************************************************************/
+
+int DronePlotDB::getNotifyFD() {
    pthread_mutex_lock(&_mutex);
 
-   if (i > _dbdata.size())
-      throw std::runtime_error("erase function called with index out of scope for std::list.");
+   if (_notify_fd == -1)
+      _notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+   int fd = _notify_fd;
+   pthread_mutex_unlock(&_mutex);
+
+   if (fd == -1)
+      throw std::runtime_error("Unable to create the database notify eventfd.");
+   return fd;
+}
+
+/*****************************************************************************************
+ * signalPending - wakes the consumer when the first plots arrive after a takePending, or
+ *                 when the log crosses the threshold. Plots in between just accumulate, so
+ *                 a steady stream costs two signals per batch rather than one per plot.
+ *                 Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::signalPending(size_t before) {
+   if (_notify_fd == -1)
+      return;
 
-   std::list<DronePlot>::iterator diter = _dbdata.begin();
+   size_t after = _pending.size();
+   bool first = (before == 0) && (after > 0);
+   bool full = (_notify_threshold > 0) && (before < _notify_threshold) &&
+                                          (after >= _notify_threshold);
+
+   if (first || full)
+      wakeConsumer();
+}
+
+/*****************************************************************************************
+ * wakeConsumer - bumps the notify eventfd (if one was created) to wake its watcher
+ *****************************************************************************************/
+
+void DronePlotDB::wakeConsumer() {
+   int fd = _notify_fd;
+   if (fd == -1)
+      return;
+
+   uint64_t one = 1;
+   if (write(fd, &one, sizeof(one)) == -1) {
+      // Only fails if the counter is about to overflow, so a wakeup is already waiting
+   }
+}
+
+/*****************************************************************************************
+ * takePending - collects the plots logged as new since the last call. Logged plots that were
+ *               erased, or had DBFLAG_NEW cleared some other way, are skipped. The rest
+ *               have DBFLAG_NEW swapped for DBFLAG_SYNCD. Does not lock the mutex.
+ *
+ *    Params:  handles - replaced with the pending handles, in insertion order
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::takePending(std::vector<plot_handle> &handles) {
+   handles.swap(_pending);
+   _pending.clear();
+
+   size_t kept = 0;
+   for (size_t i=0; i<handles.size(); i++) {
+      plot_handle h = handles[i];
+      if (isValid(h) && (chunkOf(h).flags[h & plot_chunk_mask] & DBFLAG_NEW)) {
+         unsigned short &flags = writableChunk(h).flags[h & plot_chunk_mask];
+         flags = (flags & ~DBFLAG_NEW) | DBFLAG_SYNCD;
+         handles[kept++] = h;
+      }
+   }
+   handles.resize(kept);
+}
+
+/*****************************************************************************************
+ * collectSynced - collects the live plots marked DBFLAG_SYNCD in a handle range, in order.
+ *                 Plots erased or dropped by retention since are skipped. Does not lock the
+ *                 mutex.
+ *
+ *    Params:  first, last - the handle range to look through (inclusive)
+ *             max_count - the most plots to collect
+ *             handles - replaced with the plots found
+ *
+ *    Returns: the handle after the last one looked at, past last once the range is done
+ *
+ *****************************************************************************************/
+
+plot_handle DronePlotDB::collectSynced(plot_handle first, plot_handle last, size_t max_count,
+                                                      std::vector<plot_handle> &handles) {
+   handles.clear();
+
+   plot_handle h = std::max(first, _head);
+   plot_handle end = std::min(last + 1, static_cast<plot_handle>(_size));
+   for ( ; (h < end) && (handles.size() < max_count); h++) {
+      unsigned short flags = chunkOf(h).flags[h & plot_chunk_mask];
+      if ((flags & DBFLAG_SYNCD) && !(flags & DBFLAG_ERASED))
+         handles.push_back(h);
+   }
+   return (h < end) ? h : last + 1;
+}
+
+/*****************************************************************************************
+ * popFront - removes the front element from the database 
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::popFront() {
+   // First lock the mutex (blocking)
+   lockStore();
+
+   if (_live > 0)
+      eraseSlot(_head);
+
+   // Unlock the mutex before we exit
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * erase - removes the DronePlot at the specified index. Whole segments before the one
+ *         holding the index are skipped by their live counts, so only that segment is walked
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::erase(unsigned int i) {
+   // First lock the mutex (blocking)
+   lockStore();
+
+   if (i >= _live) {
+      pthread_mutex_unlock(&_mutex);
+      throw std::runtime_error("erase function called with index out of scope for the database.");
+   }
+
+   size_t seg = segmentOf(_head);
+   while (i >= _segments[seg].live) {
+      i -= _segments[seg].live;
+      seg++;
+   }
+
+   iterator diter(this, std::max(_head, _segments[seg].first));
    for (unsigned int x=0; x<i; x++, diter++);
 
-   _dbdata.erase(diter);
+   eraseSlot(diter.getHandle());
 
 
    // Unlock the mutex before we exit
@@ -444,49 +1246,697 @@ void DronePlotDB::erase(unsigned int i) {
 /*****************************************************************************************
  * erase - removes the DronePlot at the location pointed to by the iterator
  *
- *    Returns: an iterator pointing to the next element in the list
+ *    Returns: an iterator pointing to the next element in the database
  *
  *    Note: this locks the mutex and may block if it is already locked.
  *
  *****************************************************************************************/
 
-std::list<DronePlot>::iterator DronePlotDB::erase(std::list<DronePlot>::iterator dptr) {
+DronePlotDB::iterator DronePlotDB::erase(iterator dptr) {
    // First lock the mutex (blocking)
-   pthread_mutex_lock(&_mutex);
+   lockStore();
 
-   auto retptr = _dbdata.erase(dptr);
+   plot_handle handle = dptr.getHandle();
+   eraseSlot(handle);
 
    // Unlock the mutex before we exit
    pthread_mutex_unlock(&_mutex);
 
-   return retptr;
+   return iterator(this, handle + 1);
+}
+
+/*****************************************************************************************
+ * erasePlot - removes the DronePlot with the given handle. Other handles are unaffected.
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::erasePlot(plot_handle handle) {
+   lockStore();
+
+   try {
+      eraseSlot(handle);
+   } catch (std::runtime_error &e) {
+      pthread_mutex_unlock(&_mutex);
+      throw;
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * eraseIfValid - removes the DronePlot with the given handle if it is still in the
+ *                database. The check and the erase are done under one lock, so it is safe
+ *                while other threads add or erase plots.
+ *
+ *    Returns: true if the plot was erased, false if it was already gone
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+bool DronePlotDB::eraseIfValid(plot_handle handle) {
+   lockStore();
+
+   bool valid = isValid(handle);
+   if (valid)
+      eraseSlot(handle);
+
+   pthread_mutex_unlock(&_mutex);
+   return valid;
+}
+
+/*****************************************************************************************
+ * updatePlot - replaces the attributes of a stored plot. Its index entries are keyed on the
+ *              old values, so they are taken out before the chunk is written and put back
+ *              after. The segment's time bounds are widened to take the new timestamp.
+ *
+ *    Throws: runtime_error if the handle is not in the database
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::updatePlot(plot_handle handle, const DronePlot &plot) {
+   lockStore();
+
+   if (!isValid(handle)) {
+      pthread_mutex_unlock(&_mutex);
+      throw std::runtime_error("Attempted to update a plot handle that is not in the database.");
+   }
+
+   if (_dedup_enabled)
+      removeFromDedupIndex(handle);
+   removeFromTrack(handle);
+   removeFromRuns(handle);
+
+   PlotChunk &chunk = writableChunk(handle);
+   size_t slot = handle & plot_chunk_mask;
+   chunk.drone_id[slot] = plot.drone_id;
+   chunk.node_id[slot] = plot.node_id;
+   chunk.timestamp[slot] = plot.timestamp;
+   chunk.latitude[slot] = plot.latitude;
+   chunk.longitude[slot] = plot.longitude;
+
+   segment_info &seg = _segments[segmentOf(handle)];
+   seg.min_ts = std::min(seg.min_ts, plot.timestamp);
+   seg.max_ts = std::max(seg.max_ts, plot.timestamp);
+
+   addToTrack(plot.drone_id, plot.timestamp, handle);
+   addToRun(plot.node_id, plot.timestamp, handle);
+   if (_dedup_enabled)
+      _dedup_index.emplace(makeDedupKey(plot), handle);
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * shiftTimestamps - moves every stored plot offset seconds in time. The order of plots in
+ *                   the tracks and runs does not change, so their timestamps are shifted in
+ *                   place; the duplicate index buckets by time, so it is rebuilt.
+ *
+ *    Note: this locks the mutex and may block if it is already locked.
+ *
+ *****************************************************************************************/
+
+void DronePlotDB::shiftTimestamps(time_t offset) {
+   lockStore();
+
+   // Chunks before _head may have been released, and hold no live plots anyway
+   for (plot_handle h = _head; h < _size; h = (h | plot_chunk_mask) + 1) {
+      PlotChunk &chunk = writableChunk(h);
+      size_t end = std::min(_size - (h & ~plot_chunk_mask), plot_chunk_size);
+      for (size_t slot = h & plot_chunk_mask; slot < end; slot++)
+         chunk.timestamp[slot] += offset;
+   }
+
+   for (segment_info &seg : _segments) {
+      seg.start_ts += offset;
+      seg.min_ts += offset;
+      seg.max_ts += offset;
+   }
+
+   for (auto &track : _tracks) {
+      for (series_point &point : track.second)
+         point.timestamp += offset;
+   }
+
+   for (auto &node : _node_runs) {
+      for (plot_series &run : node.second) {
+         for (series_point &point : run)
+            point.timestamp += offset;
+      }
+   }
+
+   if (_dedup_enabled)
+      rebuildDedupIndex();
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * isValid - returns true if the handle refers to a plot that is still in the database
+ *****************************************************************************************/
+
+bool DronePlotDB::isValid(plot_handle handle) {
+   return (handle >= _head) && (handle < _size) &&
+                           !(chunkOf(handle).flags[handle & plot_chunk_mask] & DBFLAG_ERASED);
+}
+
+/*****************************************************************************************
+ * dropSegmentsBefore - retention: drops the oldest segments while every plot in them is
+ *                      older than cutoff. Each segment goes in constant time (_head moves
+ *                      past it and its live count is subtracted) plus, with the duplicate
+ *                      index on, removing its index entries. Chunks left wholly behind _head
+ *                      are then released. The segment still being filled is never dropped.
+ *                      To archive, take a snapshot first - it keeps the dropped chunks
+ *                      readable.
+ *
+ *    Params:  cutoff - plots with timestamps before this may be dropped
+ *
+ *    Returns: number of live plots dropped
+ *****************************************************************************************/
+
+size_t DronePlotDB::dropSegmentsBefore(time_t cutoff) {
+   lockStore();
+
+   size_t dropped = 0;
+   plot_handle old_head = _head;
+   size_t seg = (_head < _size) ? segmentOf(_head) : _segments.size();
+
+   while ((seg + 1 < _segments.size()) && (_segments[seg].max_ts < cutoff)) {
+      plot_handle end = _segments[seg + 1].first;
+
+      if (_dedup_enabled) {
+         for (plot_handle h = std::max(_head, _segments[seg].first); h < end; h++) {
+            if (!(chunkOf(h).flags[h & plot_chunk_mask] & DBFLAG_ERASED))
+               removeFromDedupIndex(h);
+         }
+      }
+
+      dropped += _segments[seg].live;
+      _live -= _segments[seg].live;
+      _segments[seg].live = 0;
+
+      seg++;
+      _head = end;
+   }
+
+   advanceHead();
+
+   // Release the chunks now wholly behind _head (a snapshot's directory keeps its own)
+   size_t first_chunk = old_head >> plot_chunk_bits;
+   size_t head_chunk = _head >> plot_chunk_bits;
+   if (head_chunk > first_chunk) {
+      if (isShared(_chunks))
+         _chunks = std::make_shared<plot_chunk_dir>(*_chunks);
+      for (size_t c = first_chunk; c < head_chunk; c++)
+         (*_chunks)[c].reset();
+   }
+
+   // Each dropped plot has one point in a track and one in a run. They are usually at the
+   // front, but a late or clock-skewed plot can be older than the plots around it in its
+   // track or run, so if popping the fronts does not account for every dropped plot, sweep
+   // the whole series for the rest
+   if (dropped > 0) {
+      if (pruneTracks(false) < dropped)
+         pruneTracks(true);
+      if (pruneRuns(false) < dropped)
+         pruneRuns(true);
+   }
+
+   pthread_mutex_unlock(&_mutex);
+   return dropped;
+}
+
+/*****************************************************************************************
+ * findInTimeRange - collects the live plots with timestamps in [start, end], skipping
+ *                   segments whose time bounds cannot match
+ *
+ *    Params:  handles - the matching handles are appended here, in storage order
+ *****************************************************************************************/
+
+void DronePlotDB::findInTimeRange(time_t start, time_t end, std::vector<plot_handle> &handles) {
+   lockStore();
+
+   size_t seg = (_head < _size) ? segmentOf(_head) : _segments.size();
+   for (; seg < _segments.size(); seg++) {
+      const segment_info &info = _segments[seg];
+      if ((info.live == 0) || (info.max_ts < start) || (info.min_ts > end))
+         continue;
+
+      plot_handle first = std::max(_head, info.first);
+      plot_handle last = segmentEnd(seg);
+
+      for (plot_handle h = first; h < last; h++) {
+         const PlotChunk &chunk = chunkOf(h);
+         size_t slot = h & plot_chunk_mask;
+         if (!(chunk.flags[slot] & DBFLAG_ERASED) && (chunk.timestamp[slot] >= start) &&
+                                                     (chunk.timestamp[slot] <= end))
+            handles.push_back(h);
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * addToTrack - adds a plot to its drone's track. Plots normally arrive in time order and
+ *              are appended; a late one is inserted after any plots with the same time.
+ *              Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::addToTrack(unsigned int drone_id, time_t timestamp, plot_handle handle) {
+   plot_series &track = _tracks[drone_id];
+   series_point point = {timestamp, handle};
+
+   if (track.empty() || (track.back().timestamp <= timestamp)) {
+      track.push_back(point);
+      return;
+   }
+
+   auto pos = std::upper_bound(track.begin(), track.end(), timestamp,
+                               [](time_t ts, const series_point &p) { return ts < p.timestamp; });
+   track.insert(pos, point);
+}
+
+/*****************************************************************************************
+ * removeFromTrack - finds a stored plot among the points with its timestamp in its drone's
+ *                   track and removes it. Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::removeFromTrack(plot_handle handle) {
+   const PlotChunk &chunk = chunkOf(handle);
+   size_t slot = handle & plot_chunk_mask;
+
+   auto found = _tracks.find(chunk.drone_id[slot]);
+   if (found == _tracks.end())
+      return;
+
+   eraseFromSeries(found->second, chunk.timestamp[slot], handle);
+   if (found->second.empty())
+      _tracks.erase(found);
+}
+
+/*****************************************************************************************
+ * eraseFromSeries - binary searches a series for the points with timestamp ts and removes
+ *                   the one for handle
+ *
+ *    Returns: true if the handle was found
+ *****************************************************************************************/
+
+bool DronePlotDB::eraseFromSeries(plot_series &series, time_t ts, plot_handle handle) {
+   auto pos = std::lower_bound(series.begin(), series.end(), ts,
+                               [](const series_point &p, time_t t) { return p.timestamp < t; });
+
+   for (; (pos != series.end()) && (pos->timestamp == ts); pos++) {
+      if (pos->handle == handle) {
+         series.erase(pos);
+         return true;
+      }
+   }
+   return false;
+}
+
+/*****************************************************************************************
+ * pruneSeries - removes the points of a series left behind by a retention drop (handles
+ *               before _head; erased plots are already taken out by eraseSlot). Pops them
+ *               off the front, or with sweep set removes them wherever they are.
+ *
+ *    Returns: number of points removed
+ *****************************************************************************************/
+
+size_t DronePlotDB::pruneSeries(plot_series &series, bool sweep) {
+   size_t before = series.size();
+   plot_handle head = _head;
+
+   if (sweep) {
+      series.erase(std::remove_if(series.begin(), series.end(),
+                   [head](const series_point &point) { return point.handle < head; }),
+                   series.end());
+   } else {
+      while (!series.empty() && (series.front().handle < head))
+         series.pop_front();
+   }
+
+   return before - series.size();
+}
+
+/*****************************************************************************************
+ * pruneTracks/pruneRuns - pruneSeries over every drone track or node run. Tracks and runs
+ *                         left empty (drones or nodes no longer seen) are removed.
+ *
+ *    Returns: number of points removed
+ *****************************************************************************************/
+
+size_t DronePlotDB::pruneTracks(bool sweep) {
+   size_t pruned = 0;
+
+   for (auto it = _tracks.begin(); it != _tracks.end(); ) {
+      pruned += pruneSeries(it->second, sweep);
+      if (it->second.empty())
+         it = _tracks.erase(it);
+      else
+         it++;
+   }
+   return pruned;
+}
+
+size_t DronePlotDB::pruneRuns(bool sweep) {
+   size_t pruned = 0;
+
+   for (auto it = _node_runs.begin(); it != _node_runs.end(); ) {
+      std::vector<plot_series> &runs = it->second;
+      for (plot_series &run : runs)
+         pruned += pruneSeries(run, sweep);
+      runs.erase(std::remove_if(runs.begin(), runs.end(),
+                                [](const plot_series &run) { return run.empty(); }), runs.end());
+
+      if (runs.empty())
+         it = _node_runs.erase(it);
+      else
+         it++;
+   }
+   return pruned;
+}
+
+/*****************************************************************************************
+ * addToRun - adds a plot to its node's sorted runs. A plot at or after the end of the last
+ *            run extends it (the usual case, as a node reports in time order); an older one
+ *            starts a new run. Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::addToRun(unsigned int node_id, time_t timestamp, plot_handle handle) {
+   std::vector<plot_series> &runs = _node_runs[node_id];
+
+   if (runs.empty() || (runs.back().back().timestamp > timestamp))
+      runs.emplace_back();
+
+   series_point point = {timestamp, handle};
+   runs.back().push_back(point);
+}
+
+/*****************************************************************************************
+ * removeFromRuns - searches the node's runs for a stored plot and removes it, dropping the
+ *                  run if that empties it. Does not lock the mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::removeFromRuns(plot_handle handle) {
+   const PlotChunk &chunk = chunkOf(handle);
+   size_t slot = handle & plot_chunk_mask;
+
+   auto found = _node_runs.find(chunk.node_id[slot]);
+   if (found == _node_runs.end())
+      return;
+
+   std::vector<plot_series> &runs = found->second;
+   for (auto run = runs.begin(); run != runs.end(); run++) {
+      if (eraseFromSeries(*run, chunk.timestamp[slot], handle)) {
+         if (run->empty())
+            runs.erase(run);
+         break;
+      }
+   }
+
+   if (runs.empty())
+      _node_runs.erase(found);
+}
+
+/*****************************************************************************************
+ * mergeRuns - k-way merge of every node run with a binary heap keyed on (timestamp,
+ *             handle). Each run is already in that order, so the output matches a stable
+ *             sort of the store by timestamp. O(n log k) for n plots in k runs. Does not
+ *             lock the mutex.
+ *
+ *    Params:  order - replaced with the live handles in time order
+ *****************************************************************************************/
+
+void DronePlotDB::mergeRuns(std::vector<plot_handle> &order) {
+   struct cursor {
+      const plot_series *run;
+      size_t pos;
+      time_t timestamp;
+      plot_handle handle;
+   };
+
+   // Heap functions keep the largest on top, so "less" here means later in time
+   auto later = [](const cursor &a, const cursor &b) {
+      return (a.timestamp > b.timestamp) || ((a.timestamp == b.timestamp) && (a.handle > b.handle));
+   };
+
+   std::vector<cursor> heap;
+   for (auto &node : _node_runs) {
+      for (const plot_series &run : node.second) {
+         if (!run.empty())
+            heap.push_back({&run, 0, run.front().timestamp, run.front().handle});
+      }
+   }
+   std::make_heap(heap.begin(), heap.end(), later);
+
+   order.clear();
+   order.reserve(_live);
+
+   while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      cursor &next = heap.back();
+
+      // Points whose plots were dropped by retention are skipped
+      if (isValid(next.handle))
+         order.push_back(next.handle);
+
+      if (++next.pos < next.run->size()) {
+         next.timestamp = (*next.run)[next.pos].timestamp;
+         next.handle = (*next.run)[next.pos].handle;
+         std::push_heap(heap.begin(), heap.end(), later);
+      } else {
+         heap.pop_back();
+      }
+   }
+}
+
+/*****************************************************************************************
+ * radixOrder - sorts (timestamp, handle) pairs for every live plot with radixSort. The pairs
+ *              are gathered in handle order and the sort is stable, so ties come out in
+ *              handle order just as they do from mergeRuns. O(n) no matter how the node
+ *              runs are broken up. Does not lock the mutex.
+ *
+ *    Params:  order - replaced with the live handles in time order
+ *****************************************************************************************/
+
+void DronePlotDB::radixOrder(std::vector<plot_handle> &order) {
+   std::vector<radix_item> items;
+   items.reserve(_live);
+
+   for (iterator dptr = begin(); dptr != end(); dptr++) {
+      plot_handle h = dptr.getHandle();
+      items.push_back({radixKey(chunkOf(h).timestamp[h & plot_chunk_mask]), h});
+   }
+
+   radixSort(items);
+
+   order.clear();
+   order.reserve(items.size());
+   for (const radix_item &item : items)
+      order.push_back(static_cast<plot_handle>(item.index));
+}
+
+/*****************************************************************************************
+ * timeOrder - the live handles in timestamp order. Merging the node runs is cheapest while
+ *             there are only a few of them; a big store whose runs are fragmented (plots
+ *             loaded or replayed out of order) is radix sorted instead. Does not lock the
+ *             mutex.
+ *****************************************************************************************/
+
+void DronePlotDB::timeOrder(std::vector<plot_handle> &order) {
+   size_t runs = 0;
+   for (auto &node : _node_runs)
+      runs += node.second.size();
+
+   if ((runs >= radix_sort_min_runs) && (_live >= radix_sort_min_plots))
+      radixOrder(order);
+   else
+      mergeRuns(order);
+}
+
+/*****************************************************************************************
+ * getTimeOrder - the live handles in timestamp order, see timeOrder
+ *****************************************************************************************/
+
+void DronePlotDB::getTimeOrder(std::vector<plot_handle> &order) {
+   lockStore();
+   timeOrder(order);
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * lastValidBefore - walks back from pos to the newest point still in the database (points
+ *                   left behind by a retention drop are skipped)
+ *****************************************************************************************/
+
+plot_handle DronePlotDB::lastValidBefore(const plot_series &track, size_t pos) {
+   while (pos > 0) {
+      pos--;
+      if (isValid(track[pos].handle))
+         return track[pos].handle;
+   }
+   return invalid_plot;
+}
+
+/*****************************************************************************************
+ * getLastPosition - the drone's newest plot
+ *
+ *    Params:  drone_id - the drone to look up
+ *             plot - set to a copy of the plot if found
+ *
+ *    Returns: true if the drone has any plots
+ *****************************************************************************************/
+
+bool DronePlotDB::getLastPosition(unsigned int drone_id, DronePlot &plot) {
+   lockStore();
+
+   plot_handle h = invalid_plot;
+   auto found = _tracks.find(drone_id);
+   if (found != _tracks.end())
+      h = lastValidBefore(found->second, found->second.size());
+
+   if (h != invalid_plot)
+      plot = readPlot(*_chunks, h);
+
+   pthread_mutex_unlock(&_mutex);
+   return h != invalid_plot;
+}
+
+/*****************************************************************************************
+ * getPositionAt - the drone's newest plot at or before time t (where it was last seen as
+ *                 of t)
+ *
+ *    Params:  drone_id - the drone to look up
+ *             t - the time of interest
+ *             plot - set to a copy of the plot if found
+ *
+ *    Returns: true if the drone has a plot at or before t
+ *****************************************************************************************/
+
+bool DronePlotDB::getPositionAt(unsigned int drone_id, time_t t, DronePlot &plot) {
+   lockStore();
+
+   plot_handle h = invalid_plot;
+   auto found = _tracks.find(drone_id);
+   if (found != _tracks.end()) {
+      plot_series &track = found->second;
+      auto pos = std::upper_bound(track.begin(), track.end(), t,
+                                  [](time_t ts, const series_point &p) { return ts < p.timestamp; });
+      h = lastValidBefore(track, pos - track.begin());
+   }
+
+   if (h != invalid_plot)
+      plot = readPlot(*_chunks, h);
+
+   pthread_mutex_unlock(&_mutex);
+   return h != invalid_plot;
+}
+
+/*****************************************************************************************
+ * getTrack - collects a drone's plots with timestamps from start to end inclusive
+ *
+ *    Params:  handles - the matching handles are appended here, oldest first
+ *****************************************************************************************/
+
+void DronePlotDB::getTrack(unsigned int drone_id, time_t start, time_t end,
+                                                           std::vector<plot_handle> &handles) {
+   lockStore();
+
+   auto found = _tracks.find(drone_id);
+   if (found != _tracks.end()) {
+      plot_series &track = found->second;
+      auto pos = std::lower_bound(track.begin(), track.end(), start,
+                                  [](const series_point &p, time_t ts) { return p.timestamp < ts; });
+
+      for (; (pos != track.end()) && (pos->timestamp <= end); pos++) {
+         if (isValid(pos->handle))
+            handles.push_back(pos->handle);
+      }
+   }
+
+   pthread_mutex_unlock(&_mutex);
+}
+
+/*****************************************************************************************
+ * snapshot - captures the current contents as a DronePlotSnapshot. Only the chunk directory
+ *            pointer is copied, so this holds the mutex for constant time.
+ *****************************************************************************************/
+
+DronePlotSnapshot DronePlotDB::snapshot() {
+   lockStore();
+   DronePlotSnapshot snap(_chunks, _size, _head, _live);
+   pthread_mutex_unlock(&_mutex);
+   return snap;
 }
 
 
 // Removes all of a particular node (not for student use)
 void DronePlotDB::removeNodeID(unsigned int node_id) {
-   pthread_mutex_lock(&_mutex);
+   lockStore();
 
-   auto del_iter = _dbdata.begin();
-   while (del_iter != _dbdata.end()) {
-      if (del_iter->node_id == node_id)
-         del_iter = _dbdata.erase(del_iter);
-      else
-         del_iter++;
+   for (iterator dptr = begin(); dptr != end(); dptr++) {
+      if (chunkOf(dptr.getHandle()).node_id[dptr.getHandle() & plot_chunk_mask] == node_id)
+         eraseSlot(dptr.getHandle());
    }
 
    pthread_mutex_unlock(&_mutex);
 }
 
 /*****************************************************************************************
- * sortByTime - sort the database from earliest timestamp to latest
+ * sortByTime - sort the database from earliest timestamp to latest. Equal timestamps keep
+ *              their insertion order. The order comes from merging the node runs, O(n log k),
+ *              or from a parallel radix sort when a large store has many runs (see
+ *              timeOrder). Erased slots are dropped as the columns are rebuilt, so all
+ *              previously issued handles become invalid.
  *
  *       Used by the simulator--students should not need to use this
  *****************************************************************************************/
 void DronePlotDB::sortByTime() {
-   pthread_mutex_lock(&_mutex);
+   lockStore();
+
+   std::vector<plot_handle> order;
+   timeOrder(order);
+
+   // Rebuild into fresh chunks in the new order. Snapshots keep the old chunks
+   std::shared_ptr<plot_chunk_dir> old = _chunks;
+   _chunks = std::make_shared<plot_chunk_dir>();
+   _segments.clear();
+   _tracks.clear();
+   _node_runs.clear();
+   _size = 0;
+   _head = 0;
+   _pending.clear();
+
+   reserveColumns(order.size());
+   for (plot_handle h : order) {
+      const PlotChunk &from = *(*old)[h >> plot_chunk_bits];
+      size_t src = h & plot_chunk_mask;
+
+      PlotChunk &to = nextSlotChunk(from.timestamp[src]);
+      size_t dst = _size & plot_chunk_mask;
+
+      to.drone_id[dst] = from.drone_id[src];
+      to.node_id[dst] = from.node_id[src];
+      to.timestamp[dst] = from.timestamp[src];
+      to.latitude[dst] = from.latitude[src];
+      to.longitude[dst] = from.longitude[src];
+      to.flags[dst] = from.flags[src];
+      addToTrack(to.drone_id[dst], to.timestamp[dst], _size);
+      addToRun(to.node_id[dst], to.timestamp[dst], _size);
+
+      // Handles moved, so rebuild the pending log from the flags (the order is by time now)
+      if (to.flags[dst] & DBFLAG_NEW)
+         _pending.push_back(_size);
+      _size++;
+   }
 
-   _dbdata.sort(compare_plot);
+   if (_dedup_enabled)
+      rebuildDedupIndex();
 
    pthread_mutex_unlock(&_mutex);
 }
@@ -496,7 +1946,15 @@ void DronePlotDB::sortByTime() {
  *****************************************************************************************/
 
 void DronePlotDB::clear() {
-   _dbdata.clear();
+   _chunks = std::make_shared<plot_chunk_dir>();
+   _segments.clear();
+   _size = 0;
+   _head = 0;
+   _live = 0;
+   _dedup_index.clear();
+   _tracks.clear();
+   _node_runs.clear();
+   _pending.clear();
 }
 
 /*****************************************************************************************
@@ -508,9 +1966,8 @@ void DronePlotDB::clear() {
  * Author: Andrew Davis
  *****************************************************************************************/
 void DronePlotDB::lockMutex(){
-    pthread_mutex_lock(&_mutex);
+    lockStore();
 }
 void DronePlotDB::unlockMutex() {
     pthread_mutex_unlock(&_mutex);
 }
-
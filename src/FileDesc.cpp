@@ -5,6 +5,10 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <unistd.h>
 
 #include "FileDesc.h"
@@ -12,7 +16,10 @@
 
 const unsigned int bufsize = 500;
 
-FileDesc::FileDesc() {
+// Most spans a single readSpans/writeSpans call can take
+const int max_spans = 16;
+
+FileDesc::FileDesc():_fd(-1) {
 
 }
 
@@ -97,16 +104,13 @@ bool FileDesc::hasData(long ms_timeout) {
  *****************************************************************************************/
 
 ssize_t FileDesc::readFD(std::string &buf) {
-   char *readbuf = new char[bufsize];
-   bzero(readbuf, sizeof(char) * bufsize);
+   char readbuf[bufsize];
    ssize_t amt_read = 0;
    if ((amt_read = read(_fd, readbuf, bufsize)) < 0) {
-      delete readbuf;
       return -1;
    }
    
-   buf = readbuf;
-   delete readbuf;
+   buf.assign(readbuf, amt_read);
    return amt_read;
 }
 
@@ -127,7 +131,141 @@ ssize_t FileDesc::writeFD(const char *data) {
 }
 
 ssize_t FileDesc::writeFD(const char *data, unsigned int len) {
-   return write(_fd, data, len);
+   return writeAll(data, len);
+}
+
+/*****************************************************************************************
+ * readSpans - scatter reads from the FD directly into the caller's buffers, repeating the
+ *             read until the spans are full. Stops early at end of file, or on a nonblocking
+ *             FD once nothing more is waiting.
+ *
+ *    Params: spans - the buffers to fill, in order
+ *            count - number of spans (up to max_spans)
+ *
+ *    Returns: bytes read (short only at EOF/EAGAIN), or -1 for a read error or if nothing
+ *             was waiting on a nonblocking FD (errno EAGAIN)
+ *
+ *    Throws: std::runtime_error if too many spans are passed in
+ *****************************************************************************************/
+
+ssize_t FileDesc::readSpans(const iovec *spans, int count) {
+   if (count > max_spans)
+      throw std::runtime_error("Too many spans passed to FileDesc::readSpans.");
+
+   // Local copy so partial reads can advance through the spans
+   iovec local[max_spans];
+   memcpy(local, spans, sizeof(iovec) * count);
+   iovec *cur = local;
+
+   ssize_t total = 0;
+   while (count > 0) {
+      ssize_t results = readv(_fd, cur, count);
+      if (results < 0) {
+         if (errno == EINTR)
+            continue;
+         if (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && (total > 0))
+            break;
+         return -1;
+      }
+
+      // End of file
+      if (results == 0)
+         break;
+
+      total += results;
+
+      // Skip the spans that were filled and trim the one that was partly filled
+      while ((count > 0) && ((size_t) results >= cur->iov_len)) {
+         results -= cur->iov_len;
+         cur++;
+         count--;
+      }
+      if (count > 0) {
+         cur->iov_base = static_cast<uint8_t *>(cur->iov_base) + results;
+         cur->iov_len -= results;
+      }
+   }
+   return total;
+}
+
+ssize_t FileDesc::readAll(void *data, size_t len) {
+   iovec span = { data, len };
+   return readSpans(&span, 1);
+}
+
+/*****************************************************************************************
+ * writeSpans - gather writes the caller's buffers to the FD in order (e.g. a frame header
+ *              and its payload) without staging them in a combined buffer. Partial writes
+ *              continue where they left off. A nonblocking FD that fills up is never waited
+ *              on: the write stops short and the caller keeps the rest until the FD is
+ *              writable again.
+ *
+ *    Params: spans - the buffers to write, in order
+ *            count - number of spans (up to max_spans)
+ *
+ *    Returns: total bytes written (less than asked, possibly 0, if a nonblocking FD filled
+ *             up), or -1 for a write error
+ *
+ *    Throws: std::runtime_error if too many spans are passed in
+ *****************************************************************************************/
+
+ssize_t FileDesc::writeSpans(const iovec *spans, int count) {
+   if (count > max_spans)
+      throw std::runtime_error("Too many spans passed to FileDesc::writeSpans.");
+
+   // Local copy so partial writes can advance through the spans
+   iovec local[max_spans];
+   memcpy(local, spans, sizeof(iovec) * count);
+   iovec *cur = local;
+
+   // Skip over leading empty spans (writev of nothing but empties would return 0 forever)
+   while ((count > 0) && (cur->iov_len == 0)) {
+      cur++;
+      count--;
+   }
+
+   ssize_t total = 0;
+   while (count > 0) {
+      ssize_t results = writevFD(cur, count);
+      if (results < 0) {
+         if (errno == EINTR)
+            continue;
+
+         // Full nonblocking FD, hand back what went out so far
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            return total;
+         return -1;
+      }
+
+      total += results;
+
+      // Skip the spans that were fully written (and any empties) and trim the partial one
+      while ((count > 0) && ((size_t) results >= cur->iov_len)) {
+         results -= cur->iov_len;
+         cur++;
+         count--;
+      }
+      if (count > 0) {
+         cur->iov_base = static_cast<uint8_t *>(cur->iov_base) + results;
+         cur->iov_len -= results;
+      }
+   }
+   return total;
+}
+
+ssize_t FileDesc::writeAll(const void *data, size_t len) {
+   iovec span = { const_cast<void *>(data), len };
+   return writeSpans(&span, 1);
+}
+
+/*****************************************************************************************
+ * writevFD - one gather write of the spans. Sockets override this to use sendmsg
+ *
+ *    Returns: bytes written or -1 with errno set
+ *****************************************************************************************/
+
+ssize_t FileDesc::writevFD(const iovec *spans, int count) {
+   return writev(_fd, spans, count);
 }
 
 /*************************************************************************************
@@ -143,10 +281,15 @@ bool FileDesc::isOpen() {
 }
 
 /***************************************************************************************
- * closeFD - closes the FD cleanly
+ * closeFD - closes the FD cleanly. Safe to call again once closed, the number is
+ *           forgotten so a later close cannot hit an FD reused by something else
  ***************************************************************************************/
 void FileDesc::closeFD() {
+   if (_fd == -1)
+      return;
+
    close(_fd);
+   _fd = -1;
 }
 
 /****************************************************************************************
@@ -208,12 +351,15 @@ void SocketFD::bindFD(const char *ip_addr, short unsigned int port) {
 }
 
 /*****************************************************************************************
- * connectTo - attempts to connect via TCP to the given ip address and port
+ * connectTo - starts a TCP connect to the given ip address and port. The socket is made
+ *             non-blocking first, so this returns straight away with the connect usually
+ *             still under way; the socket turns writable when it finishes, and checkConnect
+ *             tells whether it worked.
  *
  *    Params:  ip_addr - the IP address string of the server to connect to in std format
  *             port - the port of the server to connect to
  *
- *    Returns: true if the connect worked, false otherwise
+ *    Returns: true if the connect is done or under way, false if it failed outright
  *****************************************************************************************/
 
 bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
@@ -225,7 +371,10 @@ bool SocketFD::connectTo(const char *ip_addr, unsigned short port) {
 }
 
 bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
-   if ((_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   // Replaces any socket this object already holds (the constructor's, or a lost session's)
+   closeFD();
+
+   if ((_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
       throw socket_error("Socket creation failed.");
 
    // Load the socket information to prep for binding
@@ -234,13 +383,38 @@ bool SocketFD::connectTo(unsigned long ip_addr, unsigned short port) {
    _fd_addr.sin_addr.s_addr = ip_addr;
    _fd_addr.sin_port = port;
 
-   if (connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0)
+   if ((connect(_fd, (struct sockaddr *) &_fd_addr, sizeof(_fd_addr)) != 0) &&
+                                                                  (errno != EINPROGRESS))
       return false;
 
    return true;
 
 }
 
+/*****************************************************************************************
+ * checkConnect - checks on a connect started by connectTo. A pending error means it failed;
+ *                otherwise the socket is connected once it has a peer address.
+ *
+ *    Returns: 0 if connected, EINPROGRESS if still connecting, else the errno it failed with
+ *****************************************************************************************/
+
+int SocketFD::checkConnect() {
+   int err = 0;
+   socklen_t len = sizeof(err);
+
+   if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+      return errno;
+   if (err != 0)
+      return err;
+
+   sockaddr_in peer;
+   len = sizeof(peer);
+   if (getpeername(_fd, (struct sockaddr *) &peer, &len) == -1)
+      return (errno == ENOTCONN) ? EINPROGRESS : errno;
+
+   return 0;
+}
+
 /*****************************************************************************************
  * listenFD - starts listening for connections on a bound socket FD
  *
@@ -267,6 +441,7 @@ void SocketFD::listenFD(int backlog) {
 bool SocketFD::acceptFD(SocketFD &server) {
    socklen_t len = sizeof(_fd_addr);
 
+   closeFD();
    _fd = accept(server.getFD(), (struct sockaddr *) &_fd_addr, &len);
    if (_fd == -1)
       return false;
@@ -274,6 +449,43 @@ bool SocketFD::acceptFD(SocketFD &server) {
    return true;
 }
 
+/*****************************************************************************************
+ * recvSpans - reads available socket data straight into the caller's buffers with a single
+ *             scatter read. Never blocks, even if the socket is in blocking mode.
+ *
+ *    Params: spans - the buffers to fill, in order
+ *            count - number of spans
+ *
+ *    Returns: bytes read, 0 if the other end closed the connection, or -1 with errno set
+ *             (EAGAIN/EWOULDBLOCK if nothing was waiting)
+ *****************************************************************************************/
+
+ssize_t SocketFD::recvSpans(const iovec *spans, int count) {
+   msghdr msg;
+   bzero(&msg, sizeof(msg));
+   msg.msg_iov = const_cast<iovec *>(spans);
+   msg.msg_iovlen = count;
+
+   return recvmsg(_fd, &msg, MSG_DONTWAIT);
+}
+
+/*****************************************************************************************
+ * writevFD - gather write for sockets. Uses sendmsg so a peer that has gone away gives an
+ *            EPIPE error instead of a SIGPIPE that would kill the server. Never blocks, even
+ *            if the socket is in blocking mode, so a full socket gives EAGAIN
+ *
+ *    Returns: bytes written or -1 with errno set
+ *****************************************************************************************/
+
+ssize_t SocketFD::writevFD(const iovec *spans, int count) {
+   msghdr msg;
+   bzero(&msg, sizeof(msg));
+   msg.msg_iov = const_cast<iovec *>(spans);
+   msg.msg_iovlen = count;
+
+   return sendmsg(_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
 /*****************************************************************************************
  * getIPAddr - returns the IP address of this FD in big endian format
  *
@@ -327,7 +539,7 @@ FileFD::FileFD(const char *filename):FileDesc(), _filename(filename) {
 }
 
 FileFD::~FileFD() {
-
+   unmapFile();
 }
 
 /******************************************************************************************
@@ -357,6 +569,58 @@ bool FileFD::openFile(fd_file_type ftype, bool create) {
    return true;
 }
 
+/******************************************************************************************
+ * mapFile - maps the entire open file into memory read-only so it can be parsed in place
+ *           without a read() per record. The kernel is told it will be read sequentially.
+ *
+ *    Params:  data - set to the start of the file's contents (NULL for an empty file)
+ *             len - set to the size of the file in bytes
+ *
+ *    Returns: false if the file could not be examined or mapped, true otherwise
+ *
+ ******************************************************************************************/
+
+bool FileFD::mapFile(const uint8_t *&data, size_t &len) {
+   struct stat st;
+
+   unmapFile();
+
+   if (fstat(_fd, &st) == -1)
+      return false;
+
+   data = NULL;
+   len = st.st_size;
+
+   // Zero-length mappings are not allowed, and there's nothing to read anyway
+   if (len == 0)
+      return true;
+
+   void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, _fd, 0);
+   if (map == MAP_FAILED)
+      return false;
+
+   madvise(map, len, MADV_SEQUENTIAL);
+
+   _map = map;
+   _maplen = len;
+   data = static_cast<const uint8_t *>(map);
+   return true;
+}
+
+/******************************************************************************************
+ * unmapFile - releases the mapping made by mapFile, if any
+ *
+ ******************************************************************************************/
+
+void FileFD::unmapFile() {
+   if (_map == NULL)
+      return;
+
+   munmap(_map, _maplen);
+   _map = NULL;
+   _maplen = 0;
+}
+
 /*****************************************************************************************
  * readStr - For a file FD, reads in characters until it hits a newline char. Not set up to
  *          work with sockets as it does not buffer and could lose data if partial data
@@ -10,37 +10,67 @@
 #include "exceptions.h"
 
 
-// Log manager, supports log_lvl for verbosity control
-LogMgr::LogMgr(const char *log_file, unsigned int log_lvl):_log_file(log_file),_log_lvl(log_lvl) {
+// Log manager, supports log_lvl for verbosity control. Starts the writer thread
+LogMgr::LogMgr(const char *log_file, unsigned int log_lvl, unsigned int flush_interval):
+                                          _log_file(log_file),
+                                          _log_lvl(log_lvl),
+                                          _flush_interval(flush_interval),
+                                          _open_failed(false),
+                                          _qhead(&_stub),
+                                          _qtail(&_stub)
+{
+   _stub.next.store(NULL);
 
+   pthread_mutex_init(&_file_mutex, NULL);
+   pthread_cond_init(&_wake, NULL);
+
+   if (pthread_create(&_writer, NULL, writerThread, this) != 0)
+      throw std::runtime_error("Unable to start the log writer thread.");
 }
 
 
 LogMgr::~LogMgr() {
+   pthread_mutex_lock(&_file_mutex);
+   _stop = true;
+   pthread_cond_signal(&_wake);
+   pthread_mutex_unlock(&_file_mutex);
+
+   pthread_join(_writer, NULL);
+
    closeLog();
+
+   pthread_cond_destroy(&_wake);
+   pthread_mutex_destroy(&_file_mutex);
 }
 
 /***************************************************************************************************
- * createTimeStamp - creates a time stamp string and places it in buf
+ * createTimeStamp - creates a time stamp string and places it in buf. The formatted string is
+ *                   cached per thread and only rebuilt when the second changes.
  ***************************************************************************************************/
 void LogMgr::createTimestamp(std::string &buf) {
-   // Put together our timestamp and start the log with the stamp
-   std::string logstr;
+   thread_local time_t cached_time = -1;
+   thread_local char cached_str[27];
+
    time_t curtime = time(NULL);
-   char timestr[27];
-   if (ctime_r(&curtime, timestr) == NULL)
-      throw std::runtime_error("ctime_r function failed unexpectedly");
+   if (curtime != cached_time) {
+      if (ctime_r(&curtime, cached_str) == NULL)
+         throw std::runtime_error("ctime_r function failed unexpectedly");
 
-   buf = timestr;
-   clrNewlines(buf);
+      // Drop ctime's newline
+      cached_str[strcspn(cached_str, "\r\n")] = '\0';
+      cached_time = curtime;
+   }
 
+   buf = cached_str;
 }
 
 /***************************************************************************************************
- * writeLog - Writes a string to a log with the timestamp
+ * writeLog - Queues a string for the log with the timestamp. The writer thread puts it in the file
  *
  *    Params:  str - string to write to the log in const char * or std::string format
  *             lvl - the "importance" of this log - can be used to set verbosity
+ *
+ *    Throws: logfile_error if the writer thread could not open the log file
  ***************************************************************************************************/
 
 void LogMgr::writeLog(const char *str, unsigned int lvl) {
@@ -49,29 +79,143 @@ void LogMgr::writeLog(const char *str, unsigned int lvl) {
    if (lvl > _log_lvl)
       return;
 
+   if (_open_failed.exchange(false))
+      throw logfile_error("Unable to open log file to append.");
+
+   // Put together our timestamp and start the log with the stamp
+   LogNode *node = new LogNode;
+   createTimestamp(node->line);
+
+   // Now add on the text to log
+   node->line += " ";
+   node->line += str;
+   node->line += "\n";
+
+   push(node);
+}
+
+void LogMgr::writeLog(std::string &str, unsigned int lvl) {
+   return writeLog(str.c_str(), lvl);
+}
+
+/***************************************************************************************************
+ * push - adds a node to the queue (any thread). The producer swaps itself in as the new head and
+ *        then links the previous head to it, so producers never wait on each other.
+ ***************************************************************************************************/
+
+void LogMgr::push(LogNode *node) {
+   node->next.store(NULL, std::memory_order_relaxed);
+   LogNode *prev = _qhead.exchange(node, std::memory_order_acq_rel);
+   prev->next.store(node, std::memory_order_release);
+}
+
+/***************************************************************************************************
+ * pop - takes the oldest node off the queue (single consumer). The stub node keeps the queue from
+ *       ever being empty so producers and the consumer never touch the same pointer.
+ *
+ *    Returns: the node (caller deletes it), or NULL if empty or a push is only half done
+ ***************************************************************************************************/
+
+LogMgr::LogNode *LogMgr::pop() {
+   LogNode *tail = _qtail;
+   LogNode *next = tail->next.load(std::memory_order_acquire);
+
+   // Skip past the stub
+   if (tail == &_stub) {
+      if (next == NULL)
+         return NULL;
+      _qtail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+   }
+
+   if (next != NULL) {
+      _qtail = next;
+      return tail;
+   }
+
+   // tail is the last node unless a producer is between its exchange and its link
+   if (tail != _qhead.load(std::memory_order_acquire))
+      return NULL;
+
+   // Put the stub back behind the last node so it can be handed out
+   push(&_stub);
+   next = tail->next.load(std::memory_order_acquire);
+   if (next != NULL) {
+      _qtail = next;
+      return tail;
+   }
+   return NULL;
+}
+
+/***************************************************************************************************
+ * drain - writes every queued line to the log file, then flushes once for the whole batch. Opens
+ *         the file if needed. Must be called with _file_mutex held.
+ ***************************************************************************************************/
+
+void LogMgr::drain() {
+   LogNode *node = pop();
+   if (node == NULL)
+      return;
+
    // If the file is not open yet, open it
    if (_lfptr == NULL) {
       if ((_lfptr = fopen(_log_file.c_str(), "a+")) == NULL) {
-         throw logfile_error("Unable to open log file to append.");
+         _open_failed = true;
+
+         // Nowhere to put them, so drop what's queued
+         do {
+            delete node;
+         } while ((node = pop()) != NULL);
+         return;
       }
    }
 
-   // Put together our timestamp and start the log with the stamp
-   std::string logstr;
-   createTimestamp(logstr);
-
-   // Now add on the text to log
-   logstr += " ";
-   logstr += str;
-   logstr += "\n";
+   do {
+      fputs(node->line.c_str(), _lfptr);
+      delete node;
+   } while ((node = pop()) != NULL);
 
-   fputs(logstr.c_str(), _lfptr);
    fflush(_lfptr);
+}
+
+/***************************************************************************************************
+ * writerThread - commits the queued log lines every flush interval until the LogMgr is destroyed
+ *
+ *    Params:  arg - the LogMgr
+ ***************************************************************************************************/
 
+void *LogMgr::writerThread(void *arg) {
+   LogMgr *log = static_cast<LogMgr *>(arg);
+
+   pthread_mutex_lock(&log->_file_mutex);
+   while (!log->_stop) {
+      timespec wakeup;
+      clock_gettime(CLOCK_REALTIME, &wakeup);
+      unsigned int ms = log->_flush_interval;
+      wakeup.tv_sec += ms / 1000;
+      wakeup.tv_nsec += (ms % 1000) * 1000000L;
+      if (wakeup.tv_nsec >= 1000000000L) {
+         wakeup.tv_sec++;
+         wakeup.tv_nsec -= 1000000000L;
+      }
+
+      pthread_cond_timedwait(&log->_wake, &log->_file_mutex, &wakeup);
+
+      log->drain();
+   }
+   pthread_mutex_unlock(&log->_file_mutex);
+   return NULL;
 }
 
-void LogMgr::writeLog(std::string &str, unsigned int lvl) {
-   return writeLog(str.c_str(), lvl);
+/***************************************************************************************************
+ * flush - writes out the queued lines now rather than waiting for the writer thread
+ ***************************************************************************************************/
+
+void LogMgr::flush() {
+   pthread_mutex_lock(&_file_mutex);
+   drain();
+   pthread_mutex_unlock(&_file_mutex);
 }
 
 /***************************************************************************************************
@@ -93,12 +237,15 @@ void LogMgr::strerrLog(const char *str, unsigned int lvl) {
    return writeLog(logstr.c_str(), lvl);
 }
 
-// self-explanatory
+// self-explanatory - anything still queued is written out first
 void LogMgr::closeLog() {
+   pthread_mutex_lock(&_file_mutex);
+   drain();
    if (_lfptr != NULL) {
       fclose(_lfptr);
       _lfptr = NULL;
    }
+   pthread_mutex_unlock(&_file_mutex);
 }
 
 
@@ -108,6 +255,15 @@ void LogMgr::closeLog() {
  ***************************************************************************************************/
 
 void LogMgr::changeFilename(const char *filename) {
-   closeLog();
+   pthread_mutex_lock(&_file_mutex);
+
+   // Lines logged before the change belong in the old file
+   drain();
+   if (_lfptr != NULL) {
+      fclose(_lfptr);
+      _lfptr = NULL;
+   }
    _log_file = filename;
+
+   pthread_mutex_unlock(&_file_mutex);
 }
@@ -1,6 +1,8 @@
 #include <fstream>
+#include <iostream>
 #include <arpa/inet.h>
 #include <tuple>
+#include <algorithm>
 #include <sstream>
 #include <crypto++/osrng.h>
 #include <crypto++/filters.h>
@@ -22,6 +24,9 @@ QueueMgr::QueueMgr(unsigned int verbosity):TCPServer(verbosity)
       throw std::runtime_error("Could not open server.txt file, or file was empty/corrupt.");
 
    loadAESKey("sharedkey.bin");
+
+   CryptoPP::AutoSeededRandomPool rng;
+   rng.GenerateBlock(reinterpret_cast<CryptoPP::byte *>(&_repl_epoch), sizeof(_repl_epoch));
 }
 
 // Destructor - does nothing right now
@@ -151,17 +156,26 @@ void QueueMgr::bindSvr(const char *ip_addr, short unsigned int port) {
 /*********************************************************************************************
  * handleQueue - runs through a cycle on the queue, accepting new connections and handling
  *               any data read from the connections, storing it in the connection buffer
- *               for later retrieval. 
+ *               for later retrieval. Blocks in the reactor until a socket is ready or
+ *               timeout_ms passes, so the caller does not need to sleep between cycles.
+ *
+ *    Params:  timeout_ms - longest to wait for socket activity
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::handleQueue() {
+void QueueMgr::handleQueue(int timeout_ms) {
+
+   // Wait for activity on the sockets
+   pollEvents(timeout_ms);
 
    // Accept new connections, if any
    handleSocket();
 
    // Handle any open connections, reading from and writing to the socket
    handleConnections();
+
+   // Record what the peers have acked
+   updateWatermarks();
    
    // Get data from input buffers on connections and add to the queue
    populateQueue();
@@ -190,12 +204,17 @@ void QueueMgr::populateQueue() {
             // Handle this better later on
             throw std::runtime_error("TCPConn claimed replication data but none existed.");
          }
+
+         // Keep where it came from, so it can be acked on this session once applied
+         repl_seq seq;
+         seq.conn_id = (*conn_it)->getConnID();
+         seq.session = (*conn_it)->getSessionID();
         
          // Add this data to the queue
-         _queue.emplace(recv, (*conn_it)->getNodeID(), buf);
+         _queue.emplace(recv, (*conn_it)->getNodeID(), buf, (*conn_it)->getInputSeal(), seq);
          if (_verbosity >= 3) {
             std::cout << "Replication info pulled off connection and placed into queue w/ " <<
-                              (buf.size()-4) / DronePlot::getDataSize() << " potential plots.\n";
+                              buf.size() << " bytes.\n";
          }   
       }      
    }
@@ -206,12 +225,13 @@ void QueueMgr::populateQueue() {
                will happen on its own
  *
  *    Params:  data - the data in binary form to send to the server
+ *             src_first, src_last - the caller's range for the data's source
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::sendToAll(std::vector<uint8_t> &data) {
+void QueueMgr::sendToAll(std::vector<uint8_t> &data, uint64_t src_first, uint64_t src_last) {
    for (unsigned int i=0; i<_server_list.size(); i++) {
-      sendToServer(std::get<0>(_server_list[i]).c_str(), data);
+      sendToServer(std::get<0>(_server_list[i]).c_str(), data, src_first, src_last);
    }
 
 }
@@ -222,11 +242,14 @@ void QueueMgr::sendToAll(std::vector<uint8_t> &data) {
  *
  *    Params:  server_id - string of the server's name (will be mapped automatically to IP)
  *             data - the data in binary form to send to the server
+ *             src_first, src_last - the caller's range for the data's source, handed back by
+ *                                   takeLostRange if the data has to be dropped unsent
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
-   _queue.emplace(send, server_id, data);
+void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data,
+                                             uint64_t src_first, uint64_t src_last) {
+   _queue.emplace(send, server_id, data, sealed_input(), repl_seq(), src_first, src_last);
 
 }
 
@@ -237,21 +260,25 @@ void QueueMgr::sendToServer(const char *server_id, std::vector<uint8_t> &data) {
  *
  *    Params:  sid - pop action places the first recv'd pop server id into this attribute
  *             data - data received gets loaded into this vector
+ *             seal - the key, nonce and frame flags to open the data with
+ *             seq - the session the data arrived on, for ackBatch
  *
  *    Returns: true for an incoming element found, false otherwise. Returns false even if
  *             outgoing connections are found in the process 
  *
  *    Throws: socket_error for any network issues
  *********************************************************************************************/
-bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
+bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data, sealed_input &seal,
+                                                                    repl_seq &seq) {
    while (_queue.size() > 0) {
-      auto next_qe = _queue.front();
+      auto &next_qe = _queue.front();
 
       // If this a send item, create a connection and start sending
       if (next_qe.type == send) {
 
          // Set up the connection and attempt to establish link (will retry if failure)
-         launchDataConn(next_qe.server_id.c_str(), next_qe.data);
+         launchDataConn(next_qe.server_id.c_str(), next_qe.data, next_qe.src_first,
+                                                                 next_qe.src_last);
 
          _queue.pop();
          continue;  
@@ -259,6 +286,8 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
 
       sid = next_qe.server_id;
       data = std::move(next_qe.data);
+      seal = next_qe.seal;
+      seq = next_qe.seq;
       _queue.pop();
       return true;
    }
@@ -266,14 +295,100 @@ bool QueueMgr::pop(std::string &sid, std::vector<uint8_t> &data) {
 }
 
 /*********************************************************************************************
- * launchDataConn - launches a connection and starts the process of sending the queue data to
- *                  the target server
+ * ackBatch - acks a received batch on the session it arrived on, once the caller has applied
+ *            it. If that session is gone the ack is dropped; the sender resends the batch on
+ *            its next session and the caller skips and acks it then.
  *
- *    Params:  sid - pop action places the first recv'd pop server id into this attribute
- *             data - data received gets loaded into this vector
+ *    Params:  seq - the session and sequence range returned by pop
  *
  *********************************************************************************************/
-void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
+void QueueMgr::ackBatch(const repl_seq &seq) {
+   for (auto &conn : _connlist) {
+      if (conn->getConnID() == seq.conn_id) {
+         if (conn->isConnected() && (conn->getSessionID() == seq.session))
+            conn->sendAck(seq.last);
+         return;
+      }
+   }
+}
+
+/*********************************************************************************************
+ * dropBatch - drops the session a popped batch arrived on because the batch failed
+ *             authentication or was malformed. The batch is not acked, so the sender resends
+ *             it on a fresh session.
+ *
+ *    Params:  seq - the session returned by pop
+ *             reason - what was wrong with the frame, for the server log
+ *
+ *********************************************************************************************/
+void QueueMgr::dropBatch(const repl_seq &seq, const char *reason) {
+   for (auto &conn : _connlist) {
+      if (conn->getConnID() == seq.conn_id) {
+         if (!conn->isConnected() || (conn->getSessionID() != seq.session))
+            return;
+
+         std::stringstream msg;
+         msg << "Replication frame from " << conn->getNodeID() << " " << reason <<
+                ". Disconnecting.";
+         _server_log.writeLog(msg.str().c_str());
+         conn->disconnect();
+         return;
+      }
+   }
+}
+
+/*********************************************************************************************
+ * launchDataConn - queues the data on the persistent session to the target server. The first
+ *                  time a server is used, the session is created and added to the pool; after
+ *                  that it is reused (and reconnected with backoff if it drops)
+ *
+ *             If the session has to drop older batches to make room, their source ranges
+ *             are moved to the peer's lost list for takeLostRange.
+ *
+ *    Params:  sid - the server ID to send to
+ *             data - the data to send
+ *             src_first, src_last - the caller's range for the data's source
+ *
+ *********************************************************************************************/
+void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data, uint64_t src_first,
+                                                                          uint64_t src_last) {
+   repl_peer &peer = _repl_peers[sid];
+   uint64_t seq = ++peer.last_seq;
+   std::vector<uint64_t> dropped_seqs;
+
+   peer.sources[seq] = std::make_pair(src_first, src_last);
+
+   // Reuse the existing session if we have one
+   auto pool_it = _peer_conns.find(sid);
+   if (pool_it != _peer_conns.end()) {
+      size_t dropped = pool_it->second->assignOutgoingData(data, seq, dropped_seqs);
+
+      // Keep what the dropped batches held, merging runs of consecutive batches
+      for (uint64_t ds : dropped_seqs) {
+         auto src_it = peer.sources.find(ds);
+         if (src_it == peer.sources.end())
+            continue;
+
+         if (!peer.lost.empty() && (ds == peer.last_lost_seq + 1)) {
+            peer.lost.back().first = std::min(peer.lost.back().first, src_it->second.first);
+            peer.lost.back().second = std::max(peer.lost.back().second, src_it->second.second);
+         } else
+            peer.lost.push_back(src_it->second);
+         peer.last_lost_seq = ds;
+         peer.sources.erase(src_it);
+      }
+
+      if (dropped > 0) {
+         std::stringstream msg;
+         msg << "Replication queue to SID " << sid << " full, dropped " << dropped <<
+                " of the oldest plots. They are requeued once the session catches up.";
+         _server_log.writeLog(msg.str().c_str());
+      }
+
+      if ((_verbosity >= 2) && (seq - peer.acked > 1))
+         std::cout << (seq - peer.acked) << " batches awaiting ack from " << sid << ".\n";
+      return;
+   }
 
    unsigned long ip_addr;
    unsigned short port;
@@ -292,24 +407,84 @@ void QueueMgr::launchDataConn(const char *sid, std::vector<uint8_t> &data) {
       throw std::runtime_error("Attempt to send data to server ID not in the server list.");
    }
 
-   // Try to connect to the server and if there's an issue, delete and re-throw socket_error
-   TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+   // Try to connect to the server and if there's an issue, schedule a retry
+   TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _tickets, _verbosity);
    new_conn->setNodeID(sid);
    new_conn->setSvrID(getServerID());
+   new_conn->setPersistent(true);
+   new_conn->setReplEpoch(_repl_epoch);
 
    try {
       new_conn->connect(ip_addr, port);
+      watchConn(new_conn);
    } catch (socket_error &e) {
       std::stringstream msg;
       msg << "Connect to SID " << sid << " failed when trying to send data. Retrying. Msg: " <<
                         e.what();
       _server_log.writeLog(msg.str().c_str());
       new_conn->disconnect();
-      new_conn->reconnect = time(NULL) + reconnect_delay;  // Try again in 5 seconds, real-world
+      new_conn->scheduleReconnect();
    }
 
 
-   new_conn->assignOutgoingData(data);
+   new_conn->assignOutgoingData(data, seq, dropped_seqs);
    _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
+   _peer_conns[sid] = new_conn;
 }
 
+
+/*********************************************************************************************
+ * updateWatermarks - copies each peer session's acked sequence number into the peer's
+ *                    replication state
+ *
+ *********************************************************************************************/
+void QueueMgr::updateWatermarks() {
+   for (auto &pc : _peer_conns) {
+      repl_peer &peer = _repl_peers[pc.first];
+      uint64_t acked = pc.second->getAckedSeq();
+
+      if (acked > peer.acked) {
+         if ((_verbosity >= 3) && (peer.last_seq > acked))
+            std::cout << pc.first << " acked through " << acked << ", " << 
+                         (peer.last_seq - acked) << " batches still outstanding.\n";
+         peer.acked = acked;
+         peer.sources.erase(peer.sources.begin(), peer.sources.upper_bound(acked));
+      }
+   }
+}
+
+/*********************************************************************************************
+ * takeLostRange - takes the oldest source range a peer's session dropped unsent, once that
+ *                 session is back up with its queue at most half full, so the caller can
+ *                 rebuild the data and queue it again (sendToServer)
+ *
+ *    Params:  sid - set to the peer the range was meant for
+ *             src_first, src_last - set to the range, as given to sendToServer
+ *
+ *    Returns: true if a range was taken, false if there is none ready
+ *********************************************************************************************/
+bool QueueMgr::takeLostRange(std::string &sid, uint64_t &src_first, uint64_t &src_last) {
+   for (auto &pc : _peer_conns) {
+      repl_peer &peer = _repl_peers[pc.first];
+
+      if (peer.lost.empty() || !pc.second->isSessionUp() ||
+          (pc.second->getOutgoingBytes() > max_outqueue_bytes / 2))
+         continue;
+
+      sid = pc.first;
+      src_first = peer.lost.front().first;
+      src_last = peer.lost.front().second;
+      peer.lost.pop_front();
+      return true;
+   }
+   return false;
+}
+
+/*********************************************************************************************
+ * putLostRange - returns the part of a range from takeLostRange the caller did not get to, so
+ *                it is the first one taken next time
+ *
+ *********************************************************************************************/
+void QueueMgr::putLostRange(const char *sid, uint64_t src_first, uint64_t src_last) {
+   _repl_peers[sid].lost.emplace_front(src_first, src_last);
+}
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <unistd.h>
+#include <pthread.h>
+#include "RadixSort.h"
+
+// Digit size - 8 bits gives 256 buckets (small enough to stay in cache) and 8 passes at most
+const unsigned int radix_bits = 8;
+const size_t radix_buckets = static_cast<size_t>(1) << radix_bits;
+
+// Fewest items worth giving a thread of its own
+const size_t radix_min_block = 1 << 14;
+
+namespace {
+
+// State shared by the threads sorting one array. The workers wait at the start gate until the
+// caller knows how many threads it managed to start, then sync at the barrier between phases
+struct radix_job {
+   radix_item *items;
+   radix_item *scratch;
+   size_t count;
+   unsigned int threads;
+
+   std::vector<uint64_t> diffs;    // Per thread, key bits that differ from the first key
+   std::vector<size_t> counts;     // Per thread digit counts for the current pass
+
+   pthread_mutex_t gate_mutex;
+   pthread_cond_t gate_cond;
+   bool started;
+   pthread_barrier_t barrier;
+};
+
+struct radix_worker {
+   radix_job *job;
+   unsigned int id;
+};
+
+/*****************************************************************************************
+ * sortBlock - one thread's share of the sort, working on block id of the items. Every
+ *             thread works out the same set of passes, so they all hit the barriers in
+ *             step and agree on where the result ends up.
+ *****************************************************************************************/
+
+void sortBlock(radix_job &job, unsigned int id) {
+   size_t begin = job.count * id / job.threads;
+   size_t end = job.count * (id + 1) / job.threads;
+
+   // Find the key bytes that vary, so constant ones can be skipped
+   uint64_t first = job.items[0].key;
+   uint64_t diff = 0;
+   for (size_t i=begin; i<end; i++)
+      diff |= job.items[i].key ^ first;
+   job.diffs[id] = diff;
+
+   pthread_barrier_wait(&job.barrier);
+
+   diff = 0;
+   for (uint64_t d : job.diffs)
+      diff |= d;
+
+   radix_item *src = job.items;
+   radix_item *dst = job.scratch;
+   size_t offsets[radix_buckets];
+
+   for (unsigned int shift=0; shift<64; shift+=radix_bits) {
+      if (((diff >> shift) & (radix_buckets - 1)) == 0)
+         continue;
+
+      size_t *counts = &job.counts[id * radix_buckets];
+      std::fill(counts, counts + radix_buckets, 0);
+      for (size_t i=begin; i<end; i++)
+         counts[(src[i].key >> shift) & (radix_buckets - 1)]++;
+
+      pthread_barrier_wait(&job.barrier);
+
+      // This block's slice of each bucket starts after every smaller digit, then after the
+      // same digit from the blocks before it
+      size_t pos = 0;
+      for (size_t digit=0; digit<radix_buckets; digit++) {
+         for (unsigned int t=0; t<job.threads; t++) {
+            if (t == id)
+               offsets[digit] = pos;
+            pos += job.counts[t * radix_buckets + digit];
+         }
+      }
+
+      for (size_t i=begin; i<end; i++)
+         dst[offsets[(src[i].key >> shift) & (radix_buckets - 1)]++] = src[i];
+
+      // Everyone done scattering (and reading the counts) before the next pass
+      pthread_barrier_wait(&job.barrier);
+      std::swap(src, dst);
+   }
+}
+
+/*****************************************************************************************
+ * t_sortBlock - worker thread function, waits at the start gate then sorts its block
+ *****************************************************************************************/
+
+void *t_sortBlock(void *data) {
+   radix_worker *worker = static_cast<radix_worker *>(data);
+   radix_job &job = *worker->job;
+
+   pthread_mutex_lock(&job.gate_mutex);
+   while (!job.started)
+      pthread_cond_wait(&job.gate_cond, &job.gate_mutex);
+   pthread_mutex_unlock(&job.gate_mutex);
+
+   sortBlock(job, worker->id);
+   return NULL;
+}
+
+}
+
+/*****************************************************************************************
+ * radixSort - sorts items by key, stable
+ *
+ *    Params:  items - the items to sort, sorted in place
+ *             threads - most threads to use, 0 for one per online core
+ *
+ *****************************************************************************************/
+
+void radixSort(std::vector<radix_item> &items, unsigned int threads) {
+   size_t count = items.size();
+   if (count < 2)
+      return;
+
+   if (threads == 0) {
+      long cores = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = (cores > 1) ? static_cast<unsigned int>(cores) : 1;
+   }
+   threads = static_cast<unsigned int>(std::min<size_t>(threads,
+                                              std::max<size_t>(1, count / radix_min_block)));
+
+   std::vector<radix_item> scratch(count);
+
+   radix_job job;
+   job.items = items.data();
+   job.scratch = scratch.data();
+   job.count = count;
+   job.started = false;
+   pthread_mutex_init(&job.gate_mutex, NULL);
+   pthread_cond_init(&job.gate_cond, NULL);
+
+   // Start the helpers; if some can't be created, sort with the ones that were
+   std::vector<pthread_t> helpers;
+   std::vector<radix_worker> workers(threads);
+   for (unsigned int i=1; i<threads; i++) {
+      workers[i].job = &job;
+      workers[i].id = i;
+
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, t_sortBlock, (void *) &workers[i]) != 0)
+         break;
+      helpers.push_back(thread);
+   }
+
+   job.threads = static_cast<unsigned int>(helpers.size()) + 1;
+   job.diffs.assign(job.threads, 0);
+   job.counts.assign(job.threads * radix_buckets, 0);
+   pthread_barrier_init(&job.barrier, NULL, job.threads);
+
+   pthread_mutex_lock(&job.gate_mutex);
+   job.started = true;
+   pthread_cond_broadcast(&job.gate_cond);
+   pthread_mutex_unlock(&job.gate_mutex);
+
+   sortBlock(job, 0);
+
+   for (pthread_t &thread : helpers)
+      pthread_join(thread, NULL);
+
+   pthread_barrier_destroy(&job.barrier);
+   pthread_cond_destroy(&job.gate_cond);
+   pthread_mutex_destroy(&job.gate_mutex);
+
+   // An odd number of passes leaves the result in the scratch buffer
+   uint64_t diff = 0;
+   for (uint64_t d : job.diffs)
+      diff |= d;
+
+   unsigned int passes = 0;
+   for (unsigned int shift=0; shift<64; shift+=radix_bits) {
+      if ((diff >> shift) & (radix_buckets - 1))
+         passes++;
+   }
+
+   if (passes % 2 == 1)
+      items.swap(scratch);
+}
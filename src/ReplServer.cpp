@@ -1,10 +1,30 @@
 #include <iostream>
 #include <exception>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "ReplServer.h"
+#include "BatchCodec.h"
 #include "handleDuplication.h"
 
-const time_t secs_between_repl = 20;
+// New plots are replicated as soon as a full batch has built up or the oldest one has waited
+// max_repl_latency (simulated seconds), whichever comes first. The DB wakes the loop when plots
+// arrive, so there is no fixed replication timer. Records are fixed size, so the batch limit
+// also bounds the bytes per batch (flush_batch_plots * plot_rec_size)
+const size_t flush_batch_plots = 512;
+const float max_repl_latency = 1.0;
+
+// Most plots rebuilt at a time from a range a peer's queue dropped - one frame's worth
+const size_t requeue_batch_plots = max_coalesce_bytes / plot_rec_size;
+
+// Receive pipeline - batches waiting at each stage before the stage feeding it blocks, and the
+// most decode threads (one per core beyond the network and ingest threads)
+const size_t pipeline_depth = 64;
+const unsigned int max_decode_threads = 8;
 const unsigned int max_servers = 10;
 
 /*********************************************************************************************
@@ -23,9 +43,14 @@ ReplServer::ReplServer(DronePlotDB &plotdb, float time_mult)
                                _time_mult(time_mult),
                                _verbosity(1),
                                _ip_addr("127.0.0.1"),
-                               _port(9999)
+                               _port(9999),
+                               _ingest_queue(pipeline_depth)
 {
    _start_time = time(NULL);
+   pthread_mutex_init(&_ack_mutex, NULL);
+
+   // Reject duplicates from other sites as they arrive instead of sweeping for them later
+   _plotdb.enableDedup();
 }
 
 ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short port, int offset, 
@@ -36,15 +61,24 @@ ReplServer::ReplServer(DronePlotDB &plotdb, const char *ip_addr, unsigned short
                                   _time_mult(time_mult), 
                                   _verbosity(verbosity),
                                   _ip_addr(ip_addr),
-                                  _port(port)
+                                  _port(port),
+                                  _ingest_queue(pipeline_depth)
 
 {
    _start_time = time(NULL) + offset;
+   pthread_mutex_init(&_ack_mutex, NULL);
    this->election();
+
+   // Reject duplicates from other sites as they arrive instead of sweeping for them later
+   _plotdb.enableDedup();
 }
 
 ReplServer::~ReplServer() {
+   stopPipeline();
 
+   if (_ack_fd != -1)
+      close(_ack_fd);
+   pthread_mutex_destroy(&_ack_mutex);
 }
 
 
@@ -57,6 +91,16 @@ time_t ReplServer::getAdjustedTime() {
    return static_cast<time_t>((time(NULL) - _start_time) * _time_mult);
 }
 
+/**********************************************************************************************
+ * monotonicMillis - milliseconds on the monotonic clock, for measuring plot latency
+ **********************************************************************************************/
+
+static int64_t monotonicMillis() {
+   timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**********************************************************************************************
  * replicate - the main function managing replication activities. Manages the QueueMgr and reads
  *             from the queue, deconflicting entries and populating the DronePlotDB object with
@@ -78,7 +122,16 @@ void ReplServer::replicate() {
 
    // Track when we started the server
    _start_time = time(NULL);
-   _last_repl = 0;
+   _oldest_pending = 0;
+
+   // Have the database wake the reactor when new plots show up or a batch fills
+   _plotdb.setNotifyThreshold(flush_batch_plots);
+   _queue.watchWakeFD(_plotdb.getNotifyFD());
+
+   // And the ingest thread wake it when applied batches are ready to ack
+   if ((_ack_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+      throw std::runtime_error("Unable to create the replication ack eventfd");
+   _queue.watchWakeFD(_ack_fd);
 
    // Set up our queue's listening socket
    _queue.bindSvr(_ip_addr.c_str(), _port);
@@ -87,37 +140,234 @@ void ReplServer::replicate() {
    if (_verbosity >= 2)
       std::cout << "Server bound to " << _ip_addr << ", port: " << _port << " and listening\n";
 
+   startPipeline();
+
   
    // Replicate until we get the shutdown signal
    while (!_shutdown) {
 
-      // Check for new connections, process existing connections, and populate the queue as applicable
-      _queue.handleQueue();     
+      // Check for new connections, process existing connections, and populate the queue as applicable.
+      // Waits in the reactor for socket activity or new plots, no longer than the next flush is due
+      _queue.handleQueue(getFlushTimeout());
 
-      // See if it's time to replicate and, if so, go through the database, identifying new plots
-      // that have not been replicated yet and adding them to the queue for replication
-      if (getAdjustedTime() - _last_repl > secs_between_repl) {
+      // Ack whatever the ingest thread has applied since the last pass
+      sendAcks();
 
+      // If enough new plots have built up, or the oldest has waited long enough, take the plots
+      // that have not been replicated yet and add them to the queue for replication
+      if (flushDue()) {
          queueNewPlots();
-         _last_repl = getAdjustedTime();
+         _oldest_pending = 0;
+
+         // Data is arriving, so this is also when old segments may have aged out
+         if (_retention > 0) {
+            size_t dropped = _plotdb.dropSegmentsBefore(getAdjustedTime() - _retention);
+            if ((dropped > 0) && (_verbosity >= 2))
+               std::cout << "Retention dropped " << dropped << " plots.\n";
+         }
       }
+
+      // Rebuild plots a peer's queue dropped while it was down, once it has caught up
+      requeueLostPlots();
       
       // Check the queue for updates and pop them until the queue is empty. The pop command only returns
       // incoming replication information--outgoing replication in the queue gets turned into a TCPConn
       // object and automatically removed from the queue by pop
-      std::string sid;
-      std::vector<uint8_t> data;
-      while (_queue.pop(sid, data)) {
+      repl_job job;
+      while (_queue.pop(job.sid, job.data, job.seal, job.seq)) {
 
-         // Incoming replication--add it to this server's local database
-         addReplDronePlots(data);         
+         // Incoming replication--hand it to the pipeline to decode and add to the local database.
+         // Always the same decode thread per sender, so its batches stay in order
+         size_t shard = std::hash<std::string>()(job.sid) % _decoders.size();
+         _decoders[shard]->queue.push(job);
       }
 //      this->_plotdb.lockMutex();
 //      this->handleDuplicates();
 //      this->_plotdb.unlockMutex();
-
-      usleep(1000);
    }   
+
+   // Let the pipeline finish what was received before we return
+   stopPipeline();
+}
+
+/**********************************************************************************************
+ * startPipeline - launches the decode pool and the ingest thread. The pool gets one thread per
+ *                 core beyond the network and ingest threads, at least one and at most
+ *                 max_decode_threads. Each decode thread has its own queue; a sender's
+ *                 batches all go to one thread, so there is no use for more than one per peer.
+ *
+ *    Throws: runtime_error if a thread cannot be created
+ **********************************************************************************************/
+
+void ReplServer::startPipeline() {
+   long cores = sysconf(_SC_NPROCESSORS_ONLN);
+   unsigned int count = (cores > 3) ? static_cast<unsigned int>(cores - 2) : 1;
+   count = std::min(count, max_decode_threads);
+   count = std::min(count, std::max(_queue.getNumServers(), 1U));
+
+   for (unsigned int i=0; i<count; i++) {
+      _decoders.emplace_back(new decode_worker(this, pipeline_depth));
+      if (pthread_create(&_decoders.back()->thread, NULL, t_decode,
+                                                 (void *) _decoders.back().get()) != 0) {
+         _decoders.pop_back();
+         throw std::runtime_error("Unable to create replication decode thread");
+      }
+   }
+
+   if (pthread_create(&_ingest_thread, NULL, t_ingest, (void *) this) != 0)
+      throw std::runtime_error("Unable to create replication ingest thread");
+
+   if (_verbosity >= 2)
+      std::cout << "Replication pipeline started with " << count << " decode threads\n";
+}
+
+/**********************************************************************************************
+ * stopPipeline - closes the decode queues, waits for the decoders to drain them, then does the
+ *                same for the ingest thread, so everything received ends up in the database
+ **********************************************************************************************/
+
+void ReplServer::stopPipeline() {
+   if (_decoders.empty())
+      return;
+
+   for (auto &worker : _decoders)
+      worker->queue.close();
+   for (auto &worker : _decoders)
+      pthread_join(worker->thread, NULL);
+   _decoders.clear();
+
+   _ingest_queue.close();
+   pthread_join(_ingest_thread, NULL);
+}
+
+/**********************************************************************************************
+ * t_decode/t_ingest - thread functions for pthread_create, passed the decode_worker or the
+ *                     ReplServer in data
+ **********************************************************************************************/
+
+void *ReplServer::t_decode(void *data) {
+   decode_worker *worker = static_cast<decode_worker *>(data);
+   worker->server->decodeBatches(worker->queue);
+   return NULL;
+}
+
+void *ReplServer::t_ingest(void *data) {
+   static_cast<ReplServer *>(data)->ingestBatches();
+   return NULL;
+}
+
+/**********************************************************************************************
+ * decodeBatches - decode thread loop. Opens the sealed frames, expands compressed batches back
+ *                 to packed records and passes them on to the ingest thread in the order they
+ *                 were queued. A frame that fails to open, or whose batch fails to
+ *                 decompress, is not passed on or acked; its session is dropped instead so the
+ *                 sender resends it on a fresh one.
+ *
+ *    Params: queue - this thread's shard of the received batches
+ **********************************************************************************************/
+
+void ReplServer::decodeBatches(BoundedQueue<repl_job> &queue) {
+   repl_job job;
+
+   while (queue.pop(job)) {
+      if (!TCPConn::openReplFrame(job.seal, job.data, job.seq.epoch, job.seq.first,
+                                                                     job.seq.last)) {
+         postDrop(job.seq, "failed authentication");
+         continue;
+      }
+
+      if (job.seal.flags & frame_compressed) {
+         std::vector<uint8_t> batch;
+         if (!decompressBatch(job.data.data(), job.data.size(), batch)) {
+            postDrop(job.seq, "failed to decompress");
+            continue;
+         }
+         job.data.swap(batch);
+      }
+
+      if (!_ingest_queue.push(job))
+         break;
+   }
+}
+
+/**********************************************************************************************
+ * ingestBatches - ingest thread loop, the only thread adding replicated plots to the database.
+ *                 A resend of batches already applied (their ack was lost) is skipped. A new
+ *                 epoch means the sender restarted and numbers from 1 again. Each batch is
+ *                 acked once it is applied or skipped.
+ **********************************************************************************************/
+
+void ReplServer::ingestBatches() {
+   repl_job job;
+
+   while (_ingest_queue.pop(job)) {
+      repl_cursor &cursor = _applied[job.sid];
+
+      if ((cursor.epoch == job.seq.epoch) && (job.seq.last <= cursor.applied)) {
+         if (_verbosity >= 3)
+            std::cout << "Replication batches " << job.seq.first << "-" << job.seq.last <<
+                         " from " << job.sid << " already applied, skipping.\n";
+      } else {
+         try {
+            addReplDronePlots(job.data);
+         } catch (std::runtime_error &e) {
+            std::cout << "Dropped replication batch from " << job.sid << ": " << e.what() <<
+                         "\n";
+         }
+         cursor.epoch = job.seq.epoch;
+         cursor.applied = job.seq.last;
+      }
+
+      postAck(job.seq);
+   }
+}
+
+/**********************************************************************************************
+ * postAck/postDrop - queues the ack for an applied batch, or the drop of the session a batch
+ *                    that failed to open came on (with the reason, for the server log), and
+ *                    wakes the network thread to send it
+ **********************************************************************************************/
+
+void ReplServer::postAck(const QueueMgr::repl_seq &seq) {
+   pthread_mutex_lock(&_ack_mutex);
+   _acks.push_back(seq);
+   pthread_mutex_unlock(&_ack_mutex);
+
+   uint64_t one = 1;
+   if (write(_ack_fd, &one, sizeof(one)) == -1) {
+      // Counter saturated, the reactor is already due to wake
+   }
+}
+
+void ReplServer::postDrop(const QueueMgr::repl_seq &seq, const char *reason) {
+   pthread_mutex_lock(&_ack_mutex);
+   _drops.emplace_back(seq, reason);
+   pthread_mutex_unlock(&_ack_mutex);
+
+   uint64_t one = 1;
+   if (write(_ack_fd, &one, sizeof(one)) == -1) {
+      // Counter saturated, the reactor is already due to wake
+   }
+}
+
+/**********************************************************************************************
+ * sendAcks - sends the acks, and drops the sessions, posted by the pipeline threads, on the
+ *            network thread
+ **********************************************************************************************/
+
+void ReplServer::sendAcks() {
+   std::vector<QueueMgr::repl_seq> acks;
+   std::vector<std::pair<QueueMgr::repl_seq, std::string>> drops;
+
+   pthread_mutex_lock(&_ack_mutex);
+   acks.swap(_acks);
+   drops.swap(_drops);
+   pthread_mutex_unlock(&_ack_mutex);
+
+   for (const QueueMgr::repl_seq &seq : acks)
+      _queue.ackBatch(seq);
+   for (const auto &drop : drops)
+      _queue.dropBatch(drop.first, drop.second.c_str());
 }
 
 /**********************************************************************************************
@@ -131,27 +381,30 @@ void ReplServer::replicate() {
 
 unsigned int ReplServer::queueNewPlots() {
    std::vector<uint8_t> marshall_data;
+   std::vector<plot_handle> new_plots;
    unsigned int count = 0;
 
    if (_verbosity >= 3)
       std::cout << "Replicating plots.\n";
 
-   // Loop through the drone plots, looking for new ones
-   std::list<DronePlot>::iterator dpit = _plotdb.begin();
-   for ( ; dpit != _plotdb.end(); dpit++) {
+   // Hold the DB lock so the antenna thread can't grow the columns under us
+   _plotdb.lockMutex();
 
-      // If this is a new one, marshall it and clear the flag
-      if (dpit->isFlagSet(DBFLAG_NEW)) {
-         
-         dpit->serialize(marshall_data);
-         dpit->clrFlags(DBFLAG_NEW);
+   try {
+      // Take the plots logged as new since the last round (clears their flag)
+      _plotdb.takePending(new_plots);
+      count = new_plots.size();
 
-         count++;
+      // Marshall them all in one pass, leaving room for the count on the front
+      if (count > 0) {
+         marshall_data.resize(sizeof(unsigned int) + count * plot_rec_size);
+         _plotdb.encodePlots(new_plots.data(), count, &marshall_data[sizeof(unsigned int)]);
       }
-      if (marshall_data.size() % DronePlot::getDataSize() != 0)
-         throw std::runtime_error("Issue with marshalling!");
-
+   } catch (std::runtime_error &e) {
+      _plotdb.unlockMutex();
+      throw;
    }
+   _plotdb.unlockMutex();
   
    if (count == 0) {
       if (_verbosity >= 3)
@@ -164,12 +417,11 @@ unsigned int ReplServer::queueNewPlots() {
    if (_verbosity >= 3)
       std::cout << "Adding in count: " << count << "\n";
 
-   uint8_t *ctptr_begin = (uint8_t *) &count;
-   marshall_data.insert(marshall_data.begin(), ctptr_begin, ctptr_begin+sizeof(unsigned int));
+   memcpy(marshall_data.data(), &count, sizeof(unsigned int));
 
-   // Send to the queue manager
+   // Send to the queue manager, with the handle range so a batch dropped unsent can be rebuilt
    if (marshall_data.size() > 0) {
-      _queue.sendToAll(marshall_data);
+      _queue.sendToAll(marshall_data, new_plots.front(), new_plots.back());
    }
 
    if (_verbosity >= 2) 
@@ -178,6 +430,95 @@ unsigned int ReplServer::queueNewPlots() {
    return count;
 }
 
+/**********************************************************************************************
+ * requeueLostPlots - takes a handle range a peer's session dropped unsent (see QueueMgr) and
+ *                    queues the plots in it to that peer again, read back from the database.
+ *                    Plots retention has removed since are gone for good. Does a frame's worth
+ *                    at most per call, handing the rest of the range back for the next one.
+ *
+ *    Returns: number of plots requeued
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+unsigned int ReplServer::requeueLostPlots() {
+   std::string sid;
+   uint64_t first, last;
+
+   if (!_queue.takeLostRange(sid, first, last))
+      return 0;
+
+   std::vector<uint8_t> marshall_data;
+   std::vector<plot_handle> lost_plots;
+   plot_handle next;
+
+   _plotdb.lockMutex();
+
+   try {
+      next = _plotdb.collectSynced(first, last, requeue_batch_plots, lost_plots);
+      if (lost_plots.size() > 0) {
+         marshall_data.resize(sizeof(unsigned int) + lost_plots.size() * plot_rec_size);
+         _plotdb.encodePlots(lost_plots.data(), lost_plots.size(),
+                                                   &marshall_data[sizeof(unsigned int)]);
+      }
+   } catch (std::runtime_error &e) {
+      _plotdb.unlockMutex();
+      throw;
+   }
+   _plotdb.unlockMutex();
+
+   if (next <= last)
+      _queue.putLostRange(sid.c_str(), next, last);
+
+   unsigned int count = lost_plots.size();
+   if (count == 0)
+      return 0;
+
+   memcpy(marshall_data.data(), &count, sizeof(unsigned int));
+   _queue.sendToServer(sid.c_str(), marshall_data, lost_plots.front(), lost_plots.back());
+
+   if (_verbosity >= 2)
+      std::cout << "Requeued " << count << " plots dropped from the queue to " << sid << ".\n";
+
+   return count;
+}
+
+/**********************************************************************************************
+ * flushDue - checks the database's pending log. Starts the latency clock when new plots first
+ *            show up (the DB wakes the reactor for them, so this is close to their arrival)
+ *
+ *    Returns: true if a full batch is waiting or the oldest plot is at max_repl_latency
+ **********************************************************************************************/
+
+bool ReplServer::flushDue() {
+   size_t pending = _plotdb.getPendingCount();
+   if (pending == 0) {
+      _oldest_pending = 0;
+      return false;
+   }
+
+   int64_t now = monotonicMillis();
+   if (_oldest_pending == 0)
+      _oldest_pending = now;
+
+   int64_t max_wait = static_cast<int64_t>(max_repl_latency * 1000 / _time_mult);
+   return (pending >= flush_batch_plots) || (now - _oldest_pending >= max_wait);
+}
+
+/**********************************************************************************************
+ * getFlushTimeout - time left until the oldest pending plot hits the latency limit, capped at
+ *                   the reactor's usual timeout
+ **********************************************************************************************/
+
+int ReplServer::getFlushTimeout() {
+   if (_oldest_pending == 0)
+      return max_poll_timeout;
+
+   int64_t max_wait = static_cast<int64_t>(max_repl_latency * 1000 / _time_mult);
+   int64_t left = _oldest_pending + max_wait - monotonicMillis();
+   return static_cast<int>(std::max<int64_t>(0, std::min<int64_t>(left, max_poll_timeout)));
+}
+
 /**********************************************************************************************
  * addReplDronePlots - Adds drone plots to the database from data that was replicated in. 
  *                     Deconflicts issues between plot points.
@@ -197,21 +538,19 @@ void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
    }
 
    // Get the number of plot points
-   unsigned int *numptr = (unsigned int *) data.data();
-   unsigned int count = *numptr;
-
-   // Store sub-vectors for efficiency
-   std::vector<uint8_t> plot;
-   auto dptr = data.begin() + sizeof(unsigned int);
+   unsigned int count;
+   memcpy(&count, data.data(), sizeof(unsigned int));
 
-   for (unsigned int i=0; i<count; i++) {
-      plot.clear();
-      plot.assign(dptr, dptr + DronePlot::getDataSize());
-      addSingleDronePlot(plot);
-      dptr += DronePlot::getDataSize();      
+   if (count != (data.size() - 4) / DronePlot::getDataSize()) {
+      throw std::runtime_error("Plot count passed into addReplDronePlots does not match the data size");
    }
+
+   // Decode and add the whole batch under one lock
+   _plotdb.addPlotBatch(data.data() + sizeof(unsigned int), count);
+
    if (_verbosity >= 2)
-      std::cout << "Replicated in " << count << " plots\n";
+      std::cout << "Replicated in " << count << " plots (" << _plotdb.getDuplicateCount() <<
+                   " duplicates rejected so far)\n";
 }
 
 
@@ -222,12 +561,10 @@ void ReplServer::addReplDronePlots(std::vector<uint8_t> &data) {
  **********************************************************************************************/
 
 void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
-   DronePlot tmp_plot;
-
-   tmp_plot.deserialize(data);
+   if (data.size() < DronePlot::getDataSize())
+      throw std::runtime_error("Not enough data passed into addSingleDronePlot");
 
-   _plotdb.addPlot(tmp_plot.drone_id, tmp_plot.node_id, tmp_plot.timestamp, tmp_plot.latitude,
-                                                         tmp_plot.longitude);
+   _plotdb.addPlotBatch(data.data(), 1);
 
    //--- Running into issue with not always unlocking.
    // Perhaps due to multiple threads locking at same time? Dumbed down explanation
@@ -244,7 +581,8 @@ void ReplServer::addSingleDronePlot(std::vector<uint8_t> &data) {
 /**********************************************************************************************
  * shutdown - Does just that
  *
- *      Modified: Does one final check for duplicates before shutting down
+ *      Modified: Does one final check for duplicates before shutting down. The DB rejects
+ *      duplicates on insert, so this only catches ones stored before the index was enabled
  **********************************************************************************************/
 void ReplServer::shutdown() {
     this->handleDuplicates();
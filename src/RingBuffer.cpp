@@ -0,0 +1,213 @@
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "RingBuffer.h"
+
+/**********************************************************************************************
+ * RingBuffer (constructor) - allocates the buffer, rounding capacity up to a power of two
+ *
+ *    Params: capacity - starting capacity in bytes
+ *
+ **********************************************************************************************/
+
+RingBuffer::RingBuffer(size_t capacity) {
+   size_t cap = 1;
+   while (cap < capacity)
+      cap <<= 1;
+   _buf.resize(cap);
+}
+
+RingBuffer::~RingBuffer() {
+
+}
+
+/**********************************************************************************************
+ * reserve - grows the buffer so it can hold at least n bytes. The data is copied into the new
+ *           buffer starting at position 0.
+ *
+ *    Params: n - total number of bytes the buffer must be able to hold
+ *
+ **********************************************************************************************/
+
+void RingBuffer::reserve(size_t n) {
+   if (n <= _buf.size())
+      return;
+
+   size_t cap = _buf.size();
+   while (cap < n)
+      cap <<= 1;
+
+   std::vector<uint8_t> newbuf(cap);
+   peek(0, newbuf.data(), _size);
+
+   _buf.swap(newbuf);
+   _head = 0;
+}
+
+/**********************************************************************************************
+ * shrink - cuts the buffer back to the smallest power of two holding n bytes (and everything
+ *          buffered), so one large frame does not pin its space for the rest of the
+ *          connection. The data is copied into the new buffer starting at position 0.
+ *
+ *    Params: n - number of bytes the buffer should keep room for
+ *
+ **********************************************************************************************/
+
+void RingBuffer::shrink(size_t n) {
+   n = std::max(n, _size);
+
+   size_t cap = 1;
+   while (cap < n)
+      cap <<= 1;
+
+   if (cap >= _buf.size())
+      return;
+
+   std::vector<uint8_t> newbuf(cap);
+   peek(0, newbuf.data(), _size);
+
+   _buf.swap(newbuf);
+   _head = 0;
+}
+
+/**********************************************************************************************
+ * append - copies data onto the end of the buffer, wrapping around the end as needed
+ *
+ *    Params: data - bytes to add
+ *            len - number of bytes
+ *
+ **********************************************************************************************/
+
+void RingBuffer::append(const uint8_t *data, size_t len) {
+   if (len > space())
+      reserve(_size + len);
+
+   size_t mask = _buf.size() - 1;
+   size_t tail = (_head + _size) & mask;
+   size_t first = std::min(len, _buf.size() - tail);
+
+   memcpy(&_buf[tail], data, first);
+   memcpy(&_buf[0], data + first, len - first);
+   _size += len;
+}
+
+/**********************************************************************************************
+ * peek - copies buffered bytes out without consuming them
+ *
+ *    Params: offset - bytes past the read position to start at
+ *            dst - where to copy the data
+ *            len - number of bytes to copy
+ *
+ *    Returns: true if copied, false if fewer than offset+len bytes are buffered
+ *
+ **********************************************************************************************/
+
+bool RingBuffer::peek(size_t offset, void *dst, size_t len) const {
+   if (offset + len > _size)
+      return false;
+
+   size_t mask = _buf.size() - 1;
+   size_t start = (_head + offset) & mask;
+   size_t first = std::min(len, _buf.size() - start);
+
+   memcpy(dst, &_buf[start], first);
+   memcpy(static_cast<uint8_t *>(dst) + first, &_buf[0], len - first);
+   return true;
+}
+
+/**********************************************************************************************
+ * getSpans - locates buffered bytes in place. A region that wraps past the end of the buffer
+ *            comes back as two spans, otherwise one.
+ *
+ *    Params: offset - bytes past the read position to start at
+ *            len - number of bytes in the region
+ *            spans - filled with the base/length of each contiguous piece
+ *
+ *    Returns: number of spans filled, 0 if fewer than offset+len bytes are buffered
+ *
+ **********************************************************************************************/
+
+int RingBuffer::getSpans(size_t offset, size_t len, iovec spans[2]) {
+   if (offset + len > _size)
+      return 0;
+
+   size_t mask = _buf.size() - 1;
+   size_t start = (_head + offset) & mask;
+   size_t first = std::min(len, _buf.size() - start);
+
+   spans[0].iov_base = &_buf[start];
+   spans[0].iov_len = first;
+   if (first == len)
+      return 1;
+
+   spans[1].iov_base = &_buf[0];
+   spans[1].iov_len = len - first;
+   return 2;
+}
+
+/**********************************************************************************************
+ * getFreeSpans - locates the unused part of the buffer, starting right after the buffered data
+ *
+ *    Params: spans - filled with the base/length of each contiguous piece of free space
+ *
+ *    Returns: number of spans filled, 0 if there is no free space
+ *
+ **********************************************************************************************/
+
+int RingBuffer::getFreeSpans(iovec spans[2]) {
+   size_t free = space();
+   if (free == 0)
+      return 0;
+
+   size_t tail = (_head + _size) & (_buf.size() - 1);
+   size_t first = std::min(free, _buf.size() - tail);
+
+   spans[0].iov_base = &_buf[tail];
+   spans[0].iov_len = first;
+   if (first == free)
+      return 1;
+
+   spans[1].iov_base = &_buf[0];
+   spans[1].iov_len = free - first;
+   return 2;
+}
+
+/**********************************************************************************************
+ * commit - adds bytes already written into the free spans to the buffered data
+ *
+ *    Params: n - number of bytes written
+ *
+ *    Throws: std::out_of_range if n is more than the free space
+ **********************************************************************************************/
+
+void RingBuffer::commit(size_t n) {
+   if (n > space())
+      throw std::out_of_range("Attempted to commit more data than the ring buffer can hold.");
+
+   _size += n;
+}
+
+/**********************************************************************************************
+ * consume - drops bytes from the front of the buffer
+ *
+ *    Params: n - number of bytes to drop
+ *
+ *    Throws: std::out_of_range if more bytes are consumed than are buffered
+ **********************************************************************************************/
+
+void RingBuffer::consume(size_t n) {
+   if (n > _size)
+      throw std::out_of_range("Attempted to consume more data than was in the ring buffer.");
+
+   _head = (_head + n) & (_buf.size() - 1);
+   _size -= n;
+
+   // Keep reads contiguous for as long as possible
+   if (_size == 0)
+      _head = 0;
+}
+
+void RingBuffer::clear() {
+   _head = 0;
+   _size = 0;
+}
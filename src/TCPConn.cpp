@@ -5,15 +5,18 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <arpa/inet.h>
+#include <errno.h>
 #include "TCPConn.h"
 #include "strfuncts.h"
+#include "BatchCodec.h"
 #include <crypto++/secblock.h>
 #include <crypto++/osrng.h>
-#include <crypto++/filters.h>
 #include <crypto++/rijndael.h>
 #include <crypto++/gcm.h>
 #include <crypto++/aes.h>
-#include <random>
+#include <crypto++/hkdf.h>
+#include <crypto++/sha.h>
 
 using namespace CryptoPP;
 
@@ -22,117 +25,188 @@ const unsigned int iv_size = AES::BLOCKSIZE;
 const unsigned int key_size = AES::DEFAULT_KEYLENGTH;
 const unsigned int auth_size = 16;
 
+// Session mode - 96-bit GCM nonce (4 byte direction, 8 byte frame counter) and a full tag
+const unsigned int nonce_size = seal_nonce_size;
+const unsigned int tag_size = 16;
+const uint32_t dir_client = 0x43;   // Client -> server frames
+const uint32_t dir_server = 0x53;   // Server -> client frames
+const char session_info[] = "repsvr session v1";
+
+// Session resumption - size of the ticket ID and of the random bytes each end adds on resume
+const unsigned int ticket_id_size = 16;
+const unsigned int resume_rb_size = 32;
+
+// Receive buffer starting size, and the least free space to offer each socket read
+const size_t recv_buf_size = 16384;
+const size_t min_recv_space = 4096;
+
+// Send buffer size kept between frames that did not fit on the socket
+const size_t send_buf_size = 16384;
+
 /**********************************************************************************************
- * TCPConn (constructor) - creates the connector and initializes - creates the command strings
- *                         to wrap around network commands
+ * ivPool - random generator for IVs and auth strings. Seeded once per thread from the OS
+ *          rather than once per message.
+ **********************************************************************************************/
+
+static RandomNumberGenerator &ivPool() {
+   thread_local AutoSeededRandomPool pool;
+   return pool;
+}
+
+/**********************************************************************************************
+ * frameChecksum - Adler-32 over a payload that may be split across up to two buffer spans
  *
- *    Params: key - reference to the pre-loaded AES key
- *            verbosity - stdout verbosity - 3 = max
+ *    Params: spans - the pieces of the payload, in order
+ *            count - number of spans
  *
+ *    Returns: the checksum
  **********************************************************************************************/
 
-TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, unsigned int verbosity):
-                                    _data_ready(false),
-                                    _aes_key(key),
-                                    _verbosity(verbosity),
-                                    _server_log(server_log)
-{
-   // prep some tools to search for command sequences in data
-   uint8_t slash = (uint8_t) '/';
-   c_rep.push_back((uint8_t) '<');
-   c_rep.push_back((uint8_t) 'R');
-   c_rep.push_back((uint8_t) 'E');
-   c_rep.push_back((uint8_t) 'P');
-   c_rep.push_back((uint8_t) '>');
-
-   c_endrep = c_rep;
-   c_endrep.insert(c_endrep.begin()+1, 1, slash);
+static uint32_t frameChecksum(const iovec *spans, int count) {
+   const uint32_t mod_adler = 65521;
+   const size_t max_run = 5552;   // Most bytes that can be summed before b could overflow
+   uint32_t a = 1, b = 0;
+
+   for (int i=0; i<count; i++) {
+      const uint8_t *data = static_cast<const uint8_t *>(spans[i].iov_base);
+      size_t len = spans[i].iov_len;
+
+      while (len > 0) {
+         size_t run = std::min(len, max_run);
+         len -= run;
+         while (run--) {
+            a += *data++;
+            b += a;
+         }
+         a %= mod_adler;
+         b %= mod_adler;
+      }
+   }
+   return (b << 16) | a;
+}
 
-   c_ack.push_back((uint8_t) '<');
-   c_ack.push_back((uint8_t) 'A');
-   c_ack.push_back((uint8_t) 'C');
-   c_ack.push_back((uint8_t) 'K');
-   c_ack.push_back((uint8_t) '>');
+/**********************************************************************************************
+ * packFrameHeader/unpackFrameHeader - convert between the header fields and the wire format
+ *
+ *    Returns: (unpack) false if the magic number does not match or the length is over max_len
+ **********************************************************************************************/
 
-   c_auth.push_back((uint8_t) '<');
-   c_auth.push_back((uint8_t) 'A');
-   c_auth.push_back((uint8_t) 'U');
-   c_auth.push_back((uint8_t) 'T');
-   c_auth.push_back((uint8_t) '>');
+static void packFrameHeader(uint8_t *hdr, uint8_t type, uint8_t flags, uint32_t length,
+                                                                        uint32_t checksum) {
+   uint16_t magic = htons(frame_magic);
+   length = htonl(length);
+   checksum = htonl(checksum);
+
+   memcpy(&hdr[0], &magic, sizeof(magic));
+   hdr[2] = type;
+   hdr[3] = flags;
+   memcpy(&hdr[4], &length, sizeof(length));
+   memcpy(&hdr[8], &checksum, sizeof(checksum));
+}
 
-   c_endauth = c_auth;
-   c_endauth.insert(c_endauth.begin()+1, 1, slash);
+/**********************************************************************************************
+ * packU64/unpackU64 - 64 bit value to/from network byte order
+ **********************************************************************************************/
 
-   c_sid.push_back((uint8_t) '<');
-   c_sid.push_back((uint8_t) 'S');
-   c_sid.push_back((uint8_t) 'I');
-   c_sid.push_back((uint8_t) 'D');
-   c_sid.push_back((uint8_t) '>');
+static void packU64(uint8_t *buf, uint64_t val) {
+   uint32_t hi = htonl(val >> 32), lo = htonl(val & 0xFFFFFFFF);
 
-   c_endsid = c_sid;
-   c_endsid.insert(c_endsid.begin()+1, 1, slash);
+   memcpy(&buf[0], &hi, sizeof(hi));
+   memcpy(&buf[4], &lo, sizeof(lo));
 }
 
+static uint64_t unpackU64(const uint8_t *buf) {
+   uint32_t hi, lo;
 
-TCPConn::~TCPConn() {
-
+   memcpy(&hi, &buf[0], sizeof(hi));
+   memcpy(&lo, &buf[4], sizeof(lo));
+   return ((uint64_t) ntohl(hi) << 32) | ntohl(lo);
 }
 
 /**********************************************************************************************
- * accept - simply calls the acceptFD FileDesc method to accept a connection on a server socket.
- *
- *    Params: server - an open/bound server file descriptor with an available connection
- *
- *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ * makeNonce - builds the GCM nonce for a frame from the sending direction and frame counter.
+ *             Each direction keeps its own counter, so a nonce never repeats under a key.
  **********************************************************************************************/
 
-bool TCPConn::accept(SocketFD &server) {
-   // Accept the connection
-   bool results = _connfd.acceptFD(server);
+static void makeNonce(uint8_t *nonce, uint32_t dir, uint64_t seq) {
+   dir = htonl(dir);
 
+   memcpy(&nonce[0], &dir, sizeof(dir));
+   packU64(&nonce[4], seq);
+}
 
-   // Set the state as waiting for the authorization packet
-   _status = s_connected;
-   _connected = true;
-   return results;
+static bool unpackFrameHeader(const uint8_t *hdr, uint8_t &type, uint8_t &flags, uint32_t &length,
+                                                      uint32_t &checksum, uint32_t max_len) {
+   uint16_t magic;
+   memcpy(&magic, &hdr[0], sizeof(magic));
+   type = hdr[2];
+   flags = hdr[3];
+   memcpy(&length, &hdr[4], sizeof(length));
+   memcpy(&checksum, &hdr[8], sizeof(checksum));
+
+   length = ntohl(length);
+   checksum = ntohl(checksum);
+   return (ntohs(magic) == frame_magic) && (length <= max_len);
 }
 
 /**********************************************************************************************
- * sendData - sends the data in the parameter to the socket
+ * TCPConn (constructor) - creates the connector and initializes
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
+ *    Params: key - reference to the pre-loaded AES key
+ *            tickets - the server's session ticket cache
+ *            verbosity - stdout verbosity - 3 = max
  *
- *    Throws: runtime_error for unrecoverable errors
  **********************************************************************************************/
 
-bool TCPConn::sendData(std::vector<uint8_t> &buf) {
-   
-   _connfd.writeBytes<uint8_t>(buf);
-   
-   return true;
+TCPConn::TCPConn(LogMgr &server_log, CryptoPP::SecByteBlock &key, TicketCache &tickets,
+                                                            unsigned int verbosity):
+                                    _data_ready(false),
+                                    _recvbuf(recv_buf_size),
+                                    _sendbuf(send_buf_size),
+                                    _aes_key(key),
+                                    _tickets(tickets),
+                                    _verbosity(verbosity),
+                                    _server_log(server_log)
+{
+   // Key the ciphers once, encryptData/decryptData only set the IV for each message
+   std::vector<uint8_t> zero_iv(iv_size, 0);
+   _encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), zero_iv.data());
+   _decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), zero_iv.data());
+
+   // Connections are only created on the reactor thread
+   static uint64_t conn_count = 0;
+   _conn_id = ++conn_count;
+}
+
+
+TCPConn::~TCPConn() {
+
 }
 
 /**********************************************************************************************
- * sendEncryptedData - sends the data in the parameter to the socket after block encrypting it
+ * accept - simply calls the acceptFD FileDesc method to accept a connection on a server socket.
  *
- *    Params:  msg - the string to be sent
- *             size - if we know how much data we should expect to send, this should be populated
+ *    Params: server - an open/bound server file descriptor with an available connection
  *
- *    Throws: runtime_error for unrecoverable errors
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
-bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf) {
+bool TCPConn::accept(SocketFD &server) {
+   // Accept the connection
+   bool results = _connfd.acceptFD(server);
 
-   // Encrypt
-   encryptData(buf);
 
-   // And send!
-   return sendData(buf);
+   // Set the state as waiting for the authorization packet
+   _status = s_connected;
+   _connected = true;
+   return results;
 }
 
 /**********************************************************************************************
- * encryptData - block encrypts data and places the results in the buffer in <ID><Data> format
+ * encryptData - block encrypts data and places the results in the buffer in <ID><Data> format.
+ *               Uses the connection's keyed cipher (only the IV changes per message) and
+ *               encrypts into the scratch buffer, which is then swapped with buf, so the only
+ *               allocation is growing the scratch buffer the first time a size is seen.
  *
  *    Params:  buf - where to place the <IV><Data> stream
  *
@@ -140,25 +214,16 @@ bool TCPConn::sendEncryptedData(std::vector<uint8_t> &buf) {
  **********************************************************************************************/
 
 void TCPConn::encryptData(std::vector<uint8_t> &buf) {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
-   AutoSeededRandomPool rnd;
-
-   // Generate our random init vector
-   rnd.GenerateBlock(init_vector, init_vector.size());
+   _scratch.resize(iv_size + buf.size());
 
-   // Encrypt the data
-   CFB_Mode<AES>::Encryption encryptor;
-   encryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+   // Generate our random init vector right at the front of the output
+   ivPool().GenerateBlock(_scratch.data(), iv_size);
 
-   std::string cipher;
-   ArraySource as(buf.data(), buf.size(), true,
-            new StreamTransformationFilter(encryptor, new StringSink(cipher)));
+   // Encrypt the data behind it
+   _encryptor.Resynchronize(_scratch.data(), iv_size);
+   _encryptor.ProcessData(_scratch.data() + iv_size, buf.data(), buf.size());
 
-   // Now add the IV to the stream we will be sending out
-   std::vector<uint8_t> enc_data(init_vector.begin(), init_vector.end());
-   enc_data.insert(enc_data.end(), cipher.begin(), cipher.end());
-   buf = enc_data;
+   buf.swap(_scratch);
 }
 
 /**********************************************************************************************
@@ -170,14 +235,23 @@ void TCPConn::encryptData(std::vector<uint8_t> &buf) {
 
 void TCPConn::handleConnection() {
 
+   // Input (if any) is handled below, so wait for the reactor to flag the socket again
+   _readable = false;
+   _writable = false;
+
    try {
+      // Finish whatever an earlier frame left unsent first, the state machine can carry on
+      // meanwhile since new frames queue up behind it
+      flushSendBuf();
+
       switch (_status) {
 
          /** Client **/
          // Client: Just connected, send our SID
          // Default
          case s_connecting:
-            sendSID();
+            if (finishConnect())
+               sendSID();
             break;
 
           // Client: Wait for Rand Bytes string
@@ -185,6 +259,11 @@ void TCPConn::handleConnection() {
               c_waitForRB();
               break;
 
+          // Client: Sent a session ticket, wait for the server to resume (or refuse) it
+          case c_waitForResumed:
+              c_waitResumed();
+              break;
+
           // Client: Wait for SID
           case c_waitForSID:
               c_waitSID();
@@ -195,18 +274,17 @@ void TCPConn::handleConnection() {
               c_waitForEB();
               break;
 
-          // Client: connecting user - replicate data
-          // Default
-          case s_datatx:
-              transmitData();
-              break;
-
-          // Client: Wait for acknowledgement that data sent was received before disconnecting
+          // Client: Wait for acknowledgement that data sent was received before sending more
           // Default
           case s_waitack:
               awaitAck();
               break;
 
+          // Client: Authenticated session with nothing in flight, send the next batch if queued
+          case s_idle:
+              waitIdle();
+              break;
+
           /** Server **/
           // Server: Wait for the SID from a newly-connected client, then send our authentication random bytes
           // Default -- To Do: Modify
@@ -247,16 +325,46 @@ void TCPConn::handleConnection() {
 }
 
 /**********************************************************************************************
- * sendSID()  - Client: after a connection, client sends its Server ID to the server
+ * hasPendingWork - returns true if handleConnection has work to do even with no input waiting
+ *
+ **********************************************************************************************/
+
+bool TCPConn::hasPendingWork() {
+   if (!_connected)
+      return false;
+
+   return ((_status == s_connecting) && !_connect_pending) ||
+          ((_status == s_idle) && (_outqueue.size() > 0)) ||
+          ((_status != s_hasdata) && hasFrame()) || (_writable && hasPendingOutput());
+}
+
+/**********************************************************************************************
+ * sendSID()  - Client: after a connection, client sends its Server ID to the server. If we
+ *              hold an unexpired ticket from the last session, sends it (with our SID and
+ *              fresh random bytes) to resume instead. Tickets are single use.
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
 void TCPConn::sendSID() {
+   if (!_ticket_id.empty() && (time(NULL) < _ticket_expires)) {
+      _gennedAuthStr.resize(resume_rb_size);
+      ivPool().GenerateBlock(_gennedAuthStr.data(), _gennedAuthStr.size());
+
+      // <ticket ID><random bytes><SID>
+      std::vector<uint8_t> buf(_ticket_id);
+      buf.insert(buf.end(), _gennedAuthStr.begin(), _gennedAuthStr.end());
+      buf.insert(buf.end(), _svr_id.begin(), _svr_id.end());
+      sendFrame(f_resume, buf);
+
+      _ticket_id.clear();
+      _status = c_waitForResumed;
+      return;
+   }
+
 //    std::cout << "\n\n----(1) Client: Sending SID----\n\n";
    std::vector<uint8_t> buf(_svr_id.begin(), _svr_id.end());
-   wrapCmd(buf, c_sid, c_endsid);
-   sendData(buf);
+   sendFrame(f_sid, buf);
 
    _status = c_waitForRBString;
 }
@@ -271,21 +379,18 @@ void TCPConn::sendSID() {
 
 void TCPConn::waitForSID() {
 
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-//       std::cout << "\n\n----(1) Server: Received SID from client; Sending random bytes----\n\n";
-      std::vector<uint8_t> buf;
-
-      if (!getData(buf))
-         return;
+   // A client with a session ticket sends that instead of its SID
+   if (!fillRecvBuf())
+      return;
+   if (nextFrameIs(f_resume)) {
+      s_resume();
+      return;
+   }
 
-      if (!getCmdData(buf, c_sid, c_endsid)) {
-         std::stringstream msg;
-         msg << "SID string from connecting client invalid format. Cannot authenticate.";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return;
-      }
+   // If a frame has arrived, should be the SID of the connecting client
+   std::vector<uint8_t> buf;
+   if (getFrame(f_sid, buf)) {
+//       std::cout << "\n\n----(1) Server: Received SID from client; Sending random bytes----\n\n";
 
       std::string node(buf.begin(), buf.end());
       setNodeID(node.c_str());
@@ -300,8 +405,7 @@ void TCPConn::waitForSID() {
 
         // Send our Random Byte number
         buf.assign(this->_gennedAuthStr.begin(), this->_gennedAuthStr.end());
-        this->wrapCmd(buf, this->c_auth, this->c_endauth);
-        sendData(buf);
+        sendFrame(f_auth, buf);
 
        this->_status = s_waitForEBString;
 //      _status = s_datarx;
@@ -310,266 +414,624 @@ void TCPConn::waitForSID() {
 
 
 /**********************************************************************************************
- * transmitData()  - receives the SID from the server and transmits data
+ * waitForData - receiving server, authentication complete, wait for replication datai
+               Also sends a plaintext random auth string of our own
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn:: transmitData() {
-   // If data on the socket, should be our Auth string from our host server
-   if (_connfd.hasData()) {
-//       std::cout << "\n\n----(5) Client: Sending data----\n\n";
-      std::vector<uint8_t> buf;
+void TCPConn::waitForData() {
 
-      if (!getData(buf))
-         return;
+   // If a frame has arrived, should be sealed replication data. It is passed up still sealed
+   // with the key and nonce to open it, so opening (and decompressing) is done off the network
+   // thread (see openReplFrame)
+   std::vector<uint8_t> buf;
+   if (takeSealedFrame(f_rep, buf, _input_seal.nonce, _input_seal.flags)) {
+//       std::cout << "\n\n----(4) Server: Getting replication data. COMPLETE WOO----\n\n";
+
+      _input_seal.key = _session_key;
+      _inputbuf = std::move(buf);
+      _data_ready = true;
+
+      // No ack yet - it goes out through sendAck once the batch is in the database
+
+      if (_verbosity >= 2)
+         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+
+      _status = s_hasdata;
+   }
+}
+
+
+/**********************************************************************************************
+ * awaitAwk - waits for the awk that the frame in flight was received, drops the batches it
+ *            covered and moves on to whatever queued up meanwhile or goes idle. Anything other
+ *            than an ack for the frame in flight drops the session, and the frame is resent
+ *            once it is re-established.
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::awaitAck() {
+
+   // Should have the awk message, getSealedFrame drops the connection if something else arrives
+   std::vector<uint8_t> buf;
+   if (getSealedFrame(f_ack, buf)) {
 
-      if (!getCmdData(buf, c_sid, c_endsid)) {
+      if ((buf.size() != sizeof(uint64_t)) || (unpackU64(buf.data()) != _inflight_last)) {
          std::stringstream msg;
-         msg << "SID string from connected server invalid format. Cannot authenticate.";
+         msg << "Ack from " << getNodeID() << " does not match the batch in flight. Disconnecting.";
          _server_log.writeLog(msg.str().c_str());
          disconnect();
          return;
       }
 
-      std::string node(buf.begin(), buf.end());
-      setNodeID(node.c_str());
-
-      // Send the replication data
-      sendData(_outputbuf);
-
       if (_verbosity >= 3)
-         std::cout << "Successfully authenticated connection with " << getNodeID() <<
-                      " and sending replication data.\n";
-
-      // Wait for their response
-      _status = s_waitack;
+         std::cout << "Data ack received from " << getNodeID() << " through sequence " <<
+                      _inflight_last << ".\n";
+
+      _acked_seq = _inflight_last;
+      for (size_t i=0; i<_inflight_batches; i++)
+         _outqueue_bytes -= _outqueue[i].second.size();
+      _outqueue.erase(_outqueue.begin(), _outqueue.begin() + _inflight_batches);
+      _inflight.clear();
+      _inflight_batches = 0;
+
+      if (_outqueue.size() > 0)
+         sendNextBatch();
+      else
+         _status = s_idle;
    }
 }
 
-
 /**********************************************************************************************
- * waitForData - receiving server, authentication complete, wait for replication datai
-               Also sends a plaintext random auth string of our own
+ * waitIdle - authenticated client session with nothing in flight. Sends the next batch once
+ *            one is queued. The server never sends unprompted, so data here means the other end
+ *            closed the session (fillRecvBuf notices and disconnects).
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::waitForData() {
+void TCPConn::waitIdle() {
+   if (_outqueue.size() > 0) {
+      sendNextBatch();
+      return;
+   }
 
-   // If data on the socket, should be replication data
-   if (_connfd.hasData()) {
-//       std::cout << "\n\n----(4) Server: Getting replication data. COMPLETE WOO----\n\n";
-      std::vector<uint8_t> buf;
+   if (!fillRecvBuf())
+      return;
 
-      if (!getData(buf))
-         return;
+   if (!_recvbuf.empty()) {
+      std::stringstream msg;
+      msg << "Unexpected data from " << getNodeID() << " on idle session, ignoring.";
+      _server_log.writeLog(msg.str().c_str());
+      _recvbuf.clear();
+   }
+}
 
-      if (!getCmdData(buf, c_rep, c_endrep)) {
-         std::stringstream msg;
-         msg << "Replication data possibly corrupted from" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
+/**********************************************************************************************
+ * sendNextBatch - transmits the frame in flight, first coalescing the queued batches into one
+ *                 if nothing is in flight. The frame is kept (in the clear) until acked, so a
+ *                 lost session resends the same sequence range under the new session key and
+ *                 the other end can recognize it; the sealed copy is built in the scratch
+ *                 buffer. The batch is compressed if the server accepts it and it actually
+ *                 comes out smaller.
+ *
+ *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+void TCPConn::sendNextBatch() {
+   if (_inflight_batches == 0) {
+      if (_outqueue.size() == 0) {
+         _status = s_idle;
          return;
       }
+      buildInflight();
+   }
 
-      // Got the data, save it
-      _inputbuf = buf;
-      _data_ready = true;
+   _scratch.resize(repl_hdr_size);
+   packU64(&_scratch[0], _repl_epoch);
+   packU64(&_scratch[8], _inflight_first);
+   packU64(&_scratch[16], _inflight_last);
+
+   uint8_t flags = 0;
+   if (_peer_compress) {
+      compressBatch(_inflight, _scratch);
+      if (_scratch.size() < repl_hdr_size + _inflight.size())
+         flags = frame_compressed;
+      else
+         _scratch.resize(repl_hdr_size);
+   }
+   if (!(flags & frame_compressed))
+      _scratch.insert(_scratch.end(), _inflight.begin(), _inflight.end());
 
-      // Send the acknowledgement and disconnect
-      sendData(c_ack);
+   sendSealedFrame(f_rep, _scratch, flags);
+   _status = s_waitack;
+}
 
-      if (_verbosity >= 2)
-         std::cout << "Successfully received replication data from " << getNodeID() << "\n";
+/**********************************************************************************************
+ * buildInflight - merges queued batches, oldest first, into a single <count><records> batch
+ *                 until max_coalesce_bytes is reached, so a backlog built up while the other
+ *                 end was unreachable goes out in one frame and one ack.
+ *
+ **********************************************************************************************/
 
+void TCPConn::buildInflight() {
+   unsigned int total = 0;
 
-      disconnect();
-      _status = s_hasdata;
+   _inflight.resize(sizeof(total));
+   _inflight_batches = 0;
+   _inflight_first = _outqueue.front().first;
+
+   for (auto &qe : _outqueue) {
+      const std::vector<uint8_t> &batch = qe.second;
+      unsigned int count;
+
+      if (batch.size() < sizeof(count))
+         throw std::runtime_error("Queued replication batch is missing its count.");
+      if ((_inflight_batches > 0) && (_inflight.size() + batch.size() > max_coalesce_bytes))
+         break;
+
+      memcpy(&count, batch.data(), sizeof(count));
+      total += count;
+      _inflight.insert(_inflight.end(), batch.begin() + sizeof(count), batch.end());
+
+      _inflight_last = qe.first;
+      _inflight_batches++;
    }
+
+   memcpy(_inflight.data(), &total, sizeof(total));
+}
+
+/**********************************************************************************************
+ * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
+ *               buf with the decrypted info (destroys IV string>. The IV is read in place
+ *               rather than erased off the front of the vector.
+ *
+ *    Params: buf - the encrypted string and holds the decrypted data (minus IV)
+ *
+ **********************************************************************************************/
+void TCPConn::decryptData(std::vector<uint8_t> &buf) {
+   if (buf.size() < iv_size)
+      throw socket_error("Encrypted data received was too short to hold an IV.");
+
+   // Decrypt everything after the IV into the scratch buffer, then trade buffers
+   _scratch.resize(buf.size() - iv_size);
+
+   _decryptor.Resynchronize(buf.data(), iv_size);
+   _decryptor.ProcessData(_scratch.data(), buf.data() + iv_size, _scratch.size());
+
+   buf.swap(_scratch);
 }
 
 
 /**********************************************************************************************
- * awaitAwk - waits for the awk that data was received and disconnects
+ * sendFrame - sends the frame header and payload in a single gather write, straight from the
+ *             caller's buffer. This runs on the reactor thread, so it never waits for a full
+ *             socket: the part that does not fit goes in the send buffer and the reactor
+ *             finishes it once the socket is writable. A frame sent while the buffer holds
+ *             data goes in behind it so frames stay in order.
+ *
+ *    Params: type - the frame type for the receiving end to check
+ *            buf - the payload
+ *            flags - passed through to the other end in the header
  *
  *    Throws: socket_error for network issues, runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-void TCPConn::awaitAck() {
+void TCPConn::sendFrame(frametype type, std::vector<uint8_t> &buf, uint8_t flags) {
+   if (buf.size() > max_frame_len)
+      throw std::runtime_error("Attempted to send a frame larger than max_frame_len.");
 
-   // Should have the awk message
-   if (_connfd.hasData()) {
-//       std::cout << "\n\n----(6) Client: Awaiting Ack. COMPLETE WOO----\n\n";
-      std::vector<uint8_t> buf;
+   uint8_t hdr[frame_hdr_size];
+   iovec spans[2] = { { hdr, frame_hdr_size }, { buf.data(), buf.size() } };
 
-      if (!getData(buf))
-         return;
+   packFrameHeader(hdr, type, flags, buf.size(), frameChecksum(&spans[1], 1));
 
-      if (findCmd(buf, c_ack) == buf.end())
-      {
-         std::stringstream msg;
-         msg << "Awk expected from data send, received something else. Node:" << getNodeID() << "\n";
-         _server_log.writeLog(msg.str().c_str());
-      }
-  
-      if (_verbosity >= 3)
-         std::cout << "Data ack received from " << getNodeID() << ". Disconnecting.\n";
+   size_t sent = 0;
+   if (_sendbuf.empty()) {
+      ssize_t results = _connfd.writeSpans(spans, 2);
+      if (results < 0)
+         throw socket_error("Failed writing frame to the socket.");
+      sent = results;
+   }
 
- 
-      disconnect();
+   // Keep whatever did not go out
+   for (int i=0; i<2; i++) {
+      size_t skip = std::min(sent, spans[i].iov_len);
+      sent -= skip;
+      _sendbuf.append(static_cast<uint8_t *>(spans[i].iov_base) + skip, spans[i].iov_len - skip);
    }
 }
 
 /**********************************************************************************************
- * getData - Reads in data from the socket and checks to see if there's an end command to the
- *           message to confirm we got it all
+ * flushSendBuf - writes the send buffer out to the socket, as much as it will take without
+ *                waiting. Once emptied, the buffer is cut back to its normal size so a large
+ *                frame does not keep its space.
  *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ *    Returns: true if everything has been sent
  *
- *    Returns: true if the data is ready to be read, false if they lost connection
+ *    Throws: socket_error for network issues
+ **********************************************************************************************/
+
+bool TCPConn::flushSendBuf() {
+   if (_sendbuf.empty())
+      return true;
+
+   iovec spans[2];
+   int count = _sendbuf.getSpans(0, _sendbuf.size(), spans);
+
+   ssize_t results = _connfd.writeSpans(spans, count);
+   if (results < 0)
+      throw socket_error("Failed writing frame to the socket.");
+   _sendbuf.consume(results);
+
+   if (!_sendbuf.empty())
+      return false;
+
+   _sendbuf.shrink(send_buf_size);
+   return true;
+}
+
+/**********************************************************************************************
+ * fillRecvBuf - reads whatever is waiting on the socket straight into the free space of the
+ *               receive buffer. Partial frames stay buffered across calls until the rest
+ *               arrives. Once a frame header is in, the buffer is grown to fit the whole frame
+ *               so large batches are read in a few big reads instead of many small ones. Only
+ *               a header within frameLimit grows it, so before the session is keyed a peer
+ *               can make us hold at most a handshake sized frame.
+ *
+ *    Returns: false if the connection was lost, true otherwise
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::getData(std::vector<uint8_t> &buf) {
+bool TCPConn::fillRecvBuf() {
+   uint8_t hdr[frame_hdr_size];
+   uint8_t type, flags;
+   uint32_t length, checksum;
 
-   std::vector<uint8_t> readbuf;
-   size_t count = 0;
+   while (!hasFrame()) {
 
-   buf.clear();
+      // Make room for the frame in progress, or at least a reasonable read
+      if (_recvbuf.peek(0, hdr, frame_hdr_size) &&
+                           unpackFrameHeader(hdr, type, flags, length, checksum, frameLimit()))
+         _recvbuf.reserve(frame_hdr_size + length);
+      if (_recvbuf.space() < min_recv_space)
+         _recvbuf.reserve(_recvbuf.size() + min_recv_space);
 
-   while (_connfd.hasData()) {
-      // read the data on the socket up to 1024
-      count += _connfd.readBytes<uint8_t>(readbuf, 1024);
+      iovec spans[2];
+      int count = _recvbuf.getFreeSpans(spans);
+      size_t free = _recvbuf.space();
 
-      // check if we lost connection
-      if (readbuf.size() == 0) {
-         std::stringstream msg;
-         std::string ip_addr;
-         msg << "Connection from server " << _node_id << " lost (IP: " << 
-                                                         getIPAddrStr(ip_addr) << ")"; 
-         _server_log.writeLog(msg.str().c_str());
-         disconnect();
-         return false;
+      ssize_t results = _connfd.recvSpans(spans, count);
+      if (results > 0) {
+         _recvbuf.commit(results);
+
+         // A short read means the socket is drained for now
+         if ((size_t) results < free)
+            break;
+         continue;
       }
 
-      buf.insert(buf.end(), readbuf.begin(), readbuf.end());
+      if ((results < 0) && (errno == EINTR))
+         continue;
+      if ((results < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+         break;
 
-      // concat the data onto anything we've read before
-//      _inputbuf.insert(_inputbuf.end(), readbuf.begin(), readbuf.end());
+      // Closed by the other end (0) or a socket error
+      connLost();
+      return false;
    }
    return true;
 }
 
 /**********************************************************************************************
- * decryptData - Takes in an encrypted buffer in the form IV/Data and decrypts it, replacing
- *               buf with the decrypted info (destroys IV string>
- *
- *    Params: buf - the encrypted string and holds the decrypted data (minus IV)
+ * connLost - logs that the other end closed the connection (or it failed) and disconnects
  *
  **********************************************************************************************/
-void TCPConn::decryptData(std::vector<uint8_t> &buf) {
-   // For the initialization vector
-   SecByteBlock init_vector(iv_size);
 
-   // Copy the IV from the incoming stream of data
-   init_vector.Assign(buf.data(), iv_size);
-   buf.erase(buf.begin(), buf.begin() + iv_size);
+void TCPConn::connLost() {
+   std::stringstream msg;
+   std::string ip_addr;
+   msg << "Connection from server " << _node_id << " lost (IP: " << 
+                                                   getIPAddrStr(ip_addr) << ")"; 
+   _server_log.writeLog(msg.str().c_str());
+   disconnect();
+}
 
-   // Decrypt the data
-   CFB_Mode<AES>::Decryption decryptor;
-   decryptor.SetKeyWithIV(_aes_key, _aes_key.size(), init_vector);
+/**********************************************************************************************
+ * hasFrame - checks the receive buffer for a complete frame. A bad header counts as complete
+ *            so getFrame gets the chance to reject it.
+ *
+ **********************************************************************************************/
+
+bool TCPConn::hasFrame() {
+   uint8_t hdr[frame_hdr_size];
+   uint8_t type, flags;
+   uint32_t length, checksum;
 
-   std::string recovered;
-   ArraySource as(buf.data(), buf.size(), true,
-            new StreamTransformationFilter(decryptor, new StringSink(recovered)));
+   if (!_recvbuf.peek(0, hdr, frame_hdr_size))
+      return false;
 
-   buf.assign(recovered.begin(), recovered.end());
+   if (!unpackFrameHeader(hdr, type, flags, length, checksum, frameLimit()))
+      return true;
 
+   return _recvbuf.size() >= frame_hdr_size + length;
 }
 
+/**********************************************************************************************
+ * nextFrameIs - checks the type of the complete frame at the front of the receive buffer, for
+ *               states that accept more than one kind of frame
+ *
+ **********************************************************************************************/
+
+bool TCPConn::nextFrameIs(frametype type) {
+   uint8_t hdr[frame_hdr_size];
+   uint8_t ftype, flags;
+   uint32_t length, checksum;
+
+   if (!hasFrame() || !_recvbuf.peek(0, hdr, frame_hdr_size))
+      return false;
+
+   return unpackFrameHeader(hdr, ftype, flags, length, checksum, frameLimit()) && (ftype == type);
+}
 
 /**********************************************************************************************
- * getEncryptedData - Reads in data from the socket and decrypts it, passing the decrypted
- *                    data back in buf
+ * getFrame - takes the next frame off the receive buffer, reading the socket first if one is
+ *            not already waiting. Only the header is examined until the whole payload has
+ *            arrived, so a frame split across TCP segments is picked up on a later call once
+ *            the reactor reports more data.
  *
- *    Params: None - data is stored in _inputbuf for retrieval with GetInputData
+ *    Params: type - the frame type expected in the current connection state
+ *            buf - receives the frame payload
+ *            flags - if not NULL, receives the header flags
  *
- *    Returns: true if the data is ready to be read, false otherwise
+ *    Returns: true if a frame was retrieved, false if none is complete yet or the connection
+ *             was dropped (wrong type, bad header or checksum, or lost connection)
  *
  *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::getEncryptedData(std::vector<uint8_t> &buf) {
-   // Get the data from the socket
-   if (!getData(buf))
+bool TCPConn::getFrame(frametype type, std::vector<uint8_t> &buf, uint8_t *flags_out) {
+
+   if (!fillRecvBuf())
+      return false;
+
+   uint8_t hdr[frame_hdr_size];
+   uint8_t ftype, flags;
+   uint32_t length, checksum;
+
+   if (!_recvbuf.peek(0, hdr, frame_hdr_size))
+      return false;
+
+   std::stringstream msg;
+   if (!unpackFrameHeader(hdr, ftype, flags, length, checksum, frameLimit())) {
+      msg << "Invalid frame header from " << getNodeID() << ". Disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return false;
+   }
+
+   // Wait for the rest of the payload
+   iovec spans[2];
+   int count = _recvbuf.getSpans(frame_hdr_size, length, spans);
+   if (count == 0)
+      return false;
+
+   if (frameChecksum(spans, count) != checksum) {
+      msg << "Frame from " << getNodeID() << " failed checksum, data possibly corrupted. " <<
+                                                                        "Disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return false;
+   }
+
+   if (ftype != type) {
+      msg << "Unexpected frame type " << (unsigned int) ftype << " from " << getNodeID() <<
+                                          " (expected " << (unsigned int) type << "). Disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
       return false;
+   }
 
-   decryptData(buf);
+   buf.resize(length);
+   _recvbuf.peek(frame_hdr_size, buf.data(), length);
+   _recvbuf.consume(frame_hdr_size + length);
 
-   return true; 
+   // Give back the space a large frame needed once what is left fits the normal size
+   if (_recvbuf.size() <= recv_buf_size)
+      _recvbuf.shrink(recv_buf_size);
+
+   if (flags_out != NULL)
+      *flags_out = flags;
+   return true;
 }
 
 /**********************************************************************************************
- * findCmd - returns an iterator to the location of a string where a command starts
- * hasCmd - returns true if command was found, false otherwise
+ * startSession - derives the session key once both ends are authenticated. HKDF-SHA256 over
+ *                the secret, salted with both ends' random bytes, so every session (and every
+ *                reconnect) gets a fresh key. Both GCM contexts are keyed here once and the
+ *                frame counters reset.
+ *
+ *                The same derivation gives a resumption secret and ticket ID for the next
+ *                reconnect. The client keeps them, the server puts them in the ticket cache.
  *
- *    Params: buf = the data buffer to look for the command within
- *            cmd - the command string to search for in the data
+ *    Params: client - true on the connecting end
+ *            secret - the shared key after a full handshake, the ticket's secret on resume
+ *            server_rb/client_rb - the random bytes sent by the server and the client
+ *
+ **********************************************************************************************/
+
+void TCPConn::startSession(bool client, const SecByteBlock &secret,
+                  const std::vector<uint8_t> &server_rb, const std::vector<uint8_t> &client_rb) {
+   std::vector<uint8_t> salt(server_rb);
+   salt.insert(salt.end(), client_rb.begin(), client_rb.end());
+
+   // <session key><resumption secret><ticket ID>
+   SecByteBlock keys(key_size * 2 + ticket_id_size);
+   HKDF<SHA256> hkdf;
+   hkdf.DeriveKey(keys, keys.size(), secret, secret.size(), salt.data(), salt.size(),
+                  (const byte *) session_info, sizeof(session_info) - 1);
+
+   _sealer.SetKey(keys, key_size);
+   _opener.SetKey(keys, key_size);
+   _session_key.Assign(keys, key_size);
+
+   SecByteBlock resume_secret(keys + key_size, key_size);
+   std::vector<uint8_t> ticket_id(keys + key_size * 2, keys + keys.size());
+   if (client) {
+      _ticket_id = ticket_id;
+      _resume_secret = resume_secret;
+      _ticket_expires = time(NULL) + ticket_ttl;
+   } else {
+      _tickets.store(ticket_id, resume_secret, _node_id);
+   }
+
+   _session = true;
+   _session_id++;
+   _session_client = client;
+   _send_seq = 0;
+   _recv_seq = 0;
+}
+
+/**********************************************************************************************
+ * sendSealedFrame - encrypts buf in place with the session key, appends the GCM tag and sends
+ *                   it as a sealed frame. The frame type and flags are authenticated with it.
+ *                   buf holds the sealed payload afterwards.
  *
- *    Returns: iterator - points to cmd position if found, end() if not found
+ *    Params: type - the frame type
+ *            buf - the payload, encrypted in place
+ *            flags - any other header flags to send (authenticated too)
  *
+ *    Throws: socket_error for network issues, runtime_error if no session is established
  **********************************************************************************************/
 
-std::vector<uint8_t>::iterator TCPConn::findCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
-   return std::search(buf.begin(), buf.end(), cmd.begin(), cmd.end());
+void TCPConn::sendSealedFrame(frametype type, std::vector<uint8_t> &buf, uint8_t flags) {
+   if (!_session)
+      throw std::runtime_error("Attempted to send a sealed frame before the session was keyed.");
+
+   uint8_t nonce[nonce_size];
+   makeNonce(nonce, _session_client ? dir_client : dir_server, _send_seq++);
+   flags |= frame_sealed;
+   uint8_t aad[2] = { (uint8_t) type, flags };
+
+   size_t len = buf.size();
+   buf.resize(len + tag_size);
+   _sealer.EncryptAndAuthenticate(buf.data(), buf.data() + len, tag_size, nonce, nonce_size,
+                                  aad, sizeof(aad), buf.data(), len);
+
+   sendFrame(type, buf, flags);
 }
 
-bool TCPConn::hasCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &cmd) {
-   return !(findCmd(buf, cmd) == buf.end());
+/**********************************************************************************************
+ * getSealedFrame - gets the next frame like getFrame, then verifies and decrypts it in place
+ *                  with the session key. A frame that is not sealed, or fails verification
+ *                  (tampered, replayed or out of order), drops the connection.
+ *
+ *    Params: type - the frame type expected in the current connection state
+ *            buf - receives the decrypted payload
+ *            flags - if not NULL, receives the header flags
+ *
+ *    Returns: true if a frame was retrieved, false if none is complete yet or it was dropped
+ *
+ *    Throws: runtime_error for unrecoverable issues
+ **********************************************************************************************/
+
+bool TCPConn::getSealedFrame(frametype type, std::vector<uint8_t> &buf, uint8_t *flags_out) {
+   uint8_t flags;
+   uint8_t nonce[nonce_size];
+   if (!takeSealedFrame(type, buf, nonce, flags))
+      return false;
+
+   uint8_t aad[2] = { (uint8_t) type, flags };
+
+   size_t len = buf.size() - tag_size;
+   if (!_opener.DecryptAndVerify(buf.data(), buf.data() + len, tag_size, nonce, nonce_size,
+                                 aad, sizeof(aad), buf.data(), len)) {
+      std::stringstream msg;
+      msg << "Frame from " << getNodeID() << " failed authentication. Disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
+      return false;
+   }
+
+   buf.resize(len);
+
+   if (flags_out != NULL)
+      *flags_out = flags;
+   return true;
 }
 
 /**********************************************************************************************
- * getCmdData - looks for a startcmd and endcmd and returns the data between the two 
+ * takeSealedFrame - gets the next frame like getFrame and checks it is sealed, but leaves it
+ *                   encrypted. Uses up the frame's nonce, so it must be opened with the one
+ *                   returned here. A frame that is not sealed drops the connection.
  *
- *    Params: buf = the string to search for the tags
- *            startcmd - the command at the beginning of the data sought
- *            endcmd - the command at the end of the data sought
+ *    Params: type - the frame type expected in the current connection state
+ *            buf - receives the sealed payload (ciphertext and tag)
+ *            nonce - receives the frame's nonce, nonce_size bytes
+ *            flags - receives the header flags
  *
- *    Returns: true if both start and end commands were found, false otherwise
+ *    Returns: true if a frame was retrieved, false if none is complete yet or it was dropped
  *
+ *    Throws: runtime_error for unrecoverable issues
  **********************************************************************************************/
 
-bool TCPConn::getCmdData(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd, 
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = buf;
-   auto start = findCmd(temp, startcmd);
-   auto end = findCmd(temp, endcmd);
+bool TCPConn::takeSealedFrame(frametype type, std::vector<uint8_t> &buf, uint8_t *nonce,
+                                                                          uint8_t &flags) {
+   if (!getFrame(type, buf, &flags))
+      return false;
 
-   if ((start == temp.end()) || (end == temp.end()) || (start == end))
+   if (!_session || !(flags & frame_sealed) || (buf.size() < tag_size)) {
+      std::stringstream msg;
+      msg << "Unsealed frame from " << getNodeID() << " on an encrypted session. Disconnecting.";
+      _server_log.writeLog(msg.str().c_str());
+      disconnect();
       return false;
+   }
 
-   buf.assign(start + startcmd.size(), end);
+   makeNonce(nonce, _session_client ? dir_server : dir_client, _recv_seq++);
    return true;
 }
 
 /**********************************************************************************************
- * wrapCmd - wraps the command brackets around the passed-in data
+ * openReplFrame - verifies and decrypts a replication frame taken off the socket sealed, in
+ *                 place, and strips its sequence header. Keys a GCM context per call, so any
+ *                 thread can open frames from any session.
  *
- *    Params: buf = the string to wrap around
- *            startcmd - the command at the beginning of the data
- *            endcmd - the command at the end of the data
+ *    Params: seal - the key, nonce and flags from getInputSeal
+ *            buf - the sealed frame from getInputData, receives the batch
+ *            epoch, first, last - receive the sender's epoch and sequence range
  *
+ *    Returns: false if the frame fails authentication or is too short to be replication data
  **********************************************************************************************/
 
-void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
-                                                    std::vector<uint8_t> &endcmd) {
-   std::vector<uint8_t> temp = startcmd;
-   temp.insert(temp.end(), buf.begin(), buf.end());
-   temp.insert(temp.end(), endcmd.begin(), endcmd.end());
+bool TCPConn::openReplFrame(const sealed_input &seal, std::vector<uint8_t> &buf,
+                            uint64_t &epoch, uint64_t &first, uint64_t &last) {
+   if (buf.size() < tag_size)
+      return false;
+
+   thread_local GCM<AES>::Decryption opener;
+   opener.SetKey(seal.key, seal.key.size());
+
+   uint8_t aad[2] = { (uint8_t) f_rep, seal.flags };
 
-   buf = temp;
+   size_t len = buf.size() - tag_size;
+   if (!opener.DecryptAndVerify(buf.data(), buf.data() + len, tag_size, seal.nonce, nonce_size,
+                                aad, sizeof(aad), buf.data(), len))
+      return false;
+
+   // <epoch><first seq><last seq><batch>
+   if (len < repl_hdr_size)
+      return false;
+
+   epoch = unpackU64(&buf[0]);
+   first = unpackU64(&buf[8]);
+   last = unpackU64(&buf[16]);
+   buf.resize(len);
+   buf.erase(buf.begin(), buf.begin() + repl_hdr_size);
+   return true;
 }
 
 
@@ -584,32 +1046,35 @@ void TCPConn::wrapCmd(std::vector<uint8_t> &buf, std::vector<uint8_t> &startcmd,
 
 void TCPConn::getInputData(std::vector<uint8_t> &buf) {
 
-   // Returns the replication data off this connection, then prepares it to be removed
-   buf = _inputbuf;
-
+   // Returns the replication data off this connection
+   buf = std::move(_inputbuf);
+   _inputbuf.clear();
    _data_ready = false;
-   _status = s_none;
+
+   // Go back to waiting for the next batch, or get removed if the other end already left
+   if (_connected)
+      _status = s_datarx;
+   else
+      _status = s_none;
 }
 
 /**********************************************************************************************
- * connect - Opens the socket FD, attempting to connect to the remote server
+ * connect - Opens the socket FD and starts connecting to the remote server without blocking.
+ *           The connection stays in s_connecting, watched for writability, until
+ *           finishConnect sees the connect complete.
  *
  *    Params:  ip_addr - ip address string to connect to
  *             port - port in host format to connect to
  *
- *    Throws: socket_error exception if failed. socket_error is a child class of runtime_error
+ *    Throws: socket_error exception if the connect fails outright. socket_error is a child
+ *            class of runtime_error
  **********************************************************************************************/
 
 void TCPConn::connect(const char *ip_addr, unsigned short port) {
+   unsigned long n_ip_addr;
 
-   // Set the status to connecting
-   _status = s_connecting;
-
-   // Try to connect
-   if (!_connfd.connectTo(ip_addr, port))
-      throw socket_error("TCP Connection failed!");
-
-   _connected = true;
+   inet_pton(AF_INET, ip_addr, &n_ip_addr);
+   connect(n_ip_addr, htons(port));
 }
 
 // Same as above, but ip_addr and port are in network (big endian) format
@@ -617,26 +1082,122 @@ void TCPConn::connect(unsigned long ip_addr, unsigned short port) {
    // Set the status to connecting
    _status = s_connecting;
 
+   // Start the connect without waiting on it, finishConnect picks it up once the reactor
+   // sees the socket turn writable
    if (!_connfd.connectTo(ip_addr, port))
       throw socket_error("TCP Connection failed!");
 
    _connected = true;
+   _connect_pending = true;
+}
+
+/**********************************************************************************************
+ * finishConnect - Client: checks on the connect started by connect(). A failed connect drops
+ *                 the connection and schedules the next attempt after the backoff delay.
+ *
+ *    Returns: true once connected (the handshake can start), false while still connecting
+ *             or if it failed
+ **********************************************************************************************/
+
+bool TCPConn::finishConnect() {
+   if (!_connect_pending)
+      return true;
+
+   int err = _connfd.checkConnect();
+   if (err == EINPROGRESS)
+      return false;
+
+   if (err != 0) {
+      std::stringstream msg;
+      msg << "Connect to SID " << getNodeID() << " failed: " << strerror(err);
+      _server_log.writeLog(msg.str().c_str());
+      if (_verbosity >= 2)
+         std::cout << msg.str() << "\n";
+
+      disconnect();
+      scheduleReconnect();
+      return false;
+   }
+
+   _connect_pending = false;
+   return true;
 }
 
 /**********************************************************************************************
- * assignOutgoingData - sets up the connection so that, at the next handleConnection, the data
- *                      is sent to the target server
+ * assignOutgoingData - queues a batch to be sent to the target server. An idle session sends it
+ *                      on the next handleConnection, otherwise it waits behind the frame in
+ *                      flight and goes out coalesced with anything else queued by then
+ *
+ *                      If the queue is over max_outqueue_bytes (a peer down for a long time),
+ *                      the oldest batches not in flight are dropped to make room. The caller
+ *                      is told which, so it can queue their contents again later.
  *
- *    Params:  data - the data stream to send to the server
+ *    Params:  data - the data stream to send to the server (<count><records>)
+ *             seq - the batch's sequence number, increasing with each batch to this server
+ *             dropped - the sequence numbers of any batches dropped are appended to this
  *
+ *    Returns: the number of plots dropped
  **********************************************************************************************/
 
-void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
+size_t TCPConn::assignOutgoingData(std::vector<uint8_t> &data, uint64_t seq,
+                                                            std::vector<uint64_t> &dropped) {
+   size_t dropped_plots = 0;
 
-   _outputbuf.clear();
-   _outputbuf = c_rep;
-   _outputbuf.insert(_outputbuf.end(), data.begin(), data.end());
-   _outputbuf.insert(_outputbuf.end(), c_endrep.begin(), c_endrep.end());
+   while ((_outqueue.size() > _inflight_batches) &&
+          (_outqueue_bytes + data.size() > max_outqueue_bytes)) {
+      auto oldest = _outqueue.begin() + _inflight_batches;
+
+      unsigned int count = 0;
+      if (oldest->second.size() >= sizeof(count))
+         memcpy(&count, oldest->second.data(), sizeof(count));
+      dropped_plots += count;
+      dropped.push_back(oldest->first);
+
+      _outqueue_bytes -= oldest->second.size();
+      _outqueue.erase(oldest);
+   }
+
+   _outqueue.emplace_back(seq, data);
+   _outqueue_bytes += data.size();
+   return dropped_plots;
+}
+
+/**********************************************************************************************
+ * sendAck - acks the replication batches received on this session through sequence number
+ *           last. The sender keeps one frame in flight, so this answers the frame received
+ *           most recently. If the session has dropped in the meantime, the ack is skipped
+ *           and the sender resends the frame on its next session.
+ *
+ **********************************************************************************************/
+
+void TCPConn::sendAck(uint64_t last) {
+   if (!_connected || !_session)
+      return;
+
+   std::vector<uint8_t> ack(sizeof(uint64_t));
+   packU64(ack.data(), last);
+
+   try {
+      sendSealedFrame(f_ack, ack);
+   } catch (socket_error &e) {
+      std::cout << "Socket error, disconnecting.\n";
+      disconnect();
+   }
+}
+
+/**********************************************************************************************
+ * scheduleReconnect - sets up a lost session to reconnect after the backoff delay, and doubles
+ *                     the delay for the next failure. A successful handshake resets it.
+ *
+ **********************************************************************************************/
+
+void TCPConn::scheduleReconnect() {
+   reconnect = time(NULL) + _backoff;
+   _status = s_connecting;
+
+   _backoff *= 2;
+   if (_backoff > max_reconnect_delay)
+      _backoff = max_reconnect_delay;
 }
  
 
@@ -647,7 +1208,16 @@ void TCPConn::assignOutgoingData(std::vector<uint8_t> &data) {
  **********************************************************************************************/
 void TCPConn::disconnect() {
    _connfd.closeFD();
+   _recvbuf.clear();
+   _recvbuf.shrink(recv_buf_size);
+   _sendbuf.clear();
+   _sendbuf.shrink(send_buf_size);
+   _writable = false;
+   _write_watched = false;
+   _connect_pending = false;
    _connected = false;
+   _session = false;
+   _peer_compress = false;
 }
 
 
@@ -673,22 +1243,16 @@ const char *TCPConn::getIPAddrStr(std::string &buf) {
 /**********************************************************************************************
  * genBytesForVerify - Generates a random "string" of bytes to be send when initial connection is made
  *
- * Source: https://en.cppreference.com/w/cpp/numeric/random
+ *      Uses the same per-thread seeded generator as the IVs
  *********************************************************************************************/
 void TCPConn::genBytesForVerify() {
-    // Setup random generator
 //    std::cout << "\n\n----Generating random bytes---\n\n";
-    std::random_device bar;
-    std::default_random_engine foo(bar());
-    std::uniform_int_distribution<int>  uniform_distribution(0, 255);
 
+    // Start fresh, a persistent session goes through the handshake again on every reconnect
     // Set the string length to 255 bytes
-//    this->_gennedAuthStr.resize(255, 0);
+    this->_gennedAuthStr.resize(255);
 
-    // Convert each position of the string to some random number
-    for(int i = 0; i < 255; i++){
-        _gennedAuthStr.emplace_back(uniform_distribution(foo));
-    }
+    ivPool().GenerateBlock(this->_gennedAuthStr.data(), this->_gennedAuthStr.size());
 }
 
 /**********************************************************************************************
@@ -700,24 +1264,14 @@ void TCPConn::genBytesForVerify() {
  **********************************************************************************************/
 void TCPConn::c_waitForRB(){
     // If data on the socket, should be our random byte authorization string from the host server
-    if(_connfd.hasData()){
+    std::vector<uint8_t> buf;
+    if(getFrame(f_auth, buf)){
 //        std::cout << "\n\n----(2) Client: Waiting for random bytes from server----\n\n";
-        std::vector<uint8_t> buf;
-
-        if(!getData(buf)) { return ;}
-        if(!getCmdData(buf, this->c_auth, this->c_endauth)){
-            std::stringstream msg;
-            msg << "The authorization string from the connecting client is invalid format. Cannot authenticate.";
-            this->_server_log.writeLog(msg.str().c_str());
-            disconnect();
-            return;
-        }
-
-        // Received good string
+        // Received good string, keep it to derive the session key
         // Encrypt and send the string
+        this->_peer_rb = buf;
         this->encryptData(buf);
-        this->wrapCmd(buf, c_auth, c_endauth);
-        this->sendData(buf);
+        sendFrame(f_auth, buf);
 
         // Status to wait for the SID
         this->_status = this->c_waitForSID;
@@ -732,21 +1286,13 @@ void TCPConn::c_waitForRB(){
  **********************************************************************************************/
  void TCPConn::c_waitSID(){
      // If data on the socket, should be the server's SID
-     if(_connfd.hasData()){
+     std::vector<uint8_t> buf;
+     uint8_t flags;
+     if(getFrame(f_sid, buf, &flags)){
 //         std::cout << "\n\n----(3) Client: Bytes good. Sending random bytes to server----\n\n";
-         std::vector<uint8_t> buf;
-
-         if(!getData(buf)) { return; }
-         if(!getCmdData(buf, this->c_sid, this->c_endsid)){
-             std::stringstream msg;
-             msg << "The SID from the server is invalid. Cannot connect";
-             this->_server_log.writeLog(msg.str().c_str());
-             disconnect();
-             return;
-         }
-
          std::string node(buf.begin(), buf.end());
          setNodeID(node.c_str());
+         this->_peer_compress = (flags & frame_compressed);
 
          // Received an acknowledgement, the SID, from the server
          // Generate and send our random byte string to authenticate them
@@ -754,8 +1300,7 @@ void TCPConn::c_waitForRB(){
 
          // Send our Random Byte number
          buf.assign(this->_gennedAuthStr.begin(), this->_gennedAuthStr.end());
-         this->wrapCmd(buf, this->c_auth, this->c_endauth);
-         sendData(buf);
+         sendFrame(f_auth, buf);
 
          // We now wait for the encrypted data to come back
          this->_status = c_waitForEBString;
@@ -771,19 +1316,9 @@ void TCPConn::c_waitForRB(){
 **********************************************************************************************/
 void TCPConn::c_waitForEB() {
     // If data on the socket, it should be the server's enrypted version of our _gennedAuthStr
-    if(_connfd.hasData()){
+    std::vector<uint8_t> buf;
+    if(getFrame(f_auth, buf)){
 //        std::cout << "\n\n----(4) Client: Verifying encrypted bytes----\n\n";
-        std::vector<uint8_t> buf;
-
-        if(!getData(buf)) { return; }
-        if(!getCmdData(buf, c_auth, c_endauth)){
-            std::stringstream msg;
-            msg << "Encrypted string from server is invalid. Cannot authenticate.";
-            this->_server_log.writeLog(msg.str().c_str());
-            disconnect();
-            return;
-        }
-
         // Check the decrypted string against what we originally sent.
         this->decryptData(buf);
         // If it matches, transmit data
@@ -791,21 +1326,22 @@ void TCPConn::c_waitForEB() {
         if(buf == this->_gennedAuthStr){
 //            std::cout << "\n\n\n***Client matched encrypted string correctly***\n\n\n";
 
-            // Send Replication data here
-            // Send the replication data
-            sendData(_outputbuf);
-
             if (_verbosity >= 3)
                 std::cout << "Successfully authenticated connection with " << getNodeID() <<
                           " and sending replication data.\n";
 
-            // Wait for their response
-            this->_status = s_waitack;
+            // Session is good, so the next failure starts the backoff over
+            this->_backoff = reconnect_delay;
+
+            // Both ends authenticated, key the session for the replication frames
+            this->startSession(true, this->_aes_key, this->_peer_rb, this->_gennedAuthStr);
+
+            // Send the queued replication data (if any) and wait for their response
+            this->sendNextBatch();
 
         }
         else{
-            // Reset state machine --> Do I need to set the flag to reset? May cause issue
-            this->_status = s_connecting;
+            // The server manager reschedules the session with backoff once it sees the drop
             this->disconnect();
         }
     }
@@ -822,19 +1358,9 @@ void TCPConn::c_waitForEB() {
 
 void TCPConn::s_waitForEB(){
     // If data on the socket, it should be the client's encrypted version of our _gennedAuthStr
-    if(_connfd.hasData()){
+    std::vector<uint8_t> buf;
+    if(getFrame(f_auth, buf)){
 //        std::cout << "\n\n----(2) Server: Received encrypted bytes from client. Verifying----\n\n";
-        std::vector<uint8_t> buf;
-
-        if(!getData(buf)) { return; }
-        if(!getCmdData(buf, c_auth, c_endauth)){
-            std::stringstream msg;
-            msg << "Encrypted string from client is invalid. Cannot authenticate.";
-            this->_server_log.writeLog(msg.str().c_str());
-            disconnect();
-            return;
-        }
-
         // Check if the decrypted string is what we originally sent
         // If match, wait for the client's random bytes string
         // Otherwise, do not connect
@@ -843,10 +1369,9 @@ void TCPConn::s_waitForEB(){
         if(buf == this->_gennedAuthStr){
 //            std::cout << "\n\n\n***Server matched encrypted string correctly***\n\n\n";
 
-            // Send our SID for an ack purpose
+            // Send our SID for an ack purpose, letting them know we take compressed batches
             buf.assign(this->_svr_id.begin(), this->_svr_id.end());
-            this->wrapCmd(buf, c_sid, c_endsid);
-            sendData(buf);
+            sendFrame(f_sid, buf, frame_compressed);
 
             this->_status = s_waitForRBString;
         }
@@ -867,24 +1392,116 @@ void TCPConn::s_waitForEB(){
  **********************************************************************************************/
  void TCPConn::s_waitForRB() {
      // If data on socket, it should be the client's random byte string
-     if(_connfd.hasData()){
+     std::vector<uint8_t> buf;
+     if(getFrame(f_auth, buf)){
 //         std::cout << "\n\n----(3) Server: Waiting for random bytes from client----\n\n";
-         std::vector<uint8_t> buf;
-
-         if(!getData(buf)) { return; }
-         if(!getCmdData(buf, c_auth, c_endauth)){
-             std::stringstream msg;
-             msg << "Random Byte string from client is invalid. Cannot authenticate.";
-             this->_server_log.writeLog(msg.str().c_str());
-             disconnect();
-             return;
-         }
+         // Both ends authenticated once this goes back, key the session for replication
+         this->startSession(false, this->_aes_key, this->_gennedAuthStr, buf);
 
-         // Encrypt the string, wrap, send back
+         // Encrypt the string, send back
          this->encryptData(buf);
-         this->wrapCmd(buf, c_auth, c_endauth);
-         this->sendData(buf);
+         sendFrame(f_auth, buf);
 
          this->_status = s_datarx;
      }
- }
\ No newline at end of file
+ }
+/**********************************************************************************************
+ * s_resume() - A reconnecting client sent a session ticket instead of its SID
+ *      If the ticket is in our cache (unexpired, issued to this SID), sends our random bytes and
+ *      SID back and keys the new session from the ticket's secret, going straight to waiting
+ *      for data. Holding the secret is the proof on both sides - the first sealed frame either
+ *      way only verifies if the other end derived the same key.
+ *      Otherwise sends our random bytes for the full handshake, just as for a SID.
+ **********************************************************************************************/
+
+void TCPConn::s_resume() {
+    std::vector<uint8_t> buf;
+    if (!getFrame(f_resume, buf))
+        return;
+
+    if (buf.size() < ticket_id_size + resume_rb_size) {
+        std::stringstream msg;
+        msg << "Invalid session ticket from " << getNodeID() << ". Disconnecting.";
+        _server_log.writeLog(msg.str().c_str());
+        disconnect();
+        return;
+    }
+
+    // <ticket ID><random bytes><SID>
+    std::vector<uint8_t> ticket_id(buf.begin(), buf.begin() + ticket_id_size);
+    std::vector<uint8_t> client_rb(buf.begin() + ticket_id_size,
+                                   buf.begin() + ticket_id_size + resume_rb_size);
+    std::string node(buf.begin() + ticket_id_size + resume_rb_size, buf.end());
+    setNodeID(node.c_str());
+
+    SecByteBlock secret;
+    if (!_tickets.take(ticket_id, _node_id, secret)) {
+        if (_verbosity >= 3)
+            std::cout << "Session ticket from " << getNodeID() << " not valid, full handshake.\n";
+
+        this->genBytesForVerify();
+        buf.assign(this->_gennedAuthStr.begin(), this->_gennedAuthStr.end());
+        sendFrame(f_auth, buf);
+
+        this->_status = s_waitForEBString;
+        return;
+    }
+
+    std::vector<uint8_t> server_rb(resume_rb_size);
+    ivPool().GenerateBlock(server_rb.data(), server_rb.size());
+    this->startSession(false, secret, server_rb, client_rb);
+
+    // <random bytes><SID>
+    buf = server_rb;
+    buf.insert(buf.end(), _svr_id.begin(), _svr_id.end());
+    sendFrame(f_resumed, buf, frame_compressed);
+
+    if (_verbosity >= 3)
+        std::cout << "Resumed session with " << getNodeID() << ".\n";
+
+    this->_status = s_datarx;
+}
+
+/**********************************************************************************************
+ * c_waitResumed() - The client sent its session ticket
+ *      If the server resumes, keys the new session from the ticket's secret and sends the
+ *      queued replication data. If it answers with random bytes instead, it did not accept the
+ *      ticket and we carry on with the full handshake from c_waitForRB.
+ **********************************************************************************************/
+
+void TCPConn::c_waitResumed() {
+    if (!fillRecvBuf())
+        return;
+
+    if (nextFrameIs(f_auth)) {
+        this->_status = c_waitForRBString;
+        this->c_waitForRB();
+        return;
+    }
+
+    std::vector<uint8_t> buf;
+    uint8_t flags;
+    if (getFrame(f_resumed, buf, &flags)) {
+        if (buf.size() < resume_rb_size) {
+            std::stringstream msg;
+            msg << "Invalid resume response from " << getNodeID() << ". Disconnecting.";
+            _server_log.writeLog(msg.str().c_str());
+            disconnect();
+            return;
+        }
+
+        // <random bytes><SID>
+        std::vector<uint8_t> server_rb(buf.begin(), buf.begin() + resume_rb_size);
+        std::string node(buf.begin() + resume_rb_size, buf.end());
+        setNodeID(node.c_str());
+        this->_peer_compress = (flags & frame_compressed);
+
+        this->startSession(true, this->_resume_secret, server_rb, this->_gennedAuthStr);
+        this->_backoff = reconnect_delay;
+
+        if (_verbosity >= 3)
+            std::cout << "Resumed session with " << getNodeID() << " and sending replication data.\n";
+
+        this->sendNextBatch();
+    }
+}
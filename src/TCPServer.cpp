@@ -1,11 +1,13 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdexcept>
 #include <strings.h>
+#include <errno.h>
 #include <vector>
 #include <iostream>
 #include <memory>
@@ -19,13 +21,17 @@
 TCPServer::TCPServer(unsigned int verbosity)
                         :_aes_key(CryptoPP::AES::DEFAULT_KEYLENGTH), 
                          _server_log("server.log", 0),
-                         _verbosity(verbosity)
+                         _verbosity(verbosity),
+                         _accept_ready(false),
+                         _whitelist("whitelist")
 {
+   if ((_epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      throw socket_error("Unable to create the epoll instance for the server.");
 }
 
 
 TCPServer::~TCPServer() {
-
+   close(_epollfd);
 }
 
 /**********************************************************************************************
@@ -57,6 +63,17 @@ void TCPServer::bindSvr(const char *ip_addr, short unsigned int port) {
 void TCPServer::listenSvr() {
    _sockfd.listenFD(5);
 
+   // Watch the server socket edge-triggered, handleSocket accepts until the backlog is empty.
+   // A NULL data pointer marks it apart from the connections
+   epoll_event ev;
+   ev.events = EPOLLIN | EPOLLET;
+   ev.data.ptr = NULL;
+   if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, _sockfd.getFD(), &ev) == -1)
+      throw socket_error("Unable to add the server socket to epoll.");
+
+   // Connections may already be waiting, which would not produce a new edge
+   _accept_ready = true;
+
    std::string ipaddr_str;
    std::stringstream msg;
    _sockfd.getIPAddrStr(ipaddr_str);
@@ -74,20 +91,17 @@ void TCPServer::listenSvr() {
 
 void TCPServer::runServer() {
    bool online = true;
-   timespec sleeptime;
-   sleeptime.tv_sec = 0;
-   sleeptime.tv_nsec = 100000000;
 
    // Start the server socket listening
    listenSvr();
 
    while (online) {
+      // Sleeps in epoll until there is something to do
+      pollEvents();
+
       handleSocket();
 
       handleConnections();
-
-      // So we're not chewing up CPU cycles unnecessarily
-      nanosleep(&sleeptime, NULL);
    } 
 
 
@@ -95,37 +109,138 @@ void TCPServer::runServer() {
 }
 
 /**********************************************************************************************
- * handleSocket - Checks the socket for incoming connections and validates against the whitelist.
- *                Accepts valid connections and adds them to the connection list.
+ * pollEvents - waits on the epoll instance for socket activity. Readable connections are
+ *              flagged for handleConnections and a ready server socket for handleSocket.
+ *
+ *    Params:  timeout_ms - longest to block if nothing is ready. Ignored (no blocking) if a
+ *                          connection already has work queued
+ *
+ *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
+ **********************************************************************************************/
+
+void TCPServer::pollEvents(int timeout_ms) {
+   const int max_events = 64;
+   epoll_event events[max_events];
+
+   // Don't sleep if a connection has something to send
+   for (auto tptr = _connlist.begin(); tptr != _connlist.end(); tptr++) {
+      if ((*tptr)->hasPendingWork() || (*tptr)->isReadable()) {
+         timeout_ms = 0;
+         break;
+      }
+   }
+
+   int n = epoll_wait(_epollfd, events, max_events, timeout_ms);
+   if (n == -1) {
+      if (errno == EINTR)
+         return;
+      throw socket_error("epoll_wait failed on the server.");
+   }
+
+   for (int i=0; i<n; i++) {
+      if (events[i].data.ptr == NULL)
+         _accept_ready = true;
+      else if (events[i].data.ptr == &_wake_fds) {
+         // Whichever one was signaled, reading the others just finds them empty
+         for (int fd : _wake_fds) {
+            uint64_t count;
+            if (read(fd, &count, sizeof(count)) == -1) {
+               // Already drained, nothing to do
+            }
+         }
+      } else {
+         TCPConn *conn = static_cast<TCPConn *>(events[i].data.ptr);
+         if (events[i].events & EPOLLOUT)
+            conn->setWritable();
+         if (events[i].events & ~EPOLLOUT)
+            conn->setReadable();
+      }
+   }
+}
+
+/**********************************************************************************************
+ * watchWakeFD - registers a wakeup eventfd with the reactor. All of them share one marker, so
+ *               they must be nonblocking for pollEvents to drain them together.
+ *
+ *    Throws: socket_error if the fd could not be added
+ **********************************************************************************************/
+
+void TCPServer::watchWakeFD(int fd) {
+   epoll_event ev;
+   ev.events = EPOLLIN;
+   ev.data.ptr = &_wake_fds;
+
+   if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+      throw socket_error("Unable to add the wakeup fd to epoll.");
+   _wake_fds.push_back(fd);
+}
+
+/**********************************************************************************************
+ * watchConn - registers a connection's socket with the reactor. Sockets are dropped from the
+ *             epoll set automatically when closed, so this is called again after a reconnect.
+ *             Also called to add or remove EPOLLOUT as the connection's unsent output comes
+ *             and goes, so a full socket wakes the reactor once it has room rather than the
+ *             reactor waiting on it.
  *
- *    Returns: pointer to a new connection if one was found, otherwise NULL
+ *    Throws: socket_error if the socket could not be added
+ **********************************************************************************************/
+
+void TCPServer::watchConn(TCPConn *conn) {
+   epoll_event ev;
+   ev.events = EPOLLIN | EPOLLRDHUP;
+   if (conn->hasPendingOutput())
+      ev.events |= EPOLLOUT;
+   ev.data.ptr = conn;
+
+   if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, conn->getFD(), &ev) == -1) {
+      if ((errno != EEXIST) || (epoll_ctl(_epollfd, EPOLL_CTL_MOD, conn->getFD(), &ev) == -1))
+         throw socket_error("Unable to add a connection to epoll.");
+   }
+   conn->setWriteWatched(conn->hasPendingOutput());
+}
+
+/**********************************************************************************************
+ * handleSocket - Accepts all the connections waiting on the socket, validating each against the 
+ *                whitelist. Accepts valid connections and adds them to the connection list.
+ *                The server socket is edge-triggered, so this drains it until accept would block.
+ *
+ *    Returns: number of new connections accepted
  *
  *    Throws: socket_error for recoverable errors, runtime_error for unrecoverable types
  **********************************************************************************************/
 
-TCPConn *TCPServer::handleSocket() {
-  
-   // The socket has data, means a new connection 
-   if (_sockfd.hasData()) {
+unsigned int TCPServer::handleSocket() {
+   unsigned int count = 0;
+
+   if (!_accept_ready)
+      return 0;
+
+   while (true) {
 
       // Try to accept the connection
-      TCPConn *new_conn = new TCPConn(_server_log, _aes_key, _verbosity);
+      std::unique_ptr<TCPConn> new_conn(new TCPConn(_server_log, _aes_key, _tickets, _verbosity));
       if (!new_conn->accept(_sockfd)) {
+         // Backlog is empty, wait for the next edge
+         if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            _accept_ready = false;
+            break;
+         }
+         if (errno == EINTR)
+            continue;
+
          _server_log.strerrLog("Data received on socket but failed to accept.");
-         return NULL;
+         _accept_ready = false;
+         break;
       }
       std::cout << "***Got a connection***\n";
 
-      _connlist.push_back(std::unique_ptr<TCPConn>(new_conn));
-
       // Get their IP Address string to use in logging
       std::string ipaddr_str;
       new_conn->getIPAddrStr(ipaddr_str);
 
 
       // Check the whitelist
-      ALMgr al("whitelist");
-      if (!al.isAllowed(new_conn->getIPAddr()))
+      if (!_whitelist.isAllowed(new_conn->getIPAddr()))
       {
          // Disconnect the user
          new_conn->disconnect();
@@ -136,7 +251,7 @@ TCPConn *TCPServer::handleSocket() {
          msg += "' not on whitelist. Disconnecting.";
          _server_log.writeLog(msg);
 
-         return NULL;
+         continue;
       }
 
       std::string msg = "Connection from IP address '";
@@ -144,12 +259,11 @@ TCPConn *TCPServer::handleSocket() {
       msg += "'.";
       _server_log.writeLog(msg);
 
-      // Send an authentication string in cleartext
-            
-
-      return new_conn;
+      watchConn(new_conn.get());
+      _connlist.push_back(std::move(new_conn));
+      count++;
    }
-   return NULL;
+   return count;
 }
 
 /**********************************************************************************************
@@ -168,6 +282,18 @@ void TCPServer::handleConnections() {
    {
       // If the client is not connected, then either reconnect or drop 
       if ((!(*tptr)->isConnected()) || ((*tptr)->getStatus() == TCPConn::s_none)) {
+         // A persistent peer session that just dropped gets reconnected after a backoff delay
+         if ((*tptr)->isPersistent() && ((*tptr)->getStatus() != TCPConn::s_connecting)) {
+            (*tptr)->scheduleReconnect();
+
+            std::stringstream msg;
+            msg << "Session to SID " << (*tptr)->getNodeID() << " lost, reconnecting in " <<
+                     ((*tptr)->reconnect - time(NULL)) << " secs.";
+            _server_log.writeLog(msg.str().c_str());
+            tptr++;
+            continue;
+         }
+
          // Might be trying to connect
          if ((*tptr)->getStatus() == TCPConn::s_connecting) {
 
@@ -178,11 +304,12 @@ void TCPServer::handleConnections() {
             }
 
             unsigned long ip_addr = (*tptr)->getIPAddr();
-            unsigned short port = (*tptr)->getPort();
+            unsigned short port = htons((*tptr)->getPort());  // connect wants network format
             
             // Try to connect and handle failure
             try {
                (*tptr)->connect(ip_addr, port);
+               watchConn(tptr->get());
             } catch (socket_error &e) {
                std::stringstream msg;
                msg << "Connect to SID " << (*tptr)->getNodeID() << 
@@ -191,7 +318,7 @@ void TCPServer::handleConnections() {
                   std::cout << msg.str() << "\n";
                _server_log.writeLog(msg.str().c_str());
                (*tptr)->disconnect();
-               (*tptr)->reconnect = time(NULL) + reconnect_delay;
+               (*tptr)->scheduleReconnect();
                tptr++;
                continue;
             }
@@ -212,8 +339,13 @@ void TCPServer::handleConnections() {
          continue;
       } 
 
-      // Process any user inputs
-      (*tptr)->handleConnection();
+      // Process any user inputs, skipping connections with no input and nothing to send
+      if ((*tptr)->isReadable() || (*tptr)->hasPendingWork())
+         (*tptr)->handleConnection();
+
+      // Watch for room on the socket only while there is output waiting for it
+      if ((*tptr)->isConnected() && ((*tptr)->hasPendingOutput() != (*tptr)->isWriteWatched()))
+         watchConn(tptr->get());
 
       // Increment our iterator
       tptr++;
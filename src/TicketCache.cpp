@@ -0,0 +1,80 @@
+#include <algorithm>
+#include "TicketCache.h"
+
+TicketCache::TicketCache(time_t ttl):_ttl(ttl) {
+
+}
+
+
+TicketCache::~TicketCache() {
+
+}
+
+/**********************************************************************************************
+ * store - adds a ticket to the cache, expiring ttl seconds from now
+ *
+ *    Params: id - the ticket ID both ends derived
+ *            secret - the resumption secret for the ticket
+ *            node_id - the server ID of the client the ticket was issued to
+ *
+ **********************************************************************************************/
+
+void TicketCache::store(const std::vector<uint8_t> &id, const CryptoPP::SecByteBlock &secret,
+                                                        const std::string &node_id) {
+   time_t now = time(NULL);
+
+   ticket &t = _tickets[id];
+   t.secret = secret;
+   t.node_id = node_id;
+   t.expires = now + _ttl;
+
+   prune(now);
+}
+
+/**********************************************************************************************
+ * take - looks up a ticket presented by a reconnecting client. A ticket is only good once, so
+ *        it is removed whether or not it checks out.
+ *
+ *    Params: id - the ticket ID presented
+ *            node_id - the server ID the client claims
+ *            secret - receives the resumption secret
+ *
+ *    Returns: true if the ticket was found, unexpired and issued to node_id
+ **********************************************************************************************/
+
+bool TicketCache::take(const std::vector<uint8_t> &id, const std::string &node_id,
+                                                       CryptoPP::SecByteBlock &secret) {
+   auto tptr = _tickets.find(id);
+   if (tptr == _tickets.end())
+      return false;
+
+   bool valid = (tptr->second.expires > time(NULL)) && (tptr->second.node_id == node_id);
+   if (valid)
+      secret = tptr->second.secret;
+
+   _tickets.erase(tptr);
+   return valid;
+}
+
+/**********************************************************************************************
+ * prune - drops expired tickets, then the ones closest to expiring if the cache is still
+ *         holding more than max_tickets
+ *
+ **********************************************************************************************/
+
+void TicketCache::prune(time_t now) {
+   for (auto tptr = _tickets.begin(); tptr != _tickets.end(); ) {
+      if (tptr->second.expires <= now)
+         tptr = _tickets.erase(tptr);
+      else
+         tptr++;
+   }
+
+   while (_tickets.size() > max_tickets) {
+      auto oldest = std::min_element(_tickets.begin(), _tickets.end(),
+                        [](const std::pair<const std::vector<uint8_t>, ticket> &a,
+                           const std::pair<const std::vector<uint8_t>, ticket> &b) {
+                           return a.second.expires < b.second.expires; });
+      _tickets.erase(oldest);
+   }
+}
@@ -9,24 +9,13 @@ handleDuplication::handleDuplication(DronePlotDB &plotDB) : _plotDB(plotDB) {}
 handleDuplication::~handleDuplication() {}
 
 /*********************************************************************************************
- * findDuplicates - This iterates over the stored DronePlotDB object and looks for duplicates.
- *      If one is found, the index is stored in the duplicateIndices list
+ * findDuplicates - Asks the DronePlotDB for every plot that duplicates an earlier one. The DB
+ *      does this in a single hashed pass, so it stays linear on large databases. The handles
+ *      found are stored in the duplicateHandles list
  *
  *********************************************************************************************/
 void handleDuplication::findDuplicates() {
-    int i_index = 0;
-//    this->duplicateIndices.clear(); // Reset Var. Do not do if checking once
-
-    for(auto i = this->_plotDB.begin(); i != this->_plotDB.end(); i++){
-        for(auto j = std::next(i, 1); j != this->_plotDB.end(); j++){
-            // Check if: Lat's are same, Long's are same, Drone ID's are same, and Node ID's are different
-            if( (i->drone_id == j->drone_id) && (i->node_id != j->node_id) && (i->latitude == j->latitude) && (i->longitude == j->longitude)){
-                this->duplicateIndices.push_back((i_index));
-                break;
-            }
-        }
-        i_index++;
-    }
+    this->_plotDB.findDuplicates(this->duplicateHandles);
 }
 
 /*********************************************************************************************
@@ -42,10 +31,13 @@ void handleDuplication::findDuplicates() {
  *
  *********************************************************************************************/
 void handleDuplication::deleteDuplicates() {
-    // Iterate over the list
-    for(int i = 0; i < this->duplicateIndices.size(); i++){
-        this->_plotDB.erase(i);
+    // Handles are stable across erases, so each one can be removed directly. The other
+    // threads may still be adding plots, so the check that it is still there is done under
+    // the database mutex
+    for(auto handle : this->duplicateHandles){
+        this->_plotDB.eraseIfValid(handle);
     }
+    this->duplicateHandles.clear();
 }
 
 /*********************************************************************************************
@@ -65,6 +65,7 @@ void displayHelp(const char *execname) {
    std::cout << "   o: the file to write the DB dump CSV to (default: replication_db.cv)\n";
    std::cout << "   d: duration - seconds in \"sim time\" to run the sim\n";
    std::cout << "   v: verbosity - how much information to send to stdout (0-3, 3=max)\n";
+   std::cout << "   r: retention - sim seconds of plots to keep (default: 0, keep all)\n";
 }
 
 
@@ -75,6 +76,7 @@ int main(int argc, char *argv[]) {
    float time_mult = 1.0;
    unsigned int verbosity = 0;
    int sim_time = 900; // Default 900 seconds
+   long retention = 0; // Default keep everything
    std::string ip_addr = "127.0.0.1";
    unsigned short port = 9999;
 
@@ -87,7 +89,7 @@ int main(int argc, char *argv[]) {
    // will appear in case 1
    unsigned long portval;
    int c = 0;
-   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:")) != -1) {
+   while ((c = getopt(argc, argv, "-o:t:v:d:p:a:r:")) != -1) {
       switch (c) {
 
       // The inject database file specified in the command line
@@ -138,6 +140,15 @@ int main(int argc, char *argv[]) {
          }
          break;
 
+      // Sim seconds of plots to keep
+      case 'r':
+         retention = strtol(optarg, NULL, 10);
+         if (retention < 0) {
+            std::cerr << "Invalid retention. Must be >= 0.\n";
+            exit(0);
+         }
+         break;
+
       // IP address to attempt to bind to
       case 'o':
          outfile = optarg;
@@ -174,6 +185,7 @@ int main(int argc, char *argv[]) {
 
    // Start the replication server
    ReplServer repl_server(db, ip_addr.c_str(), port, sim.getOffset(), time_mult, verbosity); 
+   repl_server.setRetention(retention);
 
    pthread_t replthread;
    if (pthread_create(&replthread, NULL, t_replserver, (void *) &repl_server) != 0)
@@ -192,10 +204,9 @@ int main(int argc, char *argv[]) {
    pthread_join(simthread, NULL);
    pthread_join(replthread, NULL);
 
-   // Write the replication database to a CSV file
+   // Write the replication database to a CSV file in time order
    std::cout << "Writing results to: " << outfile << "\n";
-   db.sortByTime();
-   db.writeCSVFile(outfile.c_str());
+   db.writeCSVFile(outfile.c_str(), true);
    
    return 0;
 }
@@ -21,6 +21,10 @@ void clrNewlines(std::string &str) {
  *******************************************************************************************/
 void clrSpaces(std::string &str) {
    const auto begin = str.find_first_not_of(" ");
+   if (begin == std::string::npos) {
+      str.clear();
+      return;
+   }
    
    const auto end = str.find_last_not_of(" ");
    str = str.substr(begin, end - begin + 1);